@@ -7,6 +7,7 @@
 
 #include "LoxCANBaseDriver.hpp"
 #include "LoxExtension.hpp"
+#include "LoxNATFragmentReassembly.hpp"
 #if DEBUG
 #include <__cross_studio_io.h>
 #endif
@@ -15,7 +16,9 @@
 /***
  *  constructor
  ***/
-LoxCANBaseDriver::LoxCANBaseDriver(tLoxCANDriverType type) : driverType(type), extensionCount(0) {
+LoxCANBaseDriver::LoxCANBaseDriver(tLoxCANDriverType type) : driverType(type), extensionCount(0), filterActive(false), filterRequestCount(0) {
+  static_assert(MAX_EXTENSIONS <= 32, "the routing uses 32-bit masks");
+  RouteUpdate();
 }
 
 /***
@@ -24,6 +27,9 @@ LoxCANBaseDriver::LoxCANBaseDriver(tLoxCANDriverType type) : driverType(type), e
 void LoxCANBaseDriver::Startup(void) {
   for (int i = 0; i < this->extensionCount; ++i)
     this->extensions[i]->Startup();
+  // setup the hardware filters for all filters requested so far
+  this->filterActive = true;
+  FilterUpdate();
 }
 
 /***
@@ -33,22 +39,161 @@ void LoxCANBaseDriver::AddExtension(LoxExtension *extension) {
   if (this->extensionCount == sizeof(this->extensions) / sizeof(this->extensions[0]))
     return;
   this->extensions[this->extensionCount++] = extension;
+  RouteUpdate();
 }
 
 /***
  *  Setup a NAT filter
  ***/
-void LoxCANBaseDriver::FilterSetupNAT(int filterIndex, LoxCmdNATBus_t busType, uint8_t extensionNAT) {
+void LoxCANBaseDriver::FilterSetupNAT(const LoxExtension *owner, int filterIndex, LoxCmdNATBus_t busType, uint8_t extensionNAT) {
   LoxCanMessage msg;
   msg.busType = busType;
   msg.directionNat = LoxCmdNATDirection_t_fromServer;
   msg.extensionNat = extensionNAT;
-  FilterSetup(filterIndex, msg.identifier, 0x1F2FF000, 0);
+  FilterRequest(owner, filterIndex, msg.identifier, FILTER_MASK_NAT, extensionNAT != 0xFF);
 #if DEBUG && 0
-  debug_printf("Filter #%d mask:%08x value:%08x\n", filterIndex, 0x1F2FF000, msg.identifier);
+  debug_printf("Filter #%d mask:%08x value:%08x\n", filterIndex, FILTER_MASK_NAT, msg.identifier);
 #endif
 }
 
+/***
+ *  Request a filter for an extension. A previous filter with the same slot is replaced.
+ ***/
+void LoxCANBaseDriver::FilterRequest(const LoxExtension *owner, int slot, uint32_t filterId, uint32_t filterMaskId, bool directed) {
+  filterId &= filterMaskId;
+  int i;
+  for (i = 0; i < this->filterRequestCount; ++i) {
+    if (this->filterRequests[i].owner == owner && this->filterRequests[i].slot == slot)
+      break;
+  }
+  if (i == this->filterRequestCount) {
+    if (this->filterRequestCount == MAX_FILTER_REQUESTS)
+      return;
+    ++this->filterRequestCount;
+  } else if (this->filterRequests[i].filterId == filterId && this->filterRequests[i].filterMaskId == filterMaskId && this->filterRequests[i].directed == directed) {
+    return; // unchanged
+  }
+  this->filterRequests[i].owner = owner;
+  this->filterRequests[i].slot = slot;
+  this->filterRequests[i].filterId = filterId;
+  this->filterRequests[i].filterMaskId = filterMaskId;
+  this->filterRequests[i].directed = directed;
+  RouteUpdate();
+  if (this->filterActive)
+    FilterUpdate();
+}
+
+/***
+ *  Release a filter of an extension
+ ***/
+void LoxCANBaseDriver::FilterRelease(const LoxExtension *owner, int slot) {
+  for (int i = 0; i < this->filterRequestCount; ++i) {
+    if (this->filterRequests[i].owner == owner && this->filterRequests[i].slot == slot) {
+      this->filterRequests[i] = this->filterRequests[--this->filterRequestCount];
+      RouteUpdate();
+      if (this->filterActive)
+        FilterUpdate();
+      return;
+    }
+  }
+}
+
+/***
+ *  Check if an identifier was requested by any extension
+ ***/
+bool LoxCANBaseDriver::FilterIsRequested(uint32_t identifier) const {
+  for (int i = 0; i < this->filterRequestCount; ++i) {
+    if ((identifier & this->filterRequests[i].filterMaskId) == this->filterRequests[i].filterId)
+      return true;
+  }
+  return false;
+}
+
+/***
+ *  Index of an extension in extensions[] or -1
+ ***/
+int LoxCANBaseDriver::ExtensionIndex(const LoxExtension *extension) const {
+  for (int i = 0; i < this->extensionCount; ++i)
+    if (this->extensions[i] == extension)
+      return i;
+  return -1;
+}
+
+/***
+ *  Rebuild the routing tables from the filter requests of all extensions
+ ***/
+void LoxCANBaseDriver::RouteUpdate(void) {
+  this->routeUnfiltered = (this->extensionCount == 32) ? 0xFFFFFFFF : (1u << this->extensionCount) - 1;
+  this->routeNATBroadcast = 0;
+  this->routeNATAll = 0;
+  this->routeLegacyBroadcast = 0;
+  this->routeLegacyAll = 0;
+  memset(this->routeNAT, ROUTE_NONE, sizeof(this->routeNAT));
+  for (int i = 0; i < ROUTE_LEGACY_SIZE; ++i)
+    this->routeLegacy[i].identifier = 0xFFFFFFFF;
+
+  for (int r = 0; r < this->filterRequestCount; ++r) {
+    const tLoxCANFilterRequest &request = this->filterRequests[r];
+    int index = ExtensionIndex(request.owner);
+    if (index < 0)
+      continue;
+    this->routeUnfiltered &= ~(1u << index);
+    if (request.filterMaskId == FILTER_MASK_NAT) {
+      this->routeNATAll |= 1u << index;
+      uint8_t nat = request.filterId >> 12;
+      if (nat == 0xFF)
+        this->routeNATBroadcast |= 1u << index;
+      else
+        this->routeNAT[nat] = (this->routeNAT[nat] == ROUTE_NONE || this->routeNAT[nat] == index) ? index : ROUTE_SEVERAL;
+    } else {
+      this->routeLegacyAll |= 1u << index;
+      if (request.filterMaskId != FILTER_MASK_EXACT) // masked requests are checked in RouteLegacy()
+        continue;
+      if (request.filterId == 0x00000000) {
+        this->routeLegacyBroadcast |= 1u << index;
+        continue;
+      }
+      for (uint32_t h = request.filterId;; ++h) {
+        h &= ROUTE_LEGACY_SIZE - 1;
+        if (this->routeLegacy[h].identifier == 0xFFFFFFFF) {
+          this->routeLegacy[h].identifier = request.filterId;
+          this->routeLegacy[h].index = index;
+          break;
+        }
+        if (this->routeLegacy[h].identifier == request.filterId) {
+          if (this->routeLegacy[h].index != index)
+            this->routeLegacy[h].index = ROUTE_SEVERAL;
+          break;
+        }
+      }
+    }
+  }
+}
+
+/***
+ *  Find all extensions, which requested a legacy identifier
+ ***/
+uint32_t LoxCANBaseDriver::RouteLegacy(uint32_t identifier) const {
+  for (uint32_t h = identifier;; ++h) {
+    h &= ROUTE_LEGACY_SIZE - 1;
+    if (this->routeLegacy[h].identifier == identifier)
+      return (this->routeLegacy[h].index == ROUTE_SEVERAL) ? this->routeLegacyAll : 1u << this->routeLegacy[h].index;
+    if (this->routeLegacy[h].identifier == 0xFFFFFFFF)
+      break;
+  }
+  // not a single identifier, e.g. a legacy firmware update
+  uint32_t receivers = 0;
+  for (int r = 0; r < this->filterRequestCount; ++r) {
+    const tLoxCANFilterRequest &request = this->filterRequests[r];
+    if (request.filterMaskId != FILTER_MASK_EXACT && request.filterMaskId != FILTER_MASK_NAT && (identifier & request.filterMaskId) == request.filterId) {
+      int index = ExtensionIndex(request.owner);
+      if (index >= 0)
+        receivers |= 1u << index;
+    }
+  }
+  return receivers;
+}
+
 /***
  *  CAN error reporting and statistics
  ***/
@@ -62,14 +207,81 @@ void LoxCANBaseDriver::StatisticsPrint() const {
   debug_printf("HWE:%d;", this->statistics.HWE);
   debug_printf("TQ:%d;", this->statistics.TQ);
   debug_printf("mTQ:%d;", this->statistics.mTQ);
+  for (int i = 0; i < eTransmitClass_count; ++i)
+    debug_printf("TQ%d:%d/%d/%dms;", i, this->statistics.TC[i].TQ, this->statistics.TC[i].mTQ, this->statistics.TC[i].mWait);
   debug_printf("QOvf:%d;", this->statistics.QOvf);
+  debug_printf("ROvf:%d;", this->statistics.ROvf);
+  debug_printf("FOVR0:%d;", this->statistics.FOVR0);
+  debug_printf("FOVR1:%d;", this->statistics.FOVR1);
   debug_printf("RQ:%d;", this->statistics.RQ);
-  debug_printf("mRQ:%d;\n", this->statistics.mRQ);
+  debug_printf("mRQ:%d;", this->statistics.mRQ);
+  debug_printf("FBk:%d;", this->statistics.FBk);
+  debug_printf("FMrg:%d;", this->statistics.FMrg);
+  debug_printf("FLk:%d;", this->statistics.FLk);
+  debug_printf("mRxStall:%dms;", this->statistics.mRxStall);
+  debug_printf("RxCyc:%d;", this->statistics.RxCyc);
+  debug_printf("mRxCyc:%d;\n", this->statistics.mRxCyc);
+}
+
+/***
+ *  Cycle count of a receive interrupt, which forwarded messageCount messages
+ ***/
+void LoxCANBaseDriver::StatisticsReceiveCycles(uint32_t cycles, unsigned messageCount) {
+  if (messageCount)
+    this->statistics.RxCyc = cycles / messageCount;
+  if (cycles > this->statistics.mRxCyc)
+    this->statistics.mRxCyc = cycles;
 }
 #endif
 
 void LoxCANBaseDriver::StatisticsReset() {
+  uint32_t filterBanks = this->statistics.FBk; // the filter setup is not a counter
+  uint32_t filterMerged = this->statistics.FMrg;
   memset(&this->statistics, 0, sizeof(this->statistics));
+  this->statistics.FBk = filterBanks;
+  this->statistics.FMrg = filterMerged;
+}
+
+/***
+ *  Transmit class of a message: fragmented packages are bulk, values are sent
+ *  behind the protocol messages (alive, ping/pong, NAT assignment, crypto handshake, etc).
+ *  The encrypted commands never wait behind values or get coalesced with them.
+ ***/
+eTransmitClass LoxCANBaseDriver::TransmitClass(const LoxCanMessage &message) const {
+  if (message.isNATmessage(*this)) {
+    if (message.commandNat >= Update_New && message.commandNat <= Update_Reply) // Update_New, Fragment_Start, Fragment_Data, Update_Reply
+      return eTransmitClass_bulk;
+    if (message.commandNat >= Digital_Value && message.commandNat < CryptoValueDigital)
+      return eTransmitClass_value;
+    return eTransmitClass_control;
+  }
+  switch (message.commandLegacy) {
+  case fragmented_package:
+  case fragmented_package_large_data:
+  case fragmented_package_large_start:
+    return eTransmitClass_bulk;
+  case config_check_CRC: // the Miniserver considers the extension offline without it
+    return eTransmitClass_control;
+  default:
+    if (message.commandLegacy < analog_input_config_0) // identify ... alive_reply
+      return eTransmitClass_control;
+    return eTransmitClass_value;
+  }
+}
+
+eTransmitClass LoxCANBaseDriver::FragmentTransmitClass(LoxMsgNATCommand_t command) {
+  if (command >= CryptoValueDigital && command <= CryptoChallengeReply)
+    return eTransmitClass_control;
+  return eTransmitClass_bulk;
+}
+
+/***
+ *  Longest time the receive task was busy with a message or the timer
+ ***/
+void LoxCANBaseDriver::StatisticsRxStall(CTL_TIME_t startTime) {
+  CTL_TIME_t stall = ctl_get_current_time() - startTime;
+  if (stall > this->statistics.mRxStall)
+    this->statistics.mRxStall = stall;
 }
 
 /***
@@ -82,22 +294,61 @@ void LoxCANBaseDriver::Delay(CTL_TIME_t msDelay) const {
 /*** 
  *  Received a message
  ***/
-void LoxCANBaseDriver::ReceiveMessage(LoxCanMessage &message) {
+void LoxCANBaseDriver::ReceiveMessage(const LoxCanMessage &message) {
+  CTL_TIME_t startTime = ctl_get_current_time();
   ++this->statistics.Rcv;
 #if DEBUG && 1
   debug_printf("CANR:");
   message.print(*this);
 #endif
-  for (int i = 0; i < this->extensionCount; ++i) {
-    this->extensions[i]->ReceiveMessage(message);
+  // merged hardware filters let messages pass, which nobody asked for
+  if (this->statistics.FMrg && !FilterIsRequested(message.identifier))
+    ++this->statistics.FLk;
+  // find the extensions interested in this message
+  uint32_t receivers = this->routeUnfiltered;
+  if (message.isNATmessage(*this)) {
+    uint8_t nat = message.extensionNat;
+    if (nat == 0xFF) {
+      receivers |= this->routeNATBroadcast;
+    } else if (this->routeNAT[nat] == ROUTE_SEVERAL) {
+      receivers |= this->routeNATAll;
+    } else if (this->routeNAT[nat] != ROUTE_NONE) {
+      receivers |= 1u << this->routeNAT[nat];
+    }
+  } else if (message.identifier == 0x00000000) {
+    receivers |= this->routeLegacyBroadcast;
+  } else {
+    receivers |= RouteLegacy(message.identifier);
+  }
+  for (uint32_t r = receivers; r; r &= r - 1)
+    this->extensions[__builtin_ctz(r)]->ReceiveMessage(message);
+  // fragmented packages from the Miniserver are reassembled once for all receivers
+  if (receivers && message.isNATmessage(*this) && message.fragmented && message.directionNat >= LoxCmdNATDirection_t_fromServerShortcut) {
+    if (message.commandNat == Fragment_Start) {
+      gNATFragments.Start(this, message);
+    } else if (message.commandNat == Fragment_Data) {
+      const tNATFragmentSlot *fragment = gNATFragments.Data(this, message);
+      if (fragment && fragment->streamed) {
+        for (uint32_t r = receivers; r; r &= r - 1)
+          this->extensions[__builtin_ctz(r)]->ReceiveFragmentStream(fragment, message);
+        if (fragment->offset == fragment->size)
+          gNATFragments.Release(fragment);
+      } else if (fragment) {
+        for (uint32_t r = receivers; r; r &= r - 1)
+          this->extensions[__builtin_ctz(r)]->ReceiveFragment(fragment->command, message, gNATFragments.Buffer(fragment), fragment->size);
+        gNATFragments.Release(fragment);
+      }
+    }
   }
+  StatisticsRxStall(startTime);
 }
 
 /***
- *  Forward a 10ms heartbeat to all extensions
+ *  Run the timers, which are due. Only extensions with a due timer are called.
  ***/
 void LoxCANBaseDriver::Timer10ms(void)
 {
-  for (int i = 0; i < this->extensionCount; ++i)
-    this->extensions[i]->Timer10ms();
+  CTL_TIME_t startTime = ctl_get_current_time();
+  TimerWheel().Advance(startTime);
+  StatisticsRxStall(startTime);
 }
\ No newline at end of file
@@ -9,6 +9,7 @@
 #define LoxCANBaseDriver_hpp
 
 #include "LoxCanMessage.hpp"
+#include "LoxTimerWheel.hpp"
 #include <ctl_api.h>
 
 class LoxExtension;
@@ -18,10 +19,90 @@ typedef enum {
   tLoxCANDriverType_TreeBus,
 } tLoxCANDriverType;
 
+#ifndef MAX_EXTENSIONS
+#define MAX_EXTENSIONS 16 // up to 16 extensions per driver, at most 32
+#endif
+#define MAX_FILTER_REQUESTS 48 // all filters requested by the extensions of a driver
+#define FILTER_MASK_EXACT 0x1FFFFFFF // a filter mask, which only accepts a single identifier
+#define FILTER_MASK_NAT 0x1F2FF000   // a filter mask for NAT messages to an extension NAT (see FilterSetupNAT)
+
+#define ROUTE_NONE 0xFF       // no extension receives this message
+#define ROUTE_SEVERAL 0xFE    // more than one extension requested it, forward to all of this kind
+#define ROUTE_LEGACY_SIZE 128 // size of the legacy identifier hash table, power of 2
+
+// Outgoing messages are queued in different classes, a lower class is only sent if the higher
+// classes are empty (or after TRANSMIT_STARVATION_LIMIT messages of higher classes)
+typedef enum {
+  eTransmitClass_control = 0, // keepalive, NAT assignment and other protocol messages
+  eTransmitClass_value,       // value updates
+  eTransmitClass_bulk,        // fragmented packages, always sent in order
+  eTransmitClass_count
+} eTransmitClass;
+
+#define TRANSMIT_STARVATION_LIMIT 8 // a waiting class is sent after this many messages of higher classes
+#define TRANSMIT_RESERVE_TIMEOUT 50 // ms a fragmented package waits for free transmit queue entries
+
+// What to do, if the transmit queue is full
+typedef enum {
+  eSendPolicy_dropNewest = 0, // drop the new message (default)
+  eSendPolicy_dropOldest,     // drop the oldest queued message of the same class, the new message if the oldest is a fragment
+  eSendPolicy_coalesce,       // replace a queued message with the same identifier and the same first 2 data bytes (e.g. the same value index), otherwise drop the new message
+  eSendPolicy_block,          // wait up to a timeout for a free entry
+} eSendPolicy;
+
+typedef enum {
+  eSendStatus_queued = 0,     // the message was queued
+  eSendStatus_coalesced,      // the message replaced a queued message
+  eSendStatus_droppedOldest,  // the message was queued, but the oldest message was dropped
+  eSendStatus_dropped,        // the queue was full, the message was dropped
+  eSendStatus_timeout,        // the queue stayed full till the timeout, the message was dropped
+} eSendStatus;
+
+// Entries of a transmit queue reserved for a fragmented package, see TransmitReserve().
+// It belongs to the sender: only messages sent with it use the reserved entries.
+typedef struct {
+  unsigned count;               // reserved entries, which are not used yet
+  eTransmitClass transmitClass; // all messages of the package are sent in this class
+} tTransmitReservation;
+
+// A filter requested by an extension. The driver combines all of them into hardware filters.
+typedef struct {
+  const LoxExtension *owner; // extension, which requested the filter
+  uint8_t slot;              // extensions can request several filters, identified by this index
+  uint32_t filterId;         // 29-bit identifier
+  uint32_t filterMaskId;     // 29-bit mask, bits set have to match the identifier
+  bool directed;             // messages directly to the extension (not a broadcast), received with a higher priority
+} tLoxCANFilterRequest;
+
 class LoxCANBaseDriver {
   tLoxCANDriverType driverType;
   int extensionCount;
-  LoxExtension *extensions[16]; // up to 16 extensions per driver
+  LoxExtension *extensions[MAX_EXTENSIONS];
+
+  // routing of received messages to the extensions, build from the filter requests
+  // all masks are bitmasks of the index into extensions[]
+  uint32_t routeUnfiltered;      // extensions without any filter request receive every message
+  uint32_t routeNATBroadcast;    // extensions receiving NAT broadcasts
+  uint32_t routeNATAll;          // all extensions with NAT filters
+  uint32_t routeLegacyBroadcast; // extensions receiving legacy multicasts to all extensions
+  uint32_t routeLegacyAll;       // all extensions with legacy filters
+  uint8_t routeNAT[256];         // extension NAT => index into extensions[]
+  struct {
+    uint32_t identifier; // 0xFFFFFFFF = unused
+    uint8_t index;
+  } routeLegacy[ROUTE_LEGACY_SIZE]; // legacy identifier => index into extensions[], open addressing
+  int ExtensionIndex(const LoxExtension *extension) const;
+  void RouteUpdate(void);
+  uint32_t RouteLegacy(uint32_t identifier) const;
+  void StatisticsRxStall(CTL_TIME_t startTime);
+
+protected:
+  bool filterActive; // filter requests are applied to the hardware, after all extensions did startup
+  int filterRequestCount;
+  tLoxCANFilterRequest filterRequests[MAX_FILTER_REQUESTS];
+
+  // apply all requested filters to the hardware, called whenever the requests changed
+  virtual void FilterUpdate(void){};
 
 public:
   struct {         // CAN bus statistics
@@ -31,9 +112,25 @@ public:
     uint32_t mRQ;  // maximum number of entries in the receive queue
     uint32_t TQ;   // number of entries in the transmit queue
     uint32_t mTQ;  // maximum number of entries in the transmit queue
-    uint32_t QOvf; // number of dropped packages, because the transmit queue was full
+    struct {
+      uint32_t TQ;    // number of entries in the transmit queue of this class
+      uint32_t mTQ;   // maximum number of entries in the transmit queue of this class
+      uint32_t mWait; // maximum time in ms a message waited in the transmit queue of this class
+    } TC[eTransmitClass_count];
+    uint32_t QOvf; // number of dropped packages, because the transmit queue was full (or a policy dropped one)
+    uint32_t ROvf; // number of dropped packages, because the receive queue was full
+    uint32_t FOVR0; // number of hardware overruns of the receive FIFO 0 (broadcasts)
+    uint32_t FOVR1; // number of hardware overruns of the receive FIFO 1 (directed messages)
     uint32_t Err;  // incremented, whenever the CAN Last error code was != 0
     uint32_t HWE;  // Hardware error: incremented, whenever the Error Passive limit has been reached (Receive Error Counter or Transmit Error Counter>127).
+    uint32_t FBk;  // number of hardware filter banks in use
+    uint32_t FMrg; // number of requested filters, which had to be merged to fit into the hardware filter banks
+    uint32_t FLk;  // number of received messages, which passed a merged hardware filter, but were not requested by any extension
+    uint32_t mRxStall; // maximum time in ms a received message or the 10ms timer kept the receive task busy
+#if DEBUG
+    uint32_t RxCyc;  // CPU cycles per message in the last receive interrupt
+    uint32_t mRxCyc; // maximum CPU cycles of a receive interrupt
+#endif
   } statistics;
 
 public:
@@ -50,11 +147,17 @@ public:
   // setup various CAN filters. At least one is required to receive messages!
   virtual void FilterAllowAll(uint32_t filterBank) = 0;
   virtual void FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment) = 0;
-  void FilterSetupNAT(int filterIndex, LoxCmdNATBus_t busType, uint8_t extensionNAT);
+  void FilterSetupNAT(const LoxExtension *owner, int filterIndex, LoxCmdNATBus_t busType, uint8_t extensionNAT);
+
+  // request/release a filter for an extension. The driver packs all requests into the hardware filters.
+  void FilterRequest(const LoxExtension *owner, int slot, uint32_t filterId, uint32_t filterMaskId = FILTER_MASK_EXACT, bool directed = false);
+  void FilterRelease(const LoxExtension *owner, int slot);
+  bool FilterIsRequested(uint32_t identifier) const;
 
   // CAN bus statistics and errors
 #if DEBUG
   void StatisticsPrint() const;
+  void StatisticsReceiveCycles(uint32_t cycles, unsigned messageCount);
 #endif
   void StatisticsReset();
   virtual uint32_t GetErrorCounter() const = 0;
@@ -64,13 +167,31 @@ public:
   // a ms delay, uses FreeRTOS
   void Delay(CTL_TIME_t msDelay) const;
 
-  // send a message onto the CAN bus
-  virtual void SendMessage(LoxCanMessage &message) = 0;
+  // send a message onto the CAN bus, with a reservation it uses one of the reserved entries
+  virtual eSendStatus SendMessage(LoxCanMessage &message, eSendPolicy policy = eSendPolicy_dropNewest, CTL_TIME_t timeout = 0, tTransmitReservation *reservation = NULL) = 0;
+  // send a message after a delay in ms (e.g. a random delay for replies to a broadcast), never blocks
+  virtual eSendStatus SendMessageDelayed(LoxCanMessage &message, CTL_TIME_t msDelay) = 0;
+  // reserve transmit queue entries for a fragmented package, so it is either sent completely or not at all.
+  // Reservations of several senders add up, the unused entries are returned with TransmitRelease().
+  // The crypto handshake is sent in the control class, other fragmented packages in the bulk class.
+  virtual bool TransmitReserve(tTransmitReservation &reservation, int count, CTL_TIME_t timeout, eTransmitClass transmitClass = eTransmitClass_bulk) {
+    reservation.count = 0;
+    reservation.transmitClass = transmitClass;
+    return true;
+  };
+  virtual void TransmitRelease(tTransmitReservation &reservation){};
+  // free entries in the transmit queue of a class, drivers without queues never run full
+  virtual unsigned TransmitFree(eTransmitClass transmitClass) const { return ~0u; };
+  eTransmitClass TransmitClass(const LoxCanMessage &message) const;
+  // transmit class of a fragmented NAT package with this command
+  static eTransmitClass FragmentTransmitClass(LoxMsgNATCommand_t command);
 
   // received a message from the CAN bus and forward it to the extensions
-  void ReceiveMessage(LoxCanMessage &message);
+  void ReceiveMessage(const LoxCanMessage &message);
 
-  // forward 10ms timer heartbeat to extensions
+  // timers of the extensions, Tree devices use the wheel of the Tree Base Extension
+  virtual LoxTimerWheel &TimerWheel(void) = 0;
+  // run the timers of the extensions, which are due. Called every 10ms.
   void Timer10ms(void);
 };
 
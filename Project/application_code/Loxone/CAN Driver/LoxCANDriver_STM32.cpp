@@ -15,11 +15,15 @@
 #define CAN_GPIO_PORT GPIOB
 #define CAN_RX_GPIO_PIN GPIO_PIN_8
 #define CAN_TX_GPIO_PIN GPIO_PIN_9
+#ifndef CAN_RX_USE_HAL
+#define CAN_RX_USE_HAL 0 // 1 = receive via HAL_CAN_IRQHandler()/HAL_CAN_GetRxMessage() (slower, for comparison)
+#endif
 
 static CAN_HandleTypeDef gCan;
 static LoxCANDriver_STM32 *gCANDriver;
 
-LoxCANDriver_STM32::LoxCANDriver_STM32(tLoxCANDriverType type) : LoxCANBaseDriver(type) {
+LoxCANDriver_STM32::LoxCANDriver_STM32(tLoxCANDriverType type) : LoxCANQueuedDriver(type), transmitGapInMs(0) {
+  memset(this->filterBanks, 0xFF, sizeof(this->filterBanks)); // unknown, the first FilterUpdate() programs all banks
 }
 
 /***
@@ -30,14 +34,20 @@ void LoxCANDriver_STM32::vCANRXTask(void *pvParameters) {
   while (1) {
     unsigned events = ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gMainEvent, eMainEvents_CanMessaged | eMainEvents_10ms, CTL_TIMEOUT_DELAY, 5u);
     if (events & eMainEvents_CanMessaged) {
-      unsigned rq = ctl_fifo_num_used(&_this->receiveFifo);
+      unsigned rq = _this->receiveRing[0].Count() + _this->receiveRing[1].Count();
       _this->statistics.RQ = rq;
       if (rq > _this->statistics.mRQ)
         _this->statistics.mRQ = rq;
-      LoxCanMessage *message;
-      while ((message = (LoxCanMessage *)ctl_fifo_peek(&_this->receiveFifo)) != NULL) {
-        _this->ReceiveMessage(*message);
-        ctl_fifo_remove(&_this->receiveFifo);
+      // forward all messages in batches, the interrupt keeps filling the rings meanwhile.
+      // Directed messages (FIFO 1) are always forwarded before the next batch of broadcasts.
+      while (_this->receiveRing[0].Count() + _this->receiveRing[1].Count() > 0) {
+        for (int fifo = 1; fifo >= 0; --fifo) {
+          LoxCanMessageRing<64> &ring = _this->receiveRing[fifo];
+          rq = ring.Count();
+          for (unsigned i = 0; i < rq; ++i)
+            _this->ReceiveMessage(ring.Peek(i));
+          ring.Release(rq);
+        }
       }
     }
     if (events & eMainEvents_10ms) {
@@ -46,39 +56,110 @@ void LoxCANDriver_STM32::vCANRXTask(void *pvParameters) {
   }
 }
 
+/***
+ *  Receive all pending messages of a FIFO directly into its receive ring.
+ *  This bypasses HAL_CAN_IRQHandler()/HAL_CAN_GetRxMessage(), only the message pending
+ *  interrupts are enabled for the FIFOs.
+ ***/
+void LoxCANDriver_STM32::ReceiveFifoIRQ(int fifo) {
+#if DEBUG
+  uint32_t cycles = DWT->CYCCNT;
+#endif
+  CAN_TypeDef *can = gCan.Instance;
+  __IO uint32_t *rfr = fifo ? &can->RF1R : &can->RF0R; // RF0R and RF1R have the same layout
+  CAN_FIFOMailBox_TypeDef *mailbox = &can->sFIFOMailBox[fifo];
+  LoxCanMessageRing<64> &ring = this->receiveRing[fifo];
+  unsigned count = 0;
+  if (*rfr & CAN_RF0R_FOVR0) { // a message was lost, because the FIFO was full
+    if (fifo)
+      ++this->statistics.FOVR1;
+    else
+      ++this->statistics.FOVR0;
+    *rfr = CAN_RF0R_FOVR0;
+  }
+  while (*rfr & CAN_RF0R_FMP0) {
+    uint32_t rir = mailbox->RIR;
+    if ((rir & (CAN_RI0R_IDE | CAN_RI0R_RTR)) == CAN_RI0R_IDE && (mailbox->RDTR & CAN_RDT0R_DLC) == 8) { // only accept standard Loxone packages
+      LoxCanMessage *message = ring.ProducerSlot();
+      if (message) {
+        uint32_t data[2] = {mailbox->RDLR, mailbox->RDHR};
+        message->identifier = rir >> CAN_RI0R_EXID_Pos;
+        memcpy(message->can_data, data, 8);
+        ring.ProducerCommit();
+        ++count;
+      } else {
+        ++this->statistics.ROvf;
+      }
+    }
+    *rfr = CAN_RF0R_RFOM0; // release the output mailbox, FULL/FOVR are not touched by writing 0
+  }
+  if (count)
+    ctl_events_set_clear(&gMainEvent, eMainEvents_CanMessaged, 0);
+#if DEBUG
+  StatisticsReceiveCycles(DWT->CYCCNT - cycles, count);
+#endif
+}
+
+/***
+ *  Move pending messages from the transmit queues into the free transmit mailboxes.
+ *  Called from the CAN interrupts or from the TX task with all interrupts disabled.
+ *  With an inter-frame gap only a single message is moved.
+ ***/
+void LoxCANDriver_STM32::TransmitFillMailboxes(void) {
+  int c;
+  while (HAL_CAN_GetTxMailboxesFreeLevel(&gCan) > 0 && (c = TransmitNextClass()) >= 0) {
+    tTransmitEntry *entry = this->transmitQueue[c].Peek();
+    const CAN_TxHeaderTypeDef hdr = {
+        .ExtId = entry->message.identifier,
+        .IDE = CAN_ID_EXT,
+        .RTR = CAN_RTR_DATA,
+        .DLC = 8,
+        .TransmitGlobalTime = DISABLE,
+    };
+    uint32_t txMailbox = 0;
+    if (HAL_CAN_AddTxMessage(&gCan, &hdr, entry->message.can_data, &txMailbox) != HAL_OK)
+      break;
+    TransmitRemove(c);
+    if (this->transmitGapInMs)
+      break;
+  }
+}
+
+/***
+ *  A transmit mailbox became empty (sent, aborted or failed). Refill it right away,
+ *  unless the TX task is pacing the messages.
+ ***/
+void LoxCANDriver_STM32::TransmitMailboxEmpty(void) {
+  if (this->transmitGapInMs == 0)
+    TransmitFillMailboxes();
+}
+
 /***
  *  CAN TX Task to send pending messages to the CAN bus
+ *
+ *  Without an inter-frame gap the task only starts the transmission, the TX mailbox empty
+ *  interrupt keeps all three mailboxes busy afterwards. With a gap, the task sends one
+ *  message at a time and waits the gap in between.
  ***/
 void LoxCANDriver_STM32::vCANTXTask(void *pvParameters) {
   LoxCANDriver_STM32 *_this = (LoxCANDriver_STM32 *)pvParameters;
   while (1) {
-    unsigned events = ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->transmitEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_DELAY, 5u);
-    if (events & eMainEvents_CanMessaged) {
-      LoxCanMessage *message;
-      while ((message = (LoxCanMessage *)ctl_fifo_peek(&_this->transmitFifo)) != NULL) {
-#if DEBUG
-        debug_printf("CANS:");
-        message->print(*_this);
-#endif
-        const CAN_TxHeaderTypeDef hdr = {
-            .ExtId = message->identifier,
-            .IDE = CAN_ID_EXT,
-            .RTR = CAN_RTR_DATA,
-            .DLC = 8,
-            .TransmitGlobalTime = DISABLE,
-        };
-        uint32_t txMailbox = 0;
-        HAL_StatusTypeDef status = HAL_CAN_AddTxMessage(&gCan, &hdr, message->can_data, &txMailbox);
-        if (status != HAL_OK)
+    CTL_TIME_t nextDeferred;
+    CTL_TIME_t timeout = ctl_get_current_time() + 5;
+    if (_this->TransmitDeferred(&nextDeferred) && (int32_t)(nextDeferred - timeout) < 0)
+      timeout = nextDeferred;
+    unsigned events = ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->transmitEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_ABSOLUTE, timeout);
+    if ((events & eMainEvents_CanMessaged) || _this->TransmitPending()) { // the timeout also restarts a stalled queue
+      do {
+        // HAL_CAN_IRQHandler() completes transmissions on every CAN1 vector (TX, SCE and the RX FIFOs
+        // with CAN_RX_USE_HAL), so masking only the TX interrupt is not enough
+        int enabled = ctl_global_interrupts_disable();
+        _this->TransmitFillMailboxes();
+        ctl_global_interrupts_set(enabled);
+        if (_this->transmitGapInMs == 0)
           break;
-        ctl_fifo_remove(&_this->transmitFifo);
-        unsigned tq = ctl_fifo_num_used(&_this->transmitFifo);
-        _this->statistics.TQ = tq;
-        if (tq > _this->statistics.mTQ)
-          _this->statistics.mTQ = tq;
-        ++_this->statistics.Sent;
-        ctl_timeout_wait(ctl_get_current_time() + 4); // wait a little bit till looking for another message
-      }
+        ctl_timeout_wait(ctl_get_current_time() + _this->transmitGapInMs); // wait a little bit till looking for another message
+      } while (_this->TransmitPending());
     }
   }
 }
@@ -89,8 +170,15 @@ void LoxCANDriver_STM32::vCANTXTask(void *pvParameters) {
 void LoxCANDriver_STM32::Startup(void) {
   gCANDriver = this;
 
-  ctl_fifo_init(&transmitFifo, transmitBuffer, sizeof(transmitBuffer[0]), sizeof(transmitBuffer) / sizeof(transmitBuffer[0]), &transmitEvent, eMainEvents_CanMessaged);
-  ctl_fifo_init(&receiveFifo, receiveBuffer, sizeof(receiveBuffer[0]), sizeof(receiveBuffer) / sizeof(receiveBuffer[0]), &gMainEvent, eMainEvents_CanMessaged);
+  TransmitInit(transmitBufferControl, sizeof(transmitBufferControl) / sizeof(transmitBufferControl[0]),
+      transmitBufferValue, sizeof(transmitBufferValue) / sizeof(transmitBufferValue[0]),
+      transmitBufferBulk, sizeof(transmitBufferBulk) / sizeof(transmitBufferBulk[0]));
+#if DEBUG
+  // enable the cycle counter to measure the receive interrupt
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
 
 #define RX_STACKSIZE 256
   static unsigned sCANTXTaskStack[1 + RX_STACKSIZE + 1];
@@ -132,36 +220,219 @@ void LoxCANDriver_STM32::Startup(void) {
   HAL_CAN_ActivateNotification(&gCan, CAN_IT_ERROR);           // Error Interrupt
   HAL_CAN_Start(&gCan);
 
-  // do not filter anything, because we might implement more than one extension/device
-  FilterAllowAll(0);
-
   // FYI: At least one filter is required to be able to receive any data.
+  // The filters requested by the extensions are setup after their startup.
   LoxCANBaseDriver::Startup();
 }
 
 /***
- *  Setup CAN filters. While an AllowAll filter is working (we can filter in software), it is probably
- *  desirable to filter in "hardware" everything we do not care about.
+ *  Setup CAN filters in mask mode: a message is accepted, if all bits set in the mask match the identifier
  ***/
 void LoxCANDriver_STM32::FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment) {
-#if 0
   filterId = (filterId << 3) | CAN_ID_EXT;
   filterMaskId = (filterMaskId << 3) | CAN_ID_EXT;
   CAN_FilterTypeDef filterInit = {
-    .FilterIdHigh = filterId >> 16,
-    .FilterIdLow = filterId & 0xFFFF,
-    .FilterMaskIdHigh = filterMaskId >> 16,
-    .FilterMaskIdLow = filterMaskId & 0xFFFF,
-    .FilterFIFOAssignment = filterFIFOAssignment,
-    .FilterBank = filterBank,
-    .FilterMode = CAN_FILTERMODE_IDMASK,
-    .FilterScale = CAN_FILTERSCALE_32BIT,
-    .FilterActivation = CAN_FILTER_ENABLE,
-    .SlaveStartFilterBank = 0,
+      .FilterIdHigh = filterId >> 16,
+      .FilterIdLow = filterId & 0xFFFF,
+      .FilterMaskIdHigh = filterMaskId >> 16,
+      .FilterMaskIdLow = filterMaskId & 0xFFFF,
+      .FilterFIFOAssignment = filterFIFOAssignment,
+      .FilterBank = filterBank,
+      .FilterMode = CAN_FILTERMODE_IDMASK,
+      .FilterScale = CAN_FILTERSCALE_32BIT,
+      .FilterActivation = CAN_FILTER_ENABLE,
+      .SlaveStartFilterBank = 0,
+  };
+  HAL_CAN_ConfigFilter(&gCan, &filterInit);
+}
+
+/***
+ *  Setup CAN filters in list mode: a message is accepted, if it matches one of the two identifiers
+ ***/
+void LoxCANDriver_STM32::FilterSetupList(uint32_t filterBank, uint32_t filterId1, uint32_t filterId2, uint32_t filterFIFOAssignment) {
+  filterId1 = (filterId1 << 3) | CAN_ID_EXT;
+  filterId2 = (filterId2 << 3) | CAN_ID_EXT;
+  CAN_FilterTypeDef filterInit = {
+      .FilterIdHigh = filterId1 >> 16,
+      .FilterIdLow = filterId1 & 0xFFFF,
+      .FilterMaskIdHigh = filterId2 >> 16,
+      .FilterMaskIdLow = filterId2 & 0xFFFF,
+      .FilterFIFOAssignment = filterFIFOAssignment,
+      .FilterBank = filterBank,
+      .FilterMode = CAN_FILTERMODE_IDLIST,
+      .FilterScale = CAN_FILTERSCALE_32BIT,
+      .FilterActivation = CAN_FILTER_ENABLE,
+      .SlaveStartFilterBank = 0,
+  };
+  HAL_CAN_ConfigFilter(&gCan, &filterInit);
+}
+
+/***
+ *  Disable an unused filter bank
+ ***/
+void LoxCANDriver_STM32::FilterDisable(uint32_t filterBank) {
+  CAN_FilterTypeDef filterInit = {
+      .FilterIdHigh = 0x0000,
+      .FilterIdLow = 0x0000,
+      .FilterMaskIdHigh = 0x0000,
+      .FilterMaskIdLow = 0x0000,
+      .FilterFIFOAssignment = CAN_FILTER_FIFO0,
+      .FilterBank = filterBank,
+      .FilterMode = CAN_FILTERMODE_IDMASK,
+      .FilterScale = CAN_FILTERSCALE_32BIT,
+      .FilterActivation = CAN_FILTER_DISABLE,
+      .SlaveStartFilterBank = 0,
   };
   HAL_CAN_ConfigFilter(&gCan, &filterInit);
-#endif
-  // an all filter is active anyway (see above). This is necessary for legacy extensions and support for multiple extensions on the same system.
+}
+
+/***
+ *  Number of filter banks needed for a list of filters: single identifiers are
+ *  paired in list mode (only with the same FIFO), all other filters need a bank in mask mode.
+ ***/
+static int filterBanksNeeded(const uint32_t *filterMaskIds, const uint8_t *filterFIFOs, int count) {
+  int exactCount[2] = {0, 0};
+  int maskCount = 0;
+  for (int i = 0; i < count; ++i) {
+    if (filterMaskIds[i] == FILTER_MASK_EXACT)
+      ++exactCount[filterFIFOs[i]];
+    else
+      ++maskCount;
+  }
+  return maskCount + (exactCount[0] + 1) / 2 + (exactCount[1] + 1) / 2;
+}
+
+/***
+ *  Filter banks saved by merging two filters of the same FIFO into one mask filter:
+ *  two masks share one bank. A single identifier merged into a mask only frees a bank,
+ *  if it was the unpaired one of its FIFO. Two single identifiers merged need a mask bank
+ *  instead of their list bank, which saves nothing, but the mask can take more filters later.
+ ***/
+static int filterBanksSaved(bool exactA, bool exactB, int exactCount) {
+  if (!exactA && !exactB)
+    return 1;
+  if (exactA != exactB)
+    return exactCount & 1;
+  return 0;
+}
+
+/***
+ *  Pack all filters requested by the extensions into the hardware filter banks.
+ *  Directed messages are received via FIFO 1, broadcasts via FIFO 0.
+ *  If there are not enough banks, two filters of the same FIFO are merged into one, till
+ *  everything fits: the merge saving the most banks, between these the one losing the least
+ *  mask bits. Merged filters accept more messages than requested, these are dropped in
+ *  software by the extensions. Only banks, which changed, are written to the hardware.
+ ***/
+void LoxCANDriver_STM32::FilterUpdate(void) {
+  uint32_t filterIds[MAX_FILTER_REQUESTS];
+  uint32_t filterMaskIds[MAX_FILTER_REQUESTS];
+  uint8_t filterFIFOs[MAX_FILTER_REQUESTS];
+  int count = 0;
+
+  // collect all requests, filters covered by another filter of the same FIFO are dropped
+  for (int r = 0; r < this->filterRequestCount; ++r) {
+    uint32_t id = this->filterRequests[r].filterId;
+    uint32_t mask = this->filterRequests[r].filterMaskId;
+    uint8_t fifo = this->filterRequests[r].directed ? CAN_FILTER_FIFO1 : CAN_FILTER_FIFO0;
+    bool covered = false;
+    for (int i = 0; i < count && !covered; ++i)
+      covered = filterFIFOs[i] == fifo && (mask & filterMaskIds[i]) == filterMaskIds[i] && ((id ^ filterIds[i]) & filterMaskIds[i]) == 0;
+    if (covered)
+      continue;
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+      if (filterFIFOs[i] == fifo && (filterMaskIds[i] & mask) == mask && ((id ^ filterIds[i]) & mask) == 0)
+        continue; // covered by the new filter
+      filterIds[n] = filterIds[i];
+      filterMaskIds[n] = filterMaskIds[i];
+      filterFIFOs[n++] = filterFIFOs[i];
+    }
+    count = n;
+    filterIds[count] = id;
+    filterMaskIds[count] = mask;
+    filterFIFOs[count++] = fifo;
+  }
+
+  // merge filters till they fit into the available filter banks
+  uint32_t merged = 0;
+  while (filterBanksNeeded(filterMaskIds, filterFIFOs, count) > CAN_FILTER_BANKS) {
+    int exactCount[2] = {0, 0};
+    for (int i = 0; i < count; ++i)
+      if (filterMaskIds[i] == FILTER_MASK_EXACT)
+        ++exactCount[filterFIFOs[i]];
+    int bestA = -1, bestB = -1, bestSaved = -1, bestBits = -1;
+    for (int a = 0; a < count; ++a) {
+      for (int b = a + 1; b < count; ++b) {
+        if (filterFIFOs[a] != filterFIFOs[b])
+          continue;
+        int saved = filterBanksSaved(filterMaskIds[a] == FILTER_MASK_EXACT, filterMaskIds[b] == FILTER_MASK_EXACT, exactCount[filterFIFOs[a]]);
+        int bits = __builtin_popcount(filterMaskIds[a] & filterMaskIds[b] & ~(filterIds[a] ^ filterIds[b]));
+        if (saved > bestSaved || (saved == bestSaved && bits > bestBits)) {
+          bestSaved = saved;
+          bestBits = bits;
+          bestA = a;
+          bestB = b;
+        }
+      }
+    }
+    if (bestA < 0) // can not happen with 14 banks and 2 FIFOs
+      break;
+    filterMaskIds[bestA] &= filterMaskIds[bestB] & ~(filterIds[bestA] ^ filterIds[bestB]);
+    filterIds[bestA] &= filterMaskIds[bestA];
+    filterIds[bestB] = filterIds[--count];
+    filterMaskIds[bestB] = filterMaskIds[count];
+    filterFIFOs[bestB] = filterFIFOs[count];
+    ++merged;
+  }
+
+  // assign the filter banks
+  tFilterBank banks[CAN_FILTER_BANKS];
+  memset(banks, 0, sizeof(banks)); // eFilterBank_disabled
+  uint32_t bank = 0;
+  for (uint8_t fifo = CAN_FILTER_FIFO0; fifo <= CAN_FILTER_FIFO1; ++fifo) {
+    tFilterBank *exactPending = NULL;
+    for (int i = 0; i < count; ++i) {
+      if (filterFIFOs[i] != fifo)
+        continue;
+      if (filterMaskIds[i] != FILTER_MASK_EXACT) {
+        banks[bank++] = (tFilterBank){eFilterBank_mask, fifo, filterIds[i], filterMaskIds[i]};
+      } else if (exactPending) {
+        exactPending->id2 = filterIds[i];
+        exactPending = NULL;
+      } else {
+        exactPending = &banks[bank++];
+        *exactPending = (tFilterBank){eFilterBank_list, fifo, filterIds[i], filterIds[i]};
+      }
+    }
+  }
+  // no requests at all: do not filter anything
+  if (bank == 0)
+    banks[bank++].mode = eFilterBank_all;
+  this->statistics.FBk = bank;
+  this->statistics.FMrg = merged;
+
+  // program the banks, which changed
+  for (bank = 0; bank < CAN_FILTER_BANKS; ++bank) {
+    const tFilterBank &b = banks[bank];
+    if (memcmp(&b, &this->filterBanks[bank], sizeof(b)) == 0)
+      continue;
+    switch (b.mode) {
+    case eFilterBank_mask:
+      FilterSetup(bank, b.id1, b.id2, b.fifo);
+      break;
+    case eFilterBank_list:
+      FilterSetupList(bank, b.id1, b.id2, b.fifo);
+      break;
+    case eFilterBank_all:
+      FilterAllowAll(bank);
+      break;
+    default:
+      FilterDisable(bank);
+      break;
+    }
+    this->filterBanks[bank] = b;
+  }
 }
 
 /***
@@ -199,10 +470,11 @@ uint8_t LoxCANDriver_STM32::GetReceiveErrorCounter() const {
 }
 
 /***
- *  Send a message by putting it into the transmission queue
+ *  Optional pause between two transmitted messages. 0 (default) sends back-to-back
+ *  through all three transmit mailboxes.
  ***/
-void LoxCANDriver_STM32::SendMessage(LoxCanMessage &message) {
-  ctl_fifo_add(&this->transmitFifo, &message);
+void LoxCANDriver_STM32::SetTransmitGap(CTL_TIME_t gapInMs) {
+  this->transmitGapInMs = gapInMs;
 }
 
 /**
@@ -217,29 +489,99 @@ extern "C" void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan) {
     if (ErrorStatus != HAL_CAN_ERROR_NONE) {
       gCANDriver->statistics.HWE++;
     }
+    // a failed transmission (lost arbitration, transmit error) also frees the mailbox
+    if (ErrorStatus & (HAL_CAN_ERROR_TX_ALST0 | HAL_CAN_ERROR_TX_TERR0 | HAL_CAN_ERROR_TX_ALST1 | HAL_CAN_ERROR_TX_TERR1 | HAL_CAN_ERROR_TX_ALST2 | HAL_CAN_ERROR_TX_TERR2)) {
+      gCANDriver->TransmitMailboxEmpty();
+    }
   }
   HAL_CAN_ResetError(hcan);
 }
 
 /**
-  * @brief  Rx FIFO 0 message pending callback.
+  * @brief  Transmission Mailbox complete and abort callbacks.
   * @param  hcan pointer to a CAN_HandleTypeDef structure that contains
   *         the configuration information for the specified CAN.
   * @retval None
   */
-extern "C" void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+extern "C" void HAL_CAN_TxMailbox0CompleteCallback(CAN_HandleTypeDef *hcan) {
+  if (hcan->Instance == CAN1)
+    gCANDriver->TransmitMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox1CompleteCallback(CAN_HandleTypeDef *hcan) {
+  if (hcan->Instance == CAN1)
+    gCANDriver->TransmitMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox2CompleteCallback(CAN_HandleTypeDef *hcan) {
+  if (hcan->Instance == CAN1)
+    gCANDriver->TransmitMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox0AbortCallback(CAN_HandleTypeDef *hcan) {
+  if (hcan->Instance == CAN1)
+    gCANDriver->TransmitMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox1AbortCallback(CAN_HandleTypeDef *hcan) {
+  if (hcan->Instance == CAN1)
+    gCANDriver->TransmitMailboxEmpty();
+}
+
+extern "C" void HAL_CAN_TxMailbox2AbortCallback(CAN_HandleTypeDef *hcan) {
+  if (hcan->Instance == CAN1)
+    gCANDriver->TransmitMailboxEmpty();
+}
+
+#if CAN_RX_USE_HAL
+/***
+ *  Receive a message via the HAL into the receive ring of the FIFO
+ ***/
+static void ReceiveMessageHAL(CAN_HandleTypeDef *hcan, int fifo) {
+#if DEBUG
+  uint32_t cycles = DWT->CYCCNT;
+#endif
   CAN_RxHeaderTypeDef rx_header;
   uint8_t rx_data[8];
-  HAL_CAN_GetRxMessage(hcan, CAN_RX_FIFO0, &rx_header, rx_data);
+  HAL_CAN_GetRxMessage(hcan, fifo ? CAN_RX_FIFO1 : CAN_RX_FIFO0, &rx_header, rx_data);
   if (hcan->Instance == CAN1) {
     if (rx_header.IDE == CAN_ID_EXT && rx_header.RTR == CAN_RTR_DATA && rx_header.DLC == 8) { // only accept standard Loxone packages
-      LoxCanMessage message;
-      message.identifier = rx_header.ExtId;
-      memmove(message.can_data, rx_data, 8);
-      ctl_fifo_add(&gCANDriver->receiveFifo, &message);
+      LoxCanMessage *message = gCANDriver->receiveRing[fifo].ProducerSlot();
+      if (message) {
+        message->identifier = rx_header.ExtId;
+        memmove(message->can_data, rx_data, 8);
+        gCANDriver->receiveRing[fifo].ProducerCommit();
+        ctl_events_set_clear(&gMainEvent, eMainEvents_CanMessaged, 0);
+      } else {
+        ++gCANDriver->statistics.ROvf;
+      }
     }
   }
+#if DEBUG
+  gCANDriver->StatisticsReceiveCycles(DWT->CYCCNT - cycles, 1);
+#endif
+}
+
+/**
+  * @brief  Rx FIFO 0 message pending callback.
+  * @param  hcan pointer to a CAN_HandleTypeDef structure that contains
+  *         the configuration information for the specified CAN.
+  * @retval None
+  */
+extern "C" void HAL_CAN_RxFifo0MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+  ReceiveMessageHAL(hcan, 0);
+}
+
+/**
+  * @brief  Rx FIFO 1 message pending callback.
+  * @param  hcan pointer to a CAN_HandleTypeDef structure that contains
+  *         the configuration information for the specified CAN.
+  * @retval None
+  */
+extern "C" void HAL_CAN_RxFifo1MsgPendingCallback(CAN_HandleTypeDef *hcan) {
+  ReceiveMessageHAL(hcan, 1);
 }
+#endif
 
 /**
   * @brief  Initializes the CAN MSP.
@@ -315,14 +657,22 @@ extern "C" void CAN1_TX_IRQHandler(void) {
 * @brief This function handles USB low priority or CAN RX0 interrupts.
 */
 extern "C" void CAN1_RX0_IRQHandler(void) {
+#if CAN_RX_USE_HAL
   HAL_CAN_IRQHandler(&gCan);
+#else
+  gCANDriver->ReceiveFifoIRQ(0);
+#endif
 }
 
 /**
 * @brief This function handles CAN RX1 interrupt.
 */
 extern "C" void CAN1_RX1_IRQHandler(void) {
+#if CAN_RX_USE_HAL
   HAL_CAN_IRQHandler(&gCan);
+#else
+  gCANDriver->ReceiveFifoIRQ(1);
+#endif
 }
 
 /**
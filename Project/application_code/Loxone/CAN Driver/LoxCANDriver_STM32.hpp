@@ -8,22 +8,48 @@
 #ifndef LoxCANDriver_STM32_hpp
 #define LoxCANDriver_STM32_hpp
 
-#include "LoxCANBaseDriver.hpp"
+#include "LoxCANQueuedDriver.hpp"
+#include "LoxCanMessageRing.hpp"
 #include "LoxCanMessage.hpp"
-#include "ctl_fifo.h"
 
 class LoxExtension;
 
-class LoxCANDriver_STM32 : public LoxCANBaseDriver {
-  LoxCanMessage transmitBuffer[64];
-  CTL_EVENT_SET_t transmitEvent;
-  CTL_FIFO_t transmitFifo;
-  LoxCanMessage receiveBuffer[64];
+#define CAN_FILTER_BANKS 14 // the STM32F103 has 14 filter banks for CAN1
 
-public: // used by HAL_CAN_RxFifo0MsgPendingCallback()
-  CTL_FIFO_t receiveFifo;
+// content of a hardware filter bank, as programmed by FilterUpdate()
+typedef enum {
+  eFilterBank_disabled = 0,
+  eFilterBank_mask, // id1 = identifier, id2 = mask
+  eFilterBank_list, // two identifiers
+  eFilterBank_all,  // FilterAllowAll()
+} eFilterBankMode;
+
+typedef struct {
+  uint32_t mode; // eFilterBankMode
+  uint32_t fifo;
+  uint32_t id1;
+  uint32_t id2;
+} tFilterBank;
+
+class LoxCANDriver_STM32 : public LoxCANQueuedDriver {
+  tTransmitEntry transmitBufferControl[16];
+  tTransmitEntry transmitBufferValue[16];
+  tTransmitEntry transmitBufferBulk[64];
+  CTL_TIME_t transmitGapInMs;
+  tFilterBank filterBanks[CAN_FILTER_BANKS]; // programmed into the hardware
+
+public: // used by CAN1_RX0_IRQHandler()/CAN1_RX1_IRQHandler()
+  LoxCanMessageRing<64> receiveRing[2]; // FIFO 0: broadcasts, FIFO 1: directed messages
+  void ReceiveFifoIRQ(int fifo);
+
+public: // used by the HAL_CAN_TxMailbox...Callback()
+  void TransmitMailboxEmpty(void);
 
 private:
+  void TransmitFillMailboxes(void);
+  void FilterSetupList(uint32_t filterBank, uint32_t filterId1, uint32_t filterId2, uint32_t filterFIFOAssignment);
+  void FilterDisable(uint32_t filterBank);
+  void FilterUpdate(void);
   static void vCANRXTask(void *pvParameters);
   static void vCANTXTask(void *pvParameters);
 
@@ -40,8 +66,8 @@ public:
   uint8_t GetTransmitErrorCounter() const;
   uint8_t GetReceiveErrorCounter() const;
 
-  // send a message onto the CAN bus
-  void SendMessage(LoxCanMessage &message);
+  // optional pause between two messages, 0 = send back-to-back (default)
+  void SetTransmitGap(CTL_TIME_t gapInMs);
 };
 
 #endif /* LoxCANDriver_STM32_hpp */
\ No newline at end of file
@@ -0,0 +1,220 @@
+//
+//  LoxCANQueuedDriver.cpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxCANQueuedDriver.hpp"
+#include "system.hpp"
+#include <__cross_studio_io.h>
+#include <string.h>
+
+LoxCANQueuedDriver::LoxCANQueuedDriver(tLoxCANDriverType type) : LoxCANBaseDriver(type) {
+  memset(this->transmitSkipped, 0, sizeof(this->transmitSkipped));
+}
+
+/***
+ *  Setup the transmit queues with the buffers of the subclass
+ ***/
+void LoxCANQueuedDriver::TransmitInit(tTransmitEntry *control, unsigned controlSize, tTransmitEntry *value, unsigned valueSize, tTransmitEntry *bulk, unsigned bulkSize) {
+  this->transmitQueue[eTransmitClass_control].Init(control, controlSize);
+  this->transmitQueue[eTransmitClass_value].Init(value, valueSize);
+  this->transmitQueue[eTransmitClass_bulk].Init(bulk, bulkSize);
+  ctl_events_init(&this->transmitEvent, 0);
+}
+
+/***
+ *  Are messages waiting in any of the transmit queues?
+ ***/
+bool LoxCANQueuedDriver::TransmitPending(void) {
+  for (int c = 0; c < eTransmitClass_count; ++c)
+    if (this->transmitQueue[c].Count() > 0)
+      return true;
+  return false;
+}
+
+/***
+ *  Select the transmit class for the next message: strictly by priority, unless a
+ *  lower class waited for TRANSMIT_STARVATION_LIMIT messages. Returns -1, if all queues are empty.
+ ***/
+int LoxCANQueuedDriver::TransmitNextClass(void) {
+  int next = -1;
+  for (int c = 0; c < eTransmitClass_count; ++c) {
+    if (this->transmitQueue[c].Count() == 0)
+      continue;
+    if (next < 0 || this->transmitSkipped[c] >= TRANSMIT_STARVATION_LIMIT) {
+      next = c;
+      if (this->transmitSkipped[c] >= TRANSMIT_STARVATION_LIMIT)
+        break;
+    }
+  }
+  for (int c = 0; c < eTransmitClass_count; ++c) {
+    if (c == next)
+      this->transmitSkipped[c] = 0;
+    else if (this->transmitQueue[c].Count() > 0 && this->transmitSkipped[c] < TRANSMIT_STARVATION_LIMIT)
+      ++this->transmitSkipped[c];
+  }
+  return next;
+}
+
+/***
+ *  The oldest message of a class was handed to the hardware: remove it from the queue
+ *  and update the statistics.
+ ***/
+void LoxCANQueuedDriver::TransmitRemove(int transmitClass) {
+  CTL_TIME_t wait = ctl_get_current_time() - this->transmitQueue[transmitClass].Peek()->time;
+  if (wait > this->statistics.TC[transmitClass].mWait)
+    this->statistics.TC[transmitClass].mWait = wait;
+  this->transmitQueue[transmitClass].Remove();
+  this->statistics.TC[transmitClass].TQ = this->transmitQueue[transmitClass].Count();
+  unsigned tq = 0;
+  for (int i = 0; i < eTransmitClass_count; ++i)
+    tq += this->transmitQueue[i].Count();
+  this->statistics.TQ = tq;
+  ++this->statistics.Sent;
+}
+
+/***
+ *  Send a message by putting it into the transmission queue of its class.
+ *  The policy defines what happens, if the queue is full. A message of a fragmented package
+ *  uses an entry of its reservation in the class of the reservation, once it is used up, the
+ *  policy applies as well. eSendPolicy_dropOldest drops the new message, if the oldest one is a
+ *  fragment: removing it would leave the rest of its package useless on the bus.
+ ***/
+eSendStatus LoxCANQueuedDriver::SendMessage(LoxCanMessage &message, eSendPolicy policy, CTL_TIME_t timeout, tTransmitReservation *reservation) {
+#if DEBUG
+  debug_printf("CANS:");
+  message.print(*this);
+#endif
+  eTransmitClass c = reservation ? reservation->transmitClass : TransmitClass(message);
+  LoxCanTransmitQueue &queue = this->transmitQueue[c];
+  tTransmitEntry entry;
+  entry.message = message;
+  entry.time = ctl_get_current_time();
+  eSendStatus status;
+  while (1) {
+    bool queueFull = false;
+    int enabled = ctl_global_interrupts_disable(); // the transmit interrupt removes messages from the queue
+    tTransmitEntry *similar;
+    if (policy == eSendPolicy_coalesce && (similar = queue.FindSimilar(message)) != NULL) {
+      similar->message = message; // keep the position and time of the queued message
+      status = eSendStatus_coalesced;
+    } else if (reservation && reservation->count > 0) {
+      --reservation->count;
+      queue.AddReserved(entry);
+      status = eSendStatus_queued;
+    } else if (queue.Free() > 0) {
+      queue.Add(entry);
+      status = eSendStatus_queued;
+    } else if (policy == eSendPolicy_dropOldest && queue.Count() > 0 && TransmitClass(queue.Peek()->message) != eTransmitClass_bulk) { // never a fragment of a partly queued package
+      queue.Remove();
+      queue.Add(entry);
+      status = eSendStatus_droppedOldest;
+    } else {
+      queueFull = true;
+    }
+    unsigned tq = queue.Count();
+    ctl_global_interrupts_set(enabled);
+    if (!queueFull) {
+      if (tq > this->statistics.TC[c].mTQ)
+        this->statistics.TC[c].mTQ = tq;
+      break;
+    }
+    if (policy != eSendPolicy_block || ctl_get_current_time() - entry.time >= timeout) {
+      ++this->statistics.QOvf;
+      return (policy == eSendPolicy_block) ? eSendStatus_timeout : eSendStatus_dropped;
+    }
+    ctl_timeout_wait(ctl_get_current_time() + 1); // wait for the transmit interrupt to free an entry
+  }
+  if (status == eSendStatus_droppedOldest)
+    ++this->statistics.QOvf;
+  unsigned total = 0;
+  for (int i = 0; i < eTransmitClass_count; ++i)
+    total += this->transmitQueue[i].Count();
+  if (total > this->statistics.mTQ)
+    this->statistics.mTQ = total;
+  ctl_events_set_clear(&this->transmitEvent, eMainEvents_CanMessaged, 0); // wakeup the TX task
+  return status;
+}
+
+/***
+ *  Queue a message, which is sent by the TX task after the delay, and wakeup the TX task,
+ *  which waits till it is due
+ ***/
+eSendStatus LoxCANQueuedDriver::SendMessageDelayed(LoxCanMessage &message, CTL_TIME_t msDelay) {
+  int enabled = ctl_global_interrupts_disable(); // the transmit task removes due messages
+  bool added = this->deferredQueue.Add(message, ctl_get_current_time() + msDelay);
+  ctl_global_interrupts_set(enabled);
+  if (!added) {
+    ++this->statistics.QOvf;
+    return eSendStatus_dropped;
+  }
+  ctl_events_set_clear(&this->transmitEvent, eMainEvents_CanMessaged, 0);
+  return eSendStatus_queued;
+}
+
+/***
+ *  Send all deferred messages, which are due
+ ***/
+bool LoxCANQueuedDriver::TransmitDeferred(CTL_TIME_t *nextTime) {
+  while (1) {
+    LoxCanMessage message;
+    int enabled = ctl_global_interrupts_disable();
+    const tDeferredEntry *entry = this->deferredQueue.Peek();
+    bool due = entry && (int32_t)(ctl_get_current_time() - entry->time) >= 0;
+    if (due) {
+      message = entry->message;
+      this->deferredQueue.Remove();
+    } else if (entry) {
+      *nextTime = entry->time;
+    }
+    ctl_global_interrupts_set(enabled);
+    if (!due)
+      return entry != NULL;
+    SendMessage(message);
+  }
+}
+
+/***
+ *  Reserve entries in the transmit queue of a class for the following fragmented messages, in
+ *  addition to the reservations of other senders. Entries still reserved from a previous package of the
+ *  sender are returned first. Packages larger than the queue reserve the whole queue, the
+ *  remaining messages have to wait for free entries (eSendPolicy_block).
+ ***/
+bool LoxCANQueuedDriver::TransmitReserve(tTransmitReservation &reservation, int count, CTL_TIME_t timeout, eTransmitClass transmitClass) {
+  TransmitRelease(reservation);
+  reservation.transmitClass = transmitClass;
+  LoxCanTransmitQueue &queue = this->transmitQueue[transmitClass];
+  if (count > (int)queue.Size())
+    count = queue.Size();
+  CTL_TIME_t startTime = ctl_get_current_time();
+  while (1) {
+    int enabled = ctl_global_interrupts_disable();
+    bool available = queue.Free() >= (unsigned)count;
+    if (available)
+      queue.Reserve(count);
+    ctl_global_interrupts_set(enabled);
+    if (available) {
+      reservation.count = count;
+      return true;
+    }
+    if (ctl_get_current_time() - startTime >= timeout) {
+      ++this->statistics.QOvf;
+      return false;
+    }
+    ctl_timeout_wait(ctl_get_current_time() + 1); // wait for the transmit interrupt to free an entry
+  }
+}
+
+/***
+ *  Return the reserved entries, which the package did not use
+ ***/
+void LoxCANQueuedDriver::TransmitRelease(tTransmitReservation &reservation) {
+  if (reservation.count == 0)
+    return;
+  int enabled = ctl_global_interrupts_disable();
+  this->transmitQueue[reservation.transmitClass].Unreserve(reservation.count);
+  ctl_global_interrupts_set(enabled);
+  reservation.count = 0;
+}
@@ -0,0 +1,54 @@
+//
+//  LoxCANQueuedDriver.hpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxCANQueuedDriver_hpp
+#define LoxCANQueuedDriver_hpp
+
+#include "LoxCANBaseDriver.hpp"
+#include "LoxCanDeferredQueue.hpp"
+#include "LoxCanTransmitQueue.hpp"
+
+#ifndef MAX_DEFERRED_MESSAGES
+#define MAX_DEFERRED_MESSAGES (2 * MAX_EXTENSIONS) // messages waiting for their send time (see SendMessageDelayed), the emulated Tree devices wait in the Tree Base Extension
+#endif
+
+/***
+ *  Base class for drivers of a real CAN bus: the transmit queues per class, the send policies and
+ *  the timers of the extensions.
+ *  The subclass moves the queued messages to the hardware, with interrupts disabled while
+ *  touching the queues (see TransmitNextClass() and TransmitRemove()).
+ ***/
+class LoxCANQueuedDriver : public LoxCANBaseDriver {
+  uint8_t transmitSkipped[eTransmitClass_count]; // messages of higher classes sent, while this class was waiting
+  LoxTimerWheel timerWheel;
+  LoxCanDeferredQueue<MAX_DEFERRED_MESSAGES> deferredQueue;
+
+protected:
+  CTL_EVENT_SET_t transmitEvent; // eMainEvents_CanMessaged is set, whenever a message was queued
+  LoxCanTransmitQueue transmitQueue[eTransmitClass_count];
+
+  void TransmitInit(tTransmitEntry *control, unsigned controlSize, tTransmitEntry *value, unsigned valueSize, tTransmitEntry *bulk, unsigned bulkSize);
+  bool TransmitPending(void);
+  int TransmitNextClass(void);
+  void TransmitRemove(int transmitClass);
+  // send the deferred messages, which are due. Called by the transmit side, returns true
+  // and the due time of the next deferred message, if there is one.
+  bool TransmitDeferred(CTL_TIME_t *nextTime);
+
+public:
+  LoxCANQueuedDriver(tLoxCANDriverType type);
+
+  // send a message onto the CAN bus
+  eSendStatus SendMessage(LoxCanMessage &message, eSendPolicy policy = eSendPolicy_dropNewest, CTL_TIME_t timeout = 0, tTransmitReservation *reservation = NULL);
+  eSendStatus SendMessageDelayed(LoxCanMessage &message, CTL_TIME_t msDelay);
+  bool TransmitReserve(tTransmitReservation &reservation, int count, CTL_TIME_t timeout, eTransmitClass transmitClass = eTransmitClass_bulk);
+  void TransmitRelease(tTransmitReservation &reservation);
+  unsigned TransmitFree(eTransmitClass transmitClass) const { return this->transmitQueue[transmitClass].Free(); };
+  LoxTimerWheel &TimerWheel(void) { return this->timerWheel; };
+};
+
+#endif /* LoxCANQueuedDriver_hpp */
@@ -0,0 +1,79 @@
+//
+//  LoxCanDeferredQueue.hpp
+//
+//  Created by Markus Fritze on 18.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxCanDeferredQueue_hpp
+#define LoxCanDeferredQueue_hpp
+
+#include "LoxCanMessage.hpp"
+#include <ctl_api.h>
+#include <stddef.h>
+
+// a message to be transmitted later
+typedef struct {
+  LoxCanMessage message;
+  CTL_TIME_t time; // time, when the message is due
+} tDeferredEntry;
+
+/***
+ *  Messages waiting for their send time, as a binary min-heap by due time.
+ *  The queue does no locking: the callers have to disable interrupts.
+ ***/
+template <unsigned SIZE>
+class LoxCanDeferredQueue {
+  tDeferredEntry entries[SIZE];
+  unsigned count;
+
+  static bool Before(const tDeferredEntry &a, const tDeferredEntry &b) {
+    return (int32_t)(a.time - b.time) < 0;
+  }
+
+public:
+  LoxCanDeferredQueue() : count(0) {}
+
+  unsigned Count(void) const { return this->count; }
+
+  // the message due first or NULL
+  const tDeferredEntry *Peek(void) const {
+    return this->count ? &this->entries[0] : NULL;
+  }
+
+  // add a message, false if the queue is full
+  bool Add(const LoxCanMessage &message, CTL_TIME_t time) {
+    if (this->count == SIZE)
+      return false;
+    unsigned i = this->count++;
+    tDeferredEntry entry;
+    entry.message = message;
+    entry.time = time;
+    while (i > 0 && Before(entry, this->entries[(i - 1) / 2])) { // sift up
+      this->entries[i] = this->entries[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    this->entries[i] = entry;
+    return true;
+  }
+
+  // remove the message due first
+  void Remove(void) {
+    const tDeferredEntry &last = this->entries[--this->count];
+    unsigned i = 0;
+    while (1) { // sift down
+      unsigned child = 2 * i + 1;
+      if (child >= this->count)
+        break;
+      if (child + 1 < this->count && Before(this->entries[child + 1], this->entries[child]))
+        ++child;
+      if (!Before(this->entries[child], last))
+        break;
+      this->entries[i] = this->entries[child];
+      i = child;
+    }
+    this->entries[i] = last;
+  }
+};
+
+#endif /* LoxCanDeferredQueue_hpp */
@@ -0,0 +1,61 @@
+//
+//  LoxCanMessageRing.hpp
+//
+//  Created by Markus Fritze on 12.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxCanMessageRing_hpp
+#define LoxCanMessageRing_hpp
+
+#include "LoxCanMessage.hpp"
+#include <stddef.h>
+
+/***
+ *  Lock-free single-producer/single-consumer ring of CAN messages.
+ *  The producer (typically an interrupt) writes directly into the next free slot
+ *  and commits it, the consumer (a task) reads the messages in place and releases
+ *  them in batches. SIZE has to be a power of 2.
+ ***/
+template <unsigned SIZE>
+class LoxCanMessageRing {
+  static_assert((SIZE & (SIZE - 1)) == 0, "SIZE has to be a power of 2");
+  volatile uint32_t head; // only written by the producer
+  volatile uint32_t tail; // only written by the consumer
+  LoxCanMessage slots[SIZE];
+
+public:
+  LoxCanMessageRing() : head(0), tail(0) {}
+
+  // producer: next free slot or NULL, if the ring is full
+  LoxCanMessage *ProducerSlot(void) {
+    uint32_t h = this->head;
+    if (h - this->tail == SIZE)
+      return NULL;
+    return &this->slots[h & (SIZE - 1)];
+  }
+
+  // producer: make the slot returned by ProducerSlot() visible to the consumer
+  void ProducerCommit(void) {
+    __sync_synchronize(); // the message has to be written before the head moves
+    this->head = this->head + 1;
+  }
+
+  // consumer: number of messages available
+  unsigned Count(void) const {
+    return this->head - this->tail;
+  }
+
+  // consumer: access a message, index < Count()
+  LoxCanMessage &Peek(unsigned index) {
+    return this->slots[(this->tail + index) & (SIZE - 1)];
+  }
+
+  // consumer: free the oldest count messages for the producer
+  void Release(unsigned count) {
+    __sync_synchronize(); // all reads have to be done before the slots are reused
+    this->tail = this->tail + count;
+  }
+};
+
+#endif /* LoxCanMessageRing_hpp */
@@ -0,0 +1,87 @@
+//
+//  LoxCanTransmitQueue.hpp
+//
+//  Created by Markus Fritze on 14.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxCanTransmitQueue_hpp
+#define LoxCanTransmitQueue_hpp
+
+#include "LoxCanMessage.hpp"
+#include <ctl_api.h>
+#include <stddef.h>
+
+// a queued message to be transmitted
+typedef struct {
+  LoxCanMessage message;
+  CTL_TIME_t time; // time, when the message was queued
+} tTransmitEntry;
+
+/***
+ *  Queue of messages to be transmitted. Unlike a plain FIFO it allows replacing
+ *  queued messages and dropping the oldest one. The queue does no locking: the
+ *  producer has to disable interrupts, the consumer is the transmit interrupt.
+ ***/
+class LoxCanTransmitQueue {
+  tTransmitEntry *entries;
+  unsigned size;
+  unsigned head;           // next entry to be written
+  unsigned tail;           // oldest entry
+  volatile unsigned count; // number of queued entries
+  unsigned reserved;       // free entries reserved by TransmitReserve(), the sum of all reservations
+
+public:
+  void Init(tTransmitEntry *entries, unsigned size) {
+    this->entries = entries;
+    this->size = size;
+    this->head = this->tail = this->count = this->reserved = 0;
+  }
+
+  unsigned Size(void) const { return this->size; }
+  unsigned Count(void) const { return this->count; }
+  unsigned Free(void) const { return this->size - this->count - this->reserved; }
+  unsigned Reserved(void) const { return this->reserved; }
+  void Reserve(unsigned count) { this->reserved += count; }
+  void Unreserve(unsigned count) { this->reserved -= count; }
+
+  // oldest message or NULL
+  tTransmitEntry *Peek(void) {
+    return this->count ? &this->entries[this->tail] : NULL;
+  }
+
+  // remove the oldest message
+  void Remove(void) {
+    if (++this->tail == this->size)
+      this->tail = 0;
+    --this->count;
+  }
+
+  // add a message, a free entry is required
+  void Add(const tTransmitEntry &entry) {
+    this->entries[this->head] = entry;
+    if (++this->head == this->size)
+      this->head = 0;
+    ++this->count;
+  }
+
+  // add a message into an entry reserved by the sender
+  void AddReserved(const tTransmitEntry &entry) {
+    --this->reserved;
+    Add(entry);
+  }
+
+  // find the newest queued message with the same identifier and the same first two data bytes
+  tTransmitEntry *FindSimilar(const LoxCanMessage &message) {
+    unsigned index = this->head;
+    for (unsigned i = 0; i < this->count; ++i) {
+      index = (index == 0 ? this->size : index) - 1;
+      const LoxCanMessage &queued = this->entries[index].message;
+      if (queued.identifier == message.identifier && queued.can_data[0] == message.can_data[0] && queued.can_data[1] == message.can_data[1])
+        return &this->entries[index];
+    }
+    return NULL;
+  }
+};
+
+#endif /* LoxCanTransmitQueue_hpp */
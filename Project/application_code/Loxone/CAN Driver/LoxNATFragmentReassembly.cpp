@@ -0,0 +1,186 @@
+//
+//  LoxNATFragmentReassembly.cpp
+//
+//  Created by Markus Fritze on 18.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxNATFragmentReassembly.hpp"
+#include "global_functions.hpp"
+#if DEBUG
+#include <__cross_studio_io.h>
+#endif
+#include <string.h>
+
+LoxNATFragmentReassembly gNATFragments;
+
+LoxNATFragmentReassembly::LoxNATFragmentReassembly() {
+  memset(this->slots, 0, sizeof(this->slots));
+  memset(this->blockUsed, 0, sizeof(this->blockUsed));
+  memset(&this->statistics, 0, sizeof(this->statistics));
+}
+
+/***
+ *  The package of a driver with the NATs and direction of the message
+ ***/
+tNATFragmentSlot *LoxNATFragmentReassembly::Find(const LoxCANBaseDriver *owner, const LoxCanMessage &message) {
+  for (int i = 0; i < NAT_FRAGMENT_SLOTS; ++i) {
+    tNATFragmentSlot *slot = &this->slots[i];
+    if (slot->owner == owner && slot->extensionNAT == message.extensionNat && slot->deviceNAT == message.deviceNAT && slot->direction == message.directionNat)
+      return slot;
+  }
+  return NULL;
+}
+
+/***
+ *  First of blockCount free consecutive blocks, marked as used, or -1
+ ***/
+int LoxNATFragmentReassembly::AllocateBlocks(uint16_t blockCount) {
+  int run = 0;
+  for (int i = 0; i < NAT_FRAGMENT_POOL_BLOCKS; ++i) {
+    run = this->blockUsed[i] ? 0 : run + 1;
+    if (run == blockCount) {
+      int first = i + 1 - blockCount;
+      memset(&this->blockUsed[first], 1, blockCount);
+      return first;
+    }
+  }
+  return -1;
+}
+
+/***
+ *  Drop all packages, which did not receive any data for NAT_FRAGMENT_TIMEOUT
+ ***/
+void LoxNATFragmentReassembly::Expire(void) {
+  CTL_TIME_t now = ctl_get_current_time();
+  for (int i = 0; i < NAT_FRAGMENT_SLOTS; ++i) {
+    if (this->slots[i].owner && now - this->slots[i].time >= NAT_FRAGMENT_TIMEOUT) {
+      ++this->statistics.TOut;
+      Release(&this->slots[i]);
+    }
+  }
+}
+
+/***
+ *  A free slot with blockCount blocks, the oldest packages are evicted, if necessary
+ ***/
+tNATFragmentSlot *LoxNATFragmentReassembly::Allocate(uint16_t blockCount) {
+  Expire();
+  tNATFragmentSlot *slot = NULL;
+  for (int i = 0; i < NAT_FRAGMENT_SLOTS && !slot; ++i) {
+    if (!this->slots[i].owner)
+      slot = &this->slots[i];
+  }
+  int block = 0;
+  while (!slot || (blockCount && (block = AllocateBlocks(blockCount)) < 0)) {
+    tNATFragmentSlot *oldest = NULL;
+    for (int i = 0; i < NAT_FRAGMENT_SLOTS; ++i) {
+      if (this->slots[i].owner && (!oldest || (int32_t)(this->slots[i].time - oldest->time) < 0))
+        oldest = &this->slots[i];
+    }
+    if (!oldest)
+      return NULL;
+    ++this->statistics.Evict;
+    Release(oldest);
+    if (!slot)
+      slot = oldest;
+  }
+  slot->block = block;
+  slot->blockCount = blockCount;
+  return slot;
+}
+
+/***
+ *  Fragment_Start: the header with the command, size and CRC of the package
+ ***/
+void LoxNATFragmentReassembly::Start(const LoxCANBaseDriver *owner, const LoxCanMessage &message) {
+  tNATFragmentSlot *slot = Find(owner, message);
+  if (slot) { // the previous package was not completed
+    ++this->statistics.Evict;
+    Release(slot);
+  }
+  uint16_t size = message.value16;
+  if (size == 0)
+    return;
+  bool streamed = IsStreamed(LoxMsgNATCommand_t(message.value8));
+  uint16_t blockCount = streamed ? 0 : (size + NAT_FRAGMENT_BLOCK_SIZE - 1) / NAT_FRAGMENT_BLOCK_SIZE;
+  if (blockCount > NAT_FRAGMENT_POOL_BLOCKS) {
+    ++this->statistics.Size;
+    return;
+  }
+  slot = Allocate(blockCount);
+  if (!slot)
+    return;
+  slot->owner = owner;
+  slot->extensionNAT = message.extensionNat;
+  slot->deviceNAT = message.deviceNAT;
+  slot->direction = message.directionNat;
+  slot->command = LoxMsgNATCommand_t(message.value8);
+  slot->size = size;
+  slot->offset = 0;
+  slot->streamed = streamed;
+  slot->chunkSize = 0;
+  slot->valid = false;
+  slot->crc = message.value32;
+  crc32_stm32_stream_init(&slot->crcStream);
+  slot->time = ctl_get_current_time();
+  ++this->statistics.Start;
+}
+
+/***
+ *  Fragment_Data: the next 7 bytes of the package
+ ***/
+const tNATFragmentSlot *LoxNATFragmentReassembly::Data(const LoxCANBaseDriver *owner, const LoxCanMessage &message) {
+  tNATFragmentSlot *slot = Find(owner, message);
+  if (!slot) {
+    ++this->statistics.Orph;
+    return NULL;
+  }
+  int size = slot->size - slot->offset;
+  if (size > (int)sizeof(message.data))
+    size = sizeof(message.data);
+  if (!slot->streamed)
+    memcpy((uint8_t *)Buffer(slot) + slot->offset, message.data, size);
+  crc32_stm32_stream_add(&slot->crcStream, message.data, size);
+  slot->offset += size;
+  slot->chunkSize = size;
+  slot->time = ctl_get_current_time();
+  if (slot->offset != slot->size) // not enough bytes received?
+    return slot->streamed ? slot : NULL;
+  slot->valid = slot->crc == crc32_stm32_stream_result(&slot->crcStream);
+  if (!slot->valid) { // checksum wrong?
+    ++this->statistics.CRC;
+    if (slot->streamed) // the receivers have to drop the data, the driver releases the slot
+      return slot;
+    Release(slot);
+    return NULL;
+  }
+  ++this->statistics.Done;
+  return slot;
+}
+
+bool LoxNATFragmentReassembly::IsStreamed(LoxMsgNATCommand_t command) {
+  return command == Update_New;
+}
+
+const uint8_t *LoxNATFragmentReassembly::Buffer(const tNATFragmentSlot *slot) const {
+  return (const uint8_t *)this->pool + slot->block * NAT_FRAGMENT_BLOCK_SIZE;
+}
+
+void LoxNATFragmentReassembly::Release(const tNATFragmentSlot *slot) {
+  tNATFragmentSlot *s = &this->slots[slot - this->slots];
+  memset(&this->blockUsed[s->block], 0, s->blockCount);
+  s->owner = NULL;
+}
+
+#if DEBUG
+void LoxNATFragmentReassembly::StatisticsPrint() const {
+  debug_printf("Frag Start:%d;", this->statistics.Start);
+  debug_printf("Done:%d;", this->statistics.Done);
+  debug_printf("CRC:%d;", this->statistics.CRC);
+  debug_printf("Size:%d;", this->statistics.Size);
+  debug_printf("Evict:%d;", this->statistics.Evict);
+  debug_printf("TOut:%d;", this->statistics.TOut);
+  debug_printf("Orph:%d;\n", this->statistics.Orph);
+}
+#endif
@@ -0,0 +1,96 @@
+//
+//  LoxNATFragmentReassembly.hpp
+//
+//  Created by Markus Fritze on 18.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxNATFragmentReassembly_hpp
+#define LoxNATFragmentReassembly_hpp
+
+#include "LoxCanMessage.hpp"
+#include "global_functions.hpp"
+#include <ctl_api.h>
+
+class LoxCANBaseDriver;
+
+#ifndef NAT_FRAGMENT_SLOTS
+#define NAT_FRAGMENT_SLOTS 4 // fragmented packages reassembled at the same time, by all drivers
+#endif
+#ifndef NAT_FRAGMENT_POOL_BLOCKS
+#define NAT_FRAGMENT_POOL_BLOCKS 16 // shared buffer for all packages, up to 1024 blocks for the 64kb protocol limit
+#endif
+#define NAT_FRAGMENT_BLOCK_SIZE 64 // a package occupies consecutive blocks
+#define NAT_FRAGMENT_TIMEOUT 1000  // ms without a Fragment_Data, after which a package is dropped
+
+// a package being reassembled
+typedef struct {
+  const LoxCANBaseDriver *owner; // driver, which received the package, NULL = unused slot
+  uint8_t extensionNAT;          // key of the package, together with the owner
+  uint8_t deviceNAT;
+  uint8_t direction;
+  LoxMsgNATCommand_t command;
+  uint16_t size;
+  uint16_t offset; // bytes received so far
+  uint32_t crc;    // STM32 CRC32 over the package
+  tCRC32Stream crcStream; // CRC32 over the bytes received so far
+  uint16_t block;  // first block in the pool
+  uint16_t blockCount;
+  CTL_TIME_t time; // last Fragment_Start/Fragment_Data
+  bool streamed;     // the data is not buffered, but passed on with every Fragment_Data
+  uint8_t chunkSize; // streamed: bytes of the last Fragment_Data, they end at offset
+  bool valid;        // streamed: the package is complete and the CRC matched
+} tNATFragmentSlot;
+
+/***
+ *  Reassembly of fragmented NAT packages (Fragment_Start + Fragment_Data) for all drivers, once per
+ *  package and not in every extension receiving it. Packages are identified by the driver, extension
+ *  NAT, device NAT and direction, so interleaved packages (e.g. a broadcast during a directed package)
+ *  do not disturb each other. The data is collected in a shared pool of blocks. Stale packages are
+ *  dropped lazily, when their slot or their blocks are needed. All calls happen in the CAN RX task,
+ *  so no locking is done.
+ ***/
+class LoxNATFragmentReassembly {
+  tNATFragmentSlot slots[NAT_FRAGMENT_SLOTS];
+  uint32_t pool[NAT_FRAGMENT_POOL_BLOCKS * NAT_FRAGMENT_BLOCK_SIZE / sizeof(uint32_t)]; // word aligned for the extensions
+  uint8_t blockUsed[NAT_FRAGMENT_POOL_BLOCKS];
+
+  tNATFragmentSlot *Find(const LoxCANBaseDriver *owner, const LoxCanMessage &message);
+  tNATFragmentSlot *Allocate(uint16_t blockCount);
+  int AllocateBlocks(uint16_t blockCount);
+  void Expire(void);
+
+public:
+  struct {
+    uint32_t Start; // packages started
+    uint32_t Done;  // packages completely received with a correct CRC
+    uint32_t CRC;   // packages with a wrong CRC
+    uint32_t Size;  // packages dropped, because they are larger than the pool
+    uint32_t Evict; // incomplete packages dropped to make room for a new one
+    uint32_t TOut;  // incomplete packages dropped after NAT_FRAGMENT_TIMEOUT
+    uint32_t Orph;  // Fragment_Data without a matching package
+  } statistics;
+
+  LoxNATFragmentReassembly();
+
+  // a Fragment_Start was received by a driver
+  void Start(const LoxCANBaseDriver *owner, const LoxCanMessage &message);
+  // a Fragment_Data was received, returns the package, once it is complete and the CRC matched.
+  // The CRC is updated with every Fragment_Data, so the completion does not touch the data again.
+  // A streamed package is returned with every Fragment_Data, the data is in the message.
+  const tNATFragmentSlot *Data(const LoxCANBaseDriver *owner, const LoxCanMessage &message);
+  // packages, which are too large to be buffered (firmware updates), they are passed on as they arrive
+  static bool IsStreamed(LoxMsgNATCommand_t command);
+  // the data of a package
+  const uint8_t *Buffer(const tNATFragmentSlot *slot) const;
+  // a complete package was handled, the slot and its blocks are free again
+  void Release(const tNATFragmentSlot *slot);
+
+#if DEBUG
+  void StatisticsPrint() const;
+#endif
+};
+
+extern LoxNATFragmentReassembly gNATFragments;
+
+#endif /* LoxNATFragmentReassembly_hpp */
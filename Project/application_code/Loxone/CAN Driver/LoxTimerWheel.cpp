@@ -0,0 +1,101 @@
+//
+//  LoxTimerWheel.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxTimerWheel.hpp"
+#include "LoxExtension.hpp"
+#include <string.h>
+
+LoxTimerWheel::LoxTimerWheel() : tick(0) {
+  memset(this->slots, 0, sizeof(this->slots));
+  this->time = ctl_get_current_time() + TIMER_WHEEL_TICK;
+}
+
+/***
+ *  Link a timer into the slot for its distance to the current tick
+ ***/
+void LoxTimerWheel::Insert(LoxTimer &timer) {
+  uint32_t delta = timer.tick - this->tick;
+  LoxTimer **slot;
+  if ((int32_t)delta < 0) { // already due: the next tick
+    slot = &this->slots[0][this->tick & (TIMER_WHEEL_SLOTS - 1)];
+  } else {
+    if (delta > TIMER_WHEEL_MAX_TICKS) {
+      delta = TIMER_WHEEL_MAX_TICKS;
+      timer.tick = this->tick + delta;
+    }
+    int level = 0;
+    while (delta >= (1UL << (TIMER_WHEEL_BITS * (level + 1))))
+      ++level;
+    slot = &this->slots[level][(timer.tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+  }
+  timer.next = *slot;
+  if (timer.next)
+    timer.next->pprev = &timer.next;
+  *slot = &timer;
+  timer.pprev = slot;
+}
+
+void LoxTimerWheel::Schedule(LoxTimer &timer, CTL_TIME_t msDelay) {
+  Cancel(timer);
+  timer.tick = this->tick + (msDelay + TIMER_WHEEL_TICK - 1) / TIMER_WHEEL_TICK; // the next tick is already up to one tick away
+  Insert(timer);
+}
+
+void LoxTimerWheel::Cancel(LoxTimer &timer) {
+  if (!timer.pprev)
+    return;
+  *timer.pprev = timer.next;
+  if (timer.next)
+    timer.next->pprev = timer.pprev;
+  timer.next = NULL;
+  timer.pprev = NULL;
+}
+
+/***
+ *  Move the timers of the current slot of a level one level down, returns the slot index
+ ***/
+uint32_t LoxTimerWheel::Cascade(int level) {
+  uint32_t index = (this->tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  LoxTimer *list = this->slots[level][index];
+  this->slots[level][index] = NULL;
+  if (list)
+    list->pprev = &list;
+  while (list) {
+    LoxTimer *timer = list;
+    Cancel(*timer);
+    Insert(*timer);
+  }
+  return index;
+}
+
+/***
+ *  Expire all timers of the current tick. A timer can be scheduled or cancelled again while
+ *  the timers are called, even one, which is due in the same tick.
+ ***/
+void LoxTimerWheel::RunTick(void) {
+  uint32_t index = this->tick & (TIMER_WHEEL_SLOTS - 1);
+  for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; ++level)
+    index = Cascade(level);
+  index = this->tick & (TIMER_WHEEL_SLOTS - 1);
+  ++this->tick;
+  LoxTimer *list = this->slots[0][index];
+  this->slots[0][index] = NULL;
+  if (list)
+    list->pprev = &list;
+  while (list) {
+    LoxTimer *timer = list;
+    Cancel(*timer);
+    timer->owner->TimerExpired(*timer);
+  }
+}
+
+void LoxTimerWheel::Advance(CTL_TIME_t now) {
+  while ((int32_t)(now - this->time) >= 0) {
+    this->time += TIMER_WHEEL_TICK;
+    RunTick();
+  }
+}
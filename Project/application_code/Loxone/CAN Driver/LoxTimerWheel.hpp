@@ -0,0 +1,66 @@
+//
+//  LoxTimerWheel.hpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxTimerWheel_hpp
+#define LoxTimerWheel_hpp
+
+#include <ctl_api.h>
+#include <stddef.h>
+#include <stdint.h>
+
+class LoxExtension;
+
+#define TIMER_WHEEL_TICK 10   // ms per tick
+#define TIMER_WHEEL_BITS 6    // 64 slots per level
+#define TIMER_WHEEL_LEVELS 4  // 4 levels cover 2^24 ticks = 46h
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MAX_TICKS ((1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/***
+ *  A deadline of an extension. When it expires, LoxExtension::TimerExpired() is called with it.
+ ***/
+class LoxTimer {
+  friend class LoxTimerWheel;
+  LoxTimer *next;   // next timer in the same slot
+  LoxTimer **pprev; // pointer to this timer in the slot, NULL = not scheduled
+  uint32_t tick;    // tick, at which the timer expires
+
+public:
+  LoxExtension *const owner;
+
+  LoxTimer(LoxExtension *owner) : next(NULL), pprev(NULL), tick(0), owner(owner) {}
+  bool Scheduled(void) const { return this->pprev != NULL; }
+};
+
+/***
+ *  Hierarchical timer wheel with 10ms ticks. A timer is kept in a slot of the level, which
+ *  covers its distance, and cascades down a level, when the level below wraps around. Scheduling
+ *  and cancelling are O(1), a tick only touches the due timers and every 64th tick a cascading
+ *  slot. Timers, which are not scheduled, cost nothing. The wheel does no locking: all calls
+ *  happen in the CAN RX task of the driver owning it.
+ ***/
+class LoxTimerWheel {
+  LoxTimer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+  uint32_t tick;   // next tick to be processed
+  CTL_TIME_t time; // time of the next tick
+
+  void Insert(LoxTimer &timer);
+  uint32_t Cascade(int level);
+  void RunTick(void);
+
+public:
+  LoxTimerWheel();
+
+  // (re)start a timer, it expires not before msDelay
+  void Schedule(LoxTimer &timer, CTL_TIME_t msDelay);
+  // stop a timer, it is fine, if it is not scheduled
+  void Cancel(LoxTimer &timer);
+  // process all ticks up to the current time, called every 10ms
+  void Advance(CTL_TIME_t now);
+};
+
+#endif /* LoxTimerWheel_hpp */
@@ -0,0 +1,371 @@
+//
+//  LoxFirmwareUpdate.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxFirmwareUpdate.hpp"
+#include "stm32f1xx_hal.h" // NVIC_SystemReset
+#include <__cross_studio_io.h>
+#include <stddef.h>
+#include <string.h>
+
+LoxFirmwareUpdate gFirmwareUpdate(gFlash);
+
+LoxFirmwareUpdate::LoxFirmwareUpdate(LoxFlash &flash) : flash(flash), active(false), updateBytes(0), firstWriteTime(0), lastWriteTime(0), resetPending(false) {
+  memset(&this->statistics, 0, sizeof(this->statistics));
+}
+
+/***
+ *  The slot containing the vector table of the running firmware. The boot record only names the
+ *  slot the bootloader tried to start last, which is not necessarily the running one.
+ ***/
+uint32_t LoxFirmwareUpdate::RunningSlot(void) {
+  uint32_t image = this->flash.RunningImage();
+  if (image >= LOXFLASH_SLOT_A && image < LOXFLASH_SLOT_A + LOXFLASH_SLOT_SIZE)
+    return LOXFLASH_SLOT_A;
+  if (image >= LOXFLASH_SLOT_B && image < LOXFLASH_SLOT_B + LOXFLASH_SLOT_SIZE)
+    return LOXFLASH_SLOT_B;
+  return 0;
+}
+
+bool LoxFirmwareUpdate::Active(uint32_t version) const {
+  return this->active && this->version == version;
+}
+
+/***
+ *  Begin an update into the other slot, the first page is erased right away. A firmware, which is
+ *  not linked to a slot, runs from the flash of slot A, so there is no slot to write to.
+ ***/
+void LoxFirmwareUpdate::Start(uint32_t version, uint16_t pageSize) {
+  uint32_t running = RunningSlot();
+  this->active = running != 0;
+  this->version = version;
+  this->slot = running == LOXFLASH_SLOT_A ? LOXFLASH_SLOT_B : LOXFLASH_SLOT_A;
+  this->pageSize = pageSize;
+  this->size = 0;
+  memset(this->erased, 0, sizeof(this->erased));
+  this->crcReceived = 0;
+  this->pageStreamed = 0;
+  this->pageError = 0;
+  this->pageMissing = 0;
+  crc32_stm32_stream_init(&this->stream);
+  this->streamOffset = 0;
+  this->resumeOffset = 0;
+  this->pendingValid = false;
+  this->updateBytes = 0;
+  if (!this->active)
+    ++this->statistics.Err;
+  else if (ErasePage(0))
+    ++this->statistics.EraseAhead;
+}
+
+/***
+ *  Start erasing a flash page of the slot, the slot of the running firmware is never touched
+ ***/
+bool LoxFirmwareUpdate::ErasePage(uint32_t page) {
+  if (!this->active || this->slot == RunningSlot() || page >= LOXFLASH_SLOT_SIZE / LOXFLASH_PAGE_SIZE)
+    return false;
+  if (!this->flash.EraseStart(this->slot + page * LOXFLASH_PAGE_SIZE))
+    return false;
+  this->erased[page >> 3] |= 1 << (page & 7);
+  return true;
+}
+
+/***
+ *  Erase the flash pages for data, which were not erased ahead
+ ***/
+bool LoxFirmwareUpdate::EnsureErased(uint32_t offset, size_t size) {
+  for (uint32_t page = offset / LOXFLASH_PAGE_SIZE; page <= (offset + size - 1) / LOXFLASH_PAGE_SIZE; ++page) {
+    if (this->erased[page >> 3] & (1 << (page & 7)))
+      continue;
+    ++this->statistics.EraseStall;
+    this->flash.Wait(); // erase of another page still running
+    if (!ErasePage(page))
+      return false;
+  }
+  return true;
+}
+
+/***
+ *  Continue the CRC of the current page. The CRC of a page is only valid, if all its data arrived in order.
+ ***/
+void LoxFirmwareUpdate::StreamAdd(uint32_t offset, const uint8_t *data, size_t size) {
+  while (size > 0) {
+    size_t count = this->pageSize - offset % this->pageSize; // up to the end of the page
+    if (count > size)
+      count = size;
+    if (offset % this->pageSize == 0) { // a page starts
+      crc32_stm32_stream_init(&this->stream);
+      this->streamOffset = offset;
+    }
+    if (offset == this->streamOffset) {
+      crc32_stm32_stream_add(&this->stream, data, count);
+      this->streamOffset += count;
+      uint32_t page = offset / this->pageSize;
+      if (this->streamOffset % this->pageSize == 0 && page < FIRMWARE_UPDATE_MAX_PAGES) { // page complete
+        this->pageCRC[page] = crc32_stm32_stream_result(&this->stream);
+        this->pageStreamed |= 1ULL << page;
+        this->pageMissing &= ~(1ULL << page);
+      }
+    } else {
+      this->streamOffset = NO_STREAM;
+    }
+    offset += count;
+    data += count;
+    size -= count;
+  }
+}
+
+/***
+ *  Program even-sized data at an even offset. Data, which is already in the flash (e.g. a repeated
+ *  block), is not programmed again.
+ ***/
+bool LoxFirmwareUpdate::Program(uint32_t offset, const uint8_t *data, size_t size) {
+  bool ok = EnsureErased(offset, size);
+  if (ok && memcmp(this->flash.Read(this->slot + offset), data, size) != 0)
+    ok = this->flash.Program(this->slot + offset, data, size);
+  if (!ok)
+    MarkError(offset);
+  return ok;
+}
+
+void LoxFirmwareUpdate::MarkError(uint32_t offset) {
+  ++this->statistics.Err;
+  if (offset / this->pageSize < FIRMWARE_UPDATE_MAX_PAGES)
+    this->pageError |= 1ULL << (offset / this->pageSize);
+}
+
+/***
+ *  Data at an offset of the firmware. The flash is programmed in halfwords, a trailing odd byte is
+ *  kept until the following byte arrives. Without it (data out of order), the page is marked as wrong.
+ ***/
+bool LoxFirmwareUpdate::Write(uint32_t offset, const void *data, size_t size) {
+  if (!this->active || size == 0 || offset + size > LOXFLASH_SLOT_SIZE)
+    return false;
+  CTL_TIME_t now = ctl_get_current_time();
+  if (this->updateBytes == 0)
+    this->firstWriteTime = now;
+  this->lastWriteTime = now;
+  this->updateBytes += size;
+  this->statistics.Bytes += size;
+  const uint8_t *dp = (const uint8_t *)data;
+  uint32_t page = offset / this->pageSize;
+  // a repeated page replaces the CRC calculated before
+  if (offset % this->pageSize == 0 && page < FIRMWARE_UPDATE_MAX_PAGES)
+    this->pageStreamed &= ~(1ULL << page);
+  StreamAdd(offset, dp, size);
+  if (offset <= this->resumeOffset && offset + size > this->resumeOffset)
+    this->resumeOffset = offset + size;
+  if (offset + size > this->size)
+    this->size = offset + size;
+
+  bool ok = true;
+  if (this->pendingValid) {
+    this->pendingValid = false;
+    if (offset == this->pendingOffset + 1) { // complete the halfword
+      uint8_t halfword[2] = {this->pendingByte, *dp};
+      ok = Program(this->pendingOffset, halfword, sizeof(halfword));
+      ++offset;
+      ++dp;
+      --size;
+    } else {
+      MarkError(this->pendingOffset);
+      ok = false;
+    }
+  }
+  if (size && (offset & 1)) { // the first byte of the halfword is missing
+    MarkError(offset);
+    ok = false;
+    ++offset;
+    ++dp;
+    --size;
+  }
+  if (size >= 2)
+    ok = Program(offset, dp, size & ~1) && ok;
+  if (size & 1) {
+    this->pendingValid = true;
+    this->pendingOffset = offset + size - 1;
+    this->pendingByte = dp[size - 1];
+  }
+  return ok;
+}
+
+/***
+ *  Position, up to which the firmware was received without a gap
+ ***/
+uint32_t LoxFirmwareUpdate::ResumeOffset(void) const {
+  return this->active ? this->resumeOffset : 0;
+}
+
+/***
+ *  Received bytes per second
+ ***/
+uint32_t LoxFirmwareUpdate::Throughput(void) const {
+  CTL_TIME_t duration = this->lastWriteTime - this->firstWriteTime;
+  return duration ? (uint64_t)this->updateBytes * 1000 / duration : 0;
+}
+
+/***
+ *  The data of a range has to be received again. Flash can only be programmed after an erase, so
+ *  the flash pages holding it are erased again by the timer, which makes all pages in them missing.
+ *  The data before and after these flash pages is kept.
+ ***/
+uint32_t LoxFirmwareUpdate::Rewind(uint32_t offset, uint32_t size) {
+  if (!this->active)
+    return 0;
+  uint32_t start = offset - offset % LOXFLASH_PAGE_SIZE;
+  uint32_t end = offset + (size ? size : 1) + LOXFLASH_PAGE_SIZE - 1;
+  end -= end % LOXFLASH_PAGE_SIZE;
+  for (uint32_t page = start / LOXFLASH_PAGE_SIZE; page < end / LOXFLASH_PAGE_SIZE && page < LOXFLASH_SLOT_SIZE / LOXFLASH_PAGE_SIZE; ++page)
+    this->erased[page >> 3] &= ~(1 << (page & 7));
+  for (uint32_t page = start / this->pageSize; page * this->pageSize < end && page < FIRMWARE_UPDATE_MAX_PAGES; ++page) {
+    this->pageStreamed &= ~(1ULL << page);
+    this->pageError &= ~(1ULL << page);
+    this->pageMissing |= 1ULL << page;
+  }
+  if (this->pendingValid && this->pendingOffset >= start && this->pendingOffset < end)
+    this->pendingValid = false;
+  if (this->resumeOffset > start)
+    this->resumeOffset = start;
+  if (this->streamOffset >= start && this->streamOffset <= end)
+    this->streamOffset = NO_STREAM;
+  ++this->statistics.Rewind;
+  return start;
+}
+
+uint32_t LoxFirmwareUpdate::MissingPage(void) const {
+  for (uint32_t page = 0; this->active && page < FIRMWARE_UPDATE_MAX_PAGES; ++page) {
+    if (this->pageMissing & (1ULL << page))
+      return page;
+  }
+  return FIRMWARE_UPDATE_MAX_PAGES;
+}
+
+/***
+ *  Was the flash of a range never programmed since its erase?
+ ***/
+bool LoxFirmwareUpdate::Blank(uint32_t offset, size_t size) {
+  uint32_t page = offset / LOXFLASH_PAGE_SIZE;
+  if (!(this->erased[page >> 3] & (1 << (page & 7))))
+    return false;
+  const uint8_t *flash = this->flash.Read(this->slot + offset);
+  for (size_t i = 0; i < size; ++i) {
+    if (flash[i] != 0xFF)
+      return false;
+  }
+  return true;
+}
+
+void LoxFirmwareUpdate::SetPageCRC(uint32_t page, uint32_t crc) {
+  if (!this->active || page >= FIRMWARE_UPDATE_MAX_PAGES)
+    return;
+  this->expectedCRC[page] = crc;
+  this->crcReceived |= 1ULL << page;
+}
+
+/***
+ *  Compare the CRCs of all pages, only pages received out of order are read from the flash. A wrong
+ *  page, which was never programmed since the erase of its flash page, is only missing. Otherwise
+ *  its flash page is erased again, see Rewind(). badPage is the first page to receive again.
+ ***/
+bool LoxFirmwareUpdate::Verify(uint32_t pageCount, uint32_t *badPage, uint32_t *badCRC) {
+  bool ok = this->active && pageCount <= FIRMWARE_UPDATE_MAX_PAGES && pageCount * this->pageSize <= LOXFLASH_SLOT_SIZE;
+  *badPage = 0;
+  *badCRC = 0;
+  if (ok && this->pendingValid) { // the firmware ends with an odd byte
+    uint8_t halfword[2] = {this->pendingByte, 0xFF};
+    this->pendingValid = false;
+    Program(this->pendingOffset, halfword, sizeof(halfword));
+  }
+  bool wrong = false;
+  this->pageMissing = 0;
+  for (uint32_t page = 0; ok && page < pageCount; ++page) {
+    uint32_t offset = page * this->pageSize;
+    uint32_t flashPage = offset / LOXFLASH_PAGE_SIZE;
+    uint32_t crc;
+    if (this->pageStreamed & (1ULL << page))
+      crc = this->pageCRC[page];
+    else
+      crc = crc32_stm32_aligned(this->flash.Read(this->slot + offset), this->pageSize);
+    if (!(this->erased[flashPage >> 3] & (1 << (flashPage & 7))) || !(this->crcReceived & (1ULL << page)) || (this->pageError & (1ULL << page)) || crc != this->expectedCRC[page]) {
+      if (!wrong)
+        *badCRC = crc;
+      wrong = true;
+      if (!(this->erased[flashPage >> 3] & (1 << (flashPage & 7))) || (!(this->pageError & (1ULL << page)) && Blank(offset, this->pageSize)))
+        this->pageMissing |= 1ULL << page; // the flash page is erased before it is programmed
+      else
+        Rewind(offset, this->pageSize);
+    }
+  }
+  if (ok && wrong) {
+    *badPage = MissingPage();
+    ok = false;
+  }
+  if (ok)
+    ++this->statistics.Verify;
+  else
+    ++this->statistics.VErr;
+  return ok;
+}
+
+/***
+ *  Write the boot record for the new slot after a successful Verify(). The reset follows in the timer.
+ ***/
+bool LoxFirmwareUpdate::Activate(uint32_t pageCount) {
+  if (!this->active)
+    return false;
+  tFirmwareBootRecord record;
+  record.magic = FIRMWARE_UPDATE_BOOT_MAGIC;
+  record.slot = this->slot;
+  record.version = this->version;
+  record.size = pageCount * this->pageSize;
+  record.crc = crc32_stm32_aligned(&record, offsetof(tFirmwareBootRecord, crc));
+  this->flash.Wait();
+  if (!this->flash.EraseStart(LOXFLASH_BOOT_RECORD) || !this->flash.Program(LOXFLASH_BOOT_RECORD, &record, sizeof(record))) {
+    ++this->statistics.Err;
+    return false;
+  }
+  this->active = false;
+  this->resetPending = true;
+  this->resetTime = ctl_get_current_time() + FIRMWARE_UPDATE_RESET_DELAY;
+  return true;
+}
+
+/***
+ *  Erase the flash pages, which were rewound, and the ones following the received data, one page at a time
+ ***/
+void LoxFirmwareUpdate::Timer10ms(void) {
+  if (this->resetPending && (int32_t)(ctl_get_current_time() - this->resetTime) >= 0) {
+    this->resetPending = false;
+    NVIC_SystemReset(); // start the new firmware
+  }
+  if (!this->active || this->flash.Busy())
+    return;
+  uint32_t first = this->size / LOXFLASH_PAGE_SIZE;
+  for (uint32_t page = 0; page <= first + FIRMWARE_UPDATE_ERASE_AHEAD && page < LOXFLASH_SLOT_SIZE / LOXFLASH_PAGE_SIZE; ++page) {
+    if (this->erased[page >> 3] & (1 << (page & 7)))
+      continue;
+    if (ErasePage(page)) {
+      ++this->statistics.EraseAhead;
+    } else {
+      ++this->statistics.Err;
+    }
+    break;
+  }
+}
+
+#if DEBUG
+void LoxFirmwareUpdate::StatisticsPrint() const {
+  debug_printf("Update Bytes:%d;", this->statistics.Bytes);
+  debug_printf("EraseAhead:%d;", this->statistics.EraseAhead);
+  debug_printf("EraseStall:%d;", this->statistics.EraseStall);
+  debug_printf("Err:%d;", this->statistics.Err);
+  debug_printf("Verify:%d;", this->statistics.Verify);
+  debug_printf("VErr:%d;", this->statistics.VErr);
+  debug_printf("Rewind:%d;", this->statistics.Rewind);
+  debug_printf("Resume:%d;", ResumeOffset());
+  debug_printf("B/s:%d;\n", Throughput());
+}
+#endif
@@ -0,0 +1,120 @@
+//
+//  LoxFirmwareUpdate.hpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxFirmwareUpdate_hpp
+#define LoxFirmwareUpdate_hpp
+
+#include "LoxFlash.hpp"
+#include "crc.hpp"
+#include <ctl_api.h>
+
+#define FIRMWARE_UPDATE_MAX_PAGES 64           // number of page CRCs the Miniserver can send
+#define FIRMWARE_UPDATE_ERASE_AHEAD 2          // flash pages erased ahead of the received data
+#define FIRMWARE_UPDATE_RESET_DELAY 100        // ms between the activation and the reset, to send the reply
+#define FIRMWARE_UPDATE_BOOT_MAGIC 0x544F4F42  // 'BOOT'
+
+// Last page of the flash: which slot the bootloader has to start, see LoxFlash.hpp
+typedef struct {
+  uint32_t magic;
+  uint32_t slot;    // address of the slot to start
+  uint32_t version; // firmware version in the slot
+  uint32_t size;    // bytes of the firmware
+  uint32_t crc;     // STM32 CRC32 over the fields above
+} tFirmwareBootRecord;
+
+/***
+ *  Firmware update into the slot, which is not running. The running slot is taken from the vector
+ *  table of the running firmware, never from the boot record, and it is never erased. The data is programmed, as it arrives, the
+ *  flash pages are erased ahead in the 10ms timer, so an erase does not stall the reception. The
+ *  CRC of every verify page is calculated while its data arrives, so a verify only compares the
+ *  CRCs. Pages, which arrived out of order, are read back from the flash instead. An interrupted
+ *  or failed update only receives the missing or wrong pages again, it does not start over.
+ *  All calls happen in the CAN RX task, so no locking is done.
+ ***/
+class LoxFirmwareUpdate {
+  LoxFlash &flash;
+  bool active;
+  uint32_t version;  // firmware version being received
+  uint32_t slot;     // address of the slot being written
+  uint16_t pageSize; // bytes covered by one CRC of the Miniserver
+  uint32_t size;     // end of the received data
+  uint8_t erased[(LOXFLASH_SLOT_SIZE / LOXFLASH_PAGE_SIZE + 7) / 8]; // erased flash pages of the slot
+  uint32_t expectedCRC[FIRMWARE_UPDATE_MAX_PAGES]; // from the Miniserver
+  uint32_t pageCRC[FIRMWARE_UPDATE_MAX_PAGES];     // calculated while receiving
+  uint64_t crcReceived;                            // bitmaps of the pages
+  uint64_t pageStreamed;
+  uint64_t pageError;
+  uint64_t pageMissing;                            // found by Verify() or Rewind(), until they arrive again
+  tCRC32Stream stream;   // CRC of the current page
+  uint32_t streamOffset; // offset continuing the current page, NO_STREAM = not in order
+  uint32_t resumeOffset; // end of the data received without a gap
+  bool pendingValid;     // a byte waits for the second byte of its halfword
+  uint8_t pendingByte;
+  uint32_t pendingOffset;
+  uint32_t updateBytes; // bytes received for this update
+  CTL_TIME_t firstWriteTime;
+  CTL_TIME_t lastWriteTime;
+  bool resetPending;
+  CTL_TIME_t resetTime;
+
+  static const uint32_t NO_STREAM = 0xFFFFFFFF;
+  bool ErasePage(uint32_t page);
+  bool EnsureErased(uint32_t offset, size_t size);
+  bool Program(uint32_t offset, const uint8_t *data, size_t size);
+  void MarkError(uint32_t offset);
+  bool Blank(uint32_t offset, size_t size);
+  void StreamAdd(uint32_t offset, const uint8_t *data, size_t size);
+
+public:
+  struct {
+    uint32_t Bytes;      // bytes received
+    uint32_t EraseAhead; // pages erased by the timer
+    uint32_t EraseStall; // pages, which had to be erased when their data arrived
+    uint32_t Err;        // erase or programming errors
+    uint32_t Verify;     // successful verifies
+    uint32_t VErr;       // failed verifies
+    uint32_t Rewind;     // data, which had to be received again
+  } statistics;
+
+  LoxFirmwareUpdate(LoxFlash &flash);
+
+  // slot of the running firmware, 0 = not linked to a slot, it can not be updated
+  uint32_t RunningSlot(void);
+  // is an update of this version running?
+  bool Active(uint32_t version) const;
+  // begin a new update. pageSize is the size covered by one CRC. Without a running slot, all data is rejected.
+  void Start(uint32_t version, uint16_t pageSize);
+  // data for an offset in the firmware
+  bool Write(uint32_t offset, const void *data, size_t size);
+  // end of the data received without a gap, an interrupted update can continue from here
+  uint32_t ResumeOffset(void) const;
+  // the data of this range has to be received again, returns the start of the invalidated flash pages
+  uint32_t Rewind(uint32_t offset, uint32_t size);
+  // first page, which has to be received again, FIRMWARE_UPDATE_MAX_PAGES = none
+  uint32_t MissingPage(void) const;
+  // received bytes per second of this update
+  uint32_t Throughput(void) const;
+  // expected CRC of a page
+  void SetPageCRC(uint32_t page, uint32_t crc);
+  // check the CRCs of the first pageCount pages. Wrong pages have to be received again, badPage
+  // is the first of them, badCRC the CRC of the first wrong page.
+  bool Verify(uint32_t pageCount, uint32_t *badPage, uint32_t *badCRC);
+  // after a successful Verify(): start the new firmware after the reset delay
+  bool Activate(uint32_t pageCount);
+  // 10ms Timer to be called 100x per second, it can be called by several extensions
+  void Timer10ms(void);
+  // the timer is needed while an update is received or the reset is pending
+  bool TimerNeeded(void) const { return this->active || this->resetPending; };
+
+#if DEBUG
+  void StatisticsPrint() const;
+#endif
+};
+
+extern LoxFirmwareUpdate gFirmwareUpdate;
+
+#endif /* LoxFirmwareUpdate_hpp */
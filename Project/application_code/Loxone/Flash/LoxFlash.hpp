@@ -0,0 +1,49 @@
+//
+//  LoxFlash.hpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxFlash_hpp
+#define LoxFlash_hpp
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Flash layout of the STM32F103VE (512kb, 2kb pages) for firmware updates: a bootloader, two slots
+// for the firmware and the boot record in the last page, which names the slot to start. The bootloader
+// is not part of this project, the firmware has to be linked to LOXFLASH_SLOT_A or LOXFLASH_SLOT_B.
+// A firmware linked to the start of the flash runs without it, but can not be updated.
+#define LOXFLASH_BASE 0x08000000
+#define LOXFLASH_SIZE 0x80000
+#define LOXFLASH_PAGE_SIZE 2048
+#define LOXFLASH_BOOTLOADER_SIZE 0x4000 // 16kb
+#define LOXFLASH_SLOT_SIZE 0x3D800      // 246kb
+#define LOXFLASH_SLOT_A (LOXFLASH_BASE + LOXFLASH_BOOTLOADER_SIZE)
+#define LOXFLASH_SLOT_B (LOXFLASH_SLOT_A + LOXFLASH_SLOT_SIZE)
+#define LOXFLASH_BOOT_RECORD (LOXFLASH_BASE + LOXFLASH_SIZE - LOXFLASH_PAGE_SIZE)
+
+/***
+ *  Access to the internal flash. The flash is memory mapped, so it can be read directly.
+ ***/
+class LoxFlash {
+public:
+  // an erase is still running
+  virtual bool Busy(void) = 0;
+  // wait for the end of a running erase
+  virtual void Wait(void) = 0;
+  // start erasing the page at the address, without waiting for the end of the erase
+  virtual bool EraseStart(uint32_t address) = 0;
+  // program erased flash, size has to be even. Waits for a running erase.
+  virtual bool Program(uint32_t address, const void *data, size_t size) = 0;
+  // pointer to the flash at an address
+  virtual const uint8_t *Read(uint32_t address) = 0;
+  // address of the vector table of the running firmware
+  virtual uint32_t RunningImage(void) = 0;
+};
+
+// the flash of the hardware, on the host a simulation
+extern LoxFlash &gFlash;
+
+#endif /* LoxFlash_hpp */
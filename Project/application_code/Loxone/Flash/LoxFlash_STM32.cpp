@@ -0,0 +1,85 @@
+//
+//  LoxFlash_STM32.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxFlash_STM32.hpp"
+#include "stm32f1xx_hal.h"
+#include <string.h>
+
+extern "C" FLASH_ProcessTypeDef pFlash; // state of the HAL flash driver
+
+static LoxFlash_STM32 gFlashSTM32;
+LoxFlash &gFlash = gFlashSTM32;
+
+LoxFlash_STM32::LoxFlash_STM32() : irqEnabled(false) {
+}
+
+bool LoxFlash_STM32::Busy(void) {
+  return pFlash.ProcedureOnGoing != FLASH_PROC_NONE;
+}
+
+void LoxFlash_STM32::Wait(void) {
+  while (Busy())
+    ;
+}
+
+/***
+ *  Start a page erase, the flash interrupt ends it
+ ***/
+bool LoxFlash_STM32::EraseStart(uint32_t address) {
+  if (Busy())
+    return false;
+  if (!this->irqEnabled) {
+    HAL_NVIC_SetPriority(FLASH_IRQn, 5, 0);
+    HAL_NVIC_EnableIRQ(FLASH_IRQn);
+    this->irqEnabled = true;
+  }
+  FLASH_EraseInitTypeDef erase;
+  erase.TypeErase = FLASH_TYPEERASE_PAGES;
+  erase.Banks = FLASH_BANK_1;
+  erase.PageAddress = address;
+  erase.NbPages = 1;
+  HAL_FLASH_Unlock();
+  return HAL_FLASHEx_Erase_IT(&erase) == HAL_OK;
+}
+
+/***
+ *  Program halfword by halfword
+ ***/
+bool LoxFlash_STM32::Program(uint32_t address, const void *data, size_t size) {
+  Wait(); // erase still running
+  HAL_FLASH_Unlock();
+  bool ok = true;
+  for (size_t i = 0; i < size && ok; i += 2) {
+    uint16_t value;
+    memcpy(&value, (const uint8_t *)data + i, sizeof(value));
+    ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + i, value) == HAL_OK;
+  }
+  HAL_FLASH_Lock();
+  return ok;
+}
+
+const uint8_t *LoxFlash_STM32::Read(uint32_t address) {
+  return (const uint8_t *)address;
+}
+
+/***
+ *  The startup code points VTOR to the vector table of the firmware, a firmware started at the
+ *  reset address can also leave it at 0, which is the start of the flash as well.
+ ***/
+uint32_t LoxFlash_STM32::RunningImage(void) {
+  uint32_t vtor = SCB->VTOR;
+  return vtor < LOXFLASH_BASE ? LOXFLASH_BASE + vtor : vtor;
+}
+
+/***
+ *  End of an erase
+ ***/
+extern "C" void FLASH_IRQHandler(void) {
+  HAL_FLASH_IRQHandler();
+  if (pFlash.ProcedureOnGoing == FLASH_PROC_NONE)
+    HAL_FLASH_Lock();
+}
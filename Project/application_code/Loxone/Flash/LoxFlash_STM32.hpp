@@ -0,0 +1,32 @@
+//
+//  LoxFlash_STM32.hpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxFlash_STM32_hpp
+#define LoxFlash_STM32_hpp
+
+#include "LoxFlash.hpp"
+
+/***
+ *  Internal flash of the STM32F1 via the HAL. An erase runs via the flash interrupt. The STM32F103
+ *  has only one flash bank, so the CPU still stalls on the next flash access, but the erase no
+ *  longer has to be waited for in the code path, which started it.
+ ***/
+class LoxFlash_STM32 : public LoxFlash {
+  bool irqEnabled;
+
+public:
+  LoxFlash_STM32();
+
+  virtual bool Busy(void);
+  virtual void Wait(void);
+  virtual bool EraseStart(uint32_t address);
+  virtual bool Program(uint32_t address, const void *data, size_t size);
+  virtual const uint8_t *Read(uint32_t address);
+  virtual uint32_t RunningImage(void);
+};
+
+#endif /* LoxFlash_STM32_hpp */
@@ -56,7 +56,7 @@ void LoxLegacyDMXExtension::search_reply(uint16_t channel, uint16_t manufacturer
   }
 }
 
-void LoxLegacyDMXExtension::PacketToExtension(LoxCanMessage &message) {
+void LoxLegacyDMXExtension::PacketToExtension(const LoxCanMessage &message) {
   switch (message.commandLegacy) {
   case dmx_search:
     debug_printf("Search for DMX devices\n");
@@ -12,7 +12,7 @@
 
 class LoxLegacyDMXExtension : public LoxLegacyExtension {
   uint8_t fragData[36]; // fragmented package
-  virtual void PacketToExtension(LoxCanMessage &message);
+  virtual void PacketToExtension(const LoxCanMessage &message);
   virtual void FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *fragData, int size);
   virtual void StartRequest();
 
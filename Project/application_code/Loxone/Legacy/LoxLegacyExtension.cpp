@@ -7,6 +7,7 @@
 
 #include "LoxLegacyExtension.hpp"
 #include "LED.hpp"
+#include "LoxFirmwareUpdate.hpp"
 #include "stm32f1xx_ll_cortex.h"
 #include "global_functions.hpp"
 #include <assert.h>
@@ -20,14 +21,20 @@ extern "C" {
  *  Constructor
  ***/
 LoxLegacyExtension::LoxLegacyExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version, void *fragPtr, uint16_t fragMaxSize)
-  : LoxExtension(driver, serial, device_type, hardware_version, version), aliveCountdown(0), isMuted(false), forceStartMessage(true), firmwareUpdateActive(false), fragPtr(fragPtr), fragMaxSize(fragMaxSize) {
+  : LoxExtension(driver, serial, device_type, hardware_version, version), isMuted(false), forceStartMessage(true), aliveTimer(this), updateTimer(this), fragmentTimer(this), firmwareUpdateActive(false), firmwareRetryActive(false), fragReceived(-1), fragPtr(fragPtr), fragMaxSize(fragMaxSize) {
   if(this->fragPtr == NULL || this->fragMaxSize < sizeof(this->fragMinimalPackage))
     this->fragPtr = this->fragMinimalPackage;
   if(this->fragMaxSize < sizeof(this->fragMinimalPackage))
     this->fragMaxSize = sizeof(this->fragMinimalPackage);
+  // the legacy messages this extension listens to (see ReceiveMessage)
+  driver.FilterRequest(this, 0, 0x00000000);                                         // multicast to all extensions
+  driver.FilterRequest(this, 1, this->device_type << 24);                            // multicast to all extensions of this type
+  driver.FilterRequest(this, 2, this->serial | 0x10000000, FILTER_MASK_EXACT, true); // sent to this extension
+  driver.FilterRequest(this, 3, (this->device_type << 16) | 0x1F000000, 0x1FFF0000); // firmware update for this type
   SetState(eDeviceState_offline);
   gLED.identify_off();
   gLED.blink_red();
+  ForceStartMessage();
 }
 
 /***
@@ -49,19 +56,25 @@ void LoxLegacyExtension::sendCommandWithValues(LoxMsgLegacyCommand_t command, ui
 }
 
 /***
- *  Send a fragmented command to the Miniserver
+ *  Send a fragmented command to the Miniserver. It waits up to timeout for the transmit queue
+ *  entries of the whole package and returns false, if they are not free.
  ***/
-void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *buffer, uint32_t byteCount) {
+bool LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *buffer, uint32_t byteCount, CTL_TIME_t timeout) {
   // never send fragmented package if the extension is not active, except for the page CRC command.
   if ((this->state != eDeviceState_online or this->isMuted) and FragCmd_page_CRC_external != fragCommand)
-    return;
+    return true;
   LoxCanMessage message;
   message.serial = this->serial;
   message.hardwareType = eDeviceType_t(this->device_type);
   message.directionLegacy = LoxMsgLegacyDirection_t_fromDevice;
   message.commandDirection = LoxMsgLegacyCommandDirection_t_fromDevice;
+  tTransmitReservation reservation = {0};
+  eTransmitClass transmitClass = (fragCommand == FragCmd_CryptoChallengeRequest or fragCommand == FragCmd_CryptoChallengeReply) ? eTransmitClass_control : eTransmitClass_bulk;
   if (byteCount > 1530) {      // large fragmented packages
     if (byteCount < 0x10000) { // max. 64kb
+      // the header and all data messages have to fit into the transmit queue
+      if (!driver.TransmitReserve(reservation, 1 + (byteCount + 6) / 7, timeout, transmitClass))
+        return false;
       message.commandLegacy = fragmented_package_large_start;
       message.data[0] = 0x00; // unused for the large fragmented package
       message.data[1] = fragCommand;
@@ -73,7 +86,7 @@ void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t
         checksum += ((uint8_t *)buffer)[i];
       message.data[5] = checksum;
       message.data[6] = checksum >> 8;
-      driver.SendMessage(message);
+      driver.SendMessage(message, eSendPolicy_block, timeout, &reservation);
       if (byteCount > 0) {
         message.commandLegacy = fragmented_package_large_data; // 7 bytes per package
         for (uint32_t offset = 0; offset < byteCount; offset += 7) {
@@ -81,11 +94,14 @@ void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t
           if (count > 7)
             count = 7;
           memmove(&message.data[0], ((uint8_t *)buffer) + offset, count);
-          driver.SendMessage(message);
+          driver.SendMessage(message, eSendPolicy_block, timeout, &reservation);
         }
       }
     }
   } else { // smaller fragmented package (6 bytes per package * 255 packages = 1530 bytes maximum size)
+    // the header and all data messages have to fit into the transmit queue
+    if (!driver.TransmitReserve(reservation, 1 + (byteCount + 5) / 6, timeout, transmitClass))
+      return false;
     message.commandLegacy = fragmented_package;
     message.data[0] = 0x00; // package index 0 = header
     message.data[1] = fragCommand;
@@ -97,7 +113,7 @@ void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t
       checksum += ((uint8_t *)buffer)[i];
     message.data[5] = checksum;
     message.data[6] = checksum >> 8;
-    driver.SendMessage(message);
+    driver.SendMessage(message, eSendPolicy_block, timeout, &reservation);
     if (byteCount > 0) {
       for (uint32_t offset = 0; offset < byteCount; offset += 6) {
         ++message.data[0]; // package index
@@ -105,10 +121,26 @@ void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t
         if (count > 6)
           count = 6;
         memmove(&message.data[1], ((uint8_t *)buffer) + offset, count);
-        driver.SendMessage(message);
+        driver.SendMessage(message, eSendPolicy_block, timeout, &reservation);
       }
     }
   }
+  driver.TransmitRelease(reservation);
+  return true;
+}
+
+/***
+ *  Send a fragmented reply of a receive handler. The RX task never waits for the transmit queue,
+ *  a reply, which does not fit, is retried every timer tick for up to TRANSMIT_RESERVE_TIMEOUT.
+ ***/
+void LoxLegacyExtension::send_fragmented_reply(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *buffer, uint32_t byteCount) {
+  if (send_fragmented_message(fragCommand, buffer, byteCount, 0) or byteCount > sizeof(this->deferredFragment.data))
+    return;
+  this->deferredFragment.command = fragCommand;
+  this->deferredFragment.size = byteCount;
+  this->deferredFragment.retries = TRANSMIT_RESERVE_TIMEOUT / TIMER_WHEEL_TICK;
+  memcpy(this->deferredFragment.data, buffer, byteCount);
+  TimerSchedule(this->fragmentTimer, TIMER_WHEEL_TICK);
 }
 
 /***
@@ -121,36 +153,50 @@ void LoxLegacyExtension::sendCommandWithVersion(LoxMsgLegacyCommand_t command) {
 }
 
 /***
- *  10ms Timer to be called 100x per second
+ *  Send a start request with the next timer tick. This happens directly after boot or if requested by the Miniserver
  ***/
-void LoxLegacyExtension::Timer10ms(void) {
-  bool resetAliveCountdown = false;
-  if (this->forceStartMessage) { // a start request needed? This happens directly after boot or if requested by the Miniserver
-    this->forceStartMessage = false;
-    this->isMuted = false;
-    sendCommandWithVersion(start_request);
-    StartRequest();
-    resetAliveCountdown = true;
-  } else if (this->aliveCountdown <= 0) {
-    sendCommandWithVersion(alive);
-    resetAliveCountdown = true;
+void LoxLegacyExtension::ForceStartMessage(void) {
+  this->forceStartMessage = true;
+  TimerSchedule(this->aliveTimer, 0);
+}
+
+/***
+ *  A timer of this extension expired
+ ***/
+void LoxLegacyExtension::TimerExpired(LoxTimer &timer) {
+  if (&timer == &this->aliveTimer) {
+    if (this->forceStartMessage) { // a start request needed?
+      this->forceStartMessage = false;
+      this->isMuted = false;
+      sendCommandWithVersion(start_request);
+      StartRequest();
+    } else {
+      sendCommandWithVersion(alive);
+    }
+    TimerSchedule(this->aliveTimer, 1000 * ((this->serial & 0x3f) + 6 * 60)); // avoid that all alive packages from all extensions are sent at the same time
+  } else if (&timer == &this->updateTimer) {
+    gFirmwareUpdate.Timer10ms();
+    FirmwareUpdateRetry();
+    if (gFirmwareUpdate.TimerNeeded())
+      TimerSchedule(this->updateTimer, 10);
+  } else if (&timer == &this->fragmentTimer) {
+    tDeferredFragment &fragment = this->deferredFragment;
+    if (!send_fragmented_message(LoxMsgLegacyFragmentedCommand_t(fragment.command), fragment.data, fragment.size, 0) and --fragment.retries > 0)
+      TimerSchedule(this->fragmentTimer, TIMER_WHEEL_TICK);
   }
-  if (resetAliveCountdown)
-    this->aliveCountdown = 1000 * ((this->serial & 0x3f) + 6 * 60); // avoid that all alive packages from all extensions are sent at the same time
-  this->aliveCountdown -= 10;
 }
 
 /***
  *  Multicast to all extensions for broadcast commands
  ***/
-void LoxLegacyExtension::PacketMulticastAll(LoxCanMessage &message) {
+void LoxLegacyExtension::PacketMulticastAll(const LoxCanMessage &message) {
   switch (message.commandLegacy) {
   case identify_LED:
     gLED.identify_off();
     break;
   case identify_unknown_extensions:
     if (this->state == eDeviceState_parked)
-      this->forceStartMessage = true;
+      ForceStartMessage();
     break;
   case extension_offline:
   case park_extension:
@@ -168,13 +214,13 @@ void LoxLegacyExtension::PacketMulticastAll(LoxCanMessage &message) {
 /***
  *  Multicast to all extensions of a certain type are used for the software update case only
  ***/
-void LoxLegacyExtension::PacketMulticastExtension(LoxCanMessage &message) {
+void LoxLegacyExtension::PacketMulticastExtension(const LoxCanMessage &message) {
   switch (message.commandLegacy) {
   case software_update_init:
     this->firmwareUpdateActive = false;
     if (message.value8 <= this->hardware_version) {
       if (message.value16 == 0xDEAD or message.value32 != this->version) {
-        this->firmwareUpdateActive = true;
+        FirmwareUpdateStart(message.value32);
         sendCommandWithVersion(BC_ACK);
       } else {
         sendCommandWithVersion(BC_NAK);
@@ -191,15 +237,15 @@ void LoxLegacyExtension::PacketMulticastExtension(LoxCanMessage &message) {
   case software_update_verify:
     if (this->firmwareUpdateActive) {
       this->firmwareNewVersion = message.value32;
-      if ((message.value8 == 0 and this->version != this->firmwareNewVersion) or message.value8 == 1) {
-        // validate CRCs over the firmware update data
-      }
+      if ((message.value8 == 0 and this->version != this->firmwareNewVersion) or message.value8 == 1)
+        FirmwareUpdateVerify();
     }
     break;
   case software_update_page_crc:
-    if (this->firmwareUpdateActive) {
-      if (message.value16 <= sizeof(firmwareUpdateCRCs) / sizeof(firmwareUpdateCRCs[0]))
-        this->firmwareUpdateCRCs[message.value16] = message.value32;
+    if (this->firmwareUpdateActive and message.value16 < FIRMWARE_UPDATE_MAX_PAGES) {
+      gFirmwareUpdate.SetPageCRC(message.value16, message.value32);
+      if (message.value16 >= this->firmwareUpdatePages)
+        this->firmwareUpdatePages = message.value16 + 1;
     }
     break;
   case mute_all:
@@ -213,12 +259,12 @@ void LoxLegacyExtension::PacketMulticastExtension(LoxCanMessage &message) {
 /***
  *  Packages to a specific extension based on it's serial number
  ***/
-void LoxLegacyExtension::PacketToExtension(LoxCanMessage &message) {
+void LoxLegacyExtension::PacketToExtension(const LoxCanMessage &message) {
   const LoxFragHeader *header = (const LoxFragHeader *)message.can_data;
   switch (message.commandLegacy) {
   case identify: // first direct command from the Miniserver after boot
     this->firmwareUpdateActive = false;
-    this->forceStartMessage = true;
+    ForceStartMessage();
     break;
   case identify_LED:
     gLED.identify_on();
@@ -246,69 +292,163 @@ void LoxLegacyExtension::PacketToExtension(LoxCanMessage &message) {
       break;
     if (header->packageIndex == 0) { // header
       memmove(&this->fragHeader, header, sizeof(this->fragHeader));
+      FragmentStart();
     } else { // data block with 6 bytes of data
-      int currentSize = (header->packageIndex - 1) * 6;
-      if (currentSize < this->fragMaxSize) {
-        int count = this->fragMaxSize - currentSize;
-        if (count > 6)
-          count = 6;
-        memmove((uint8_t *)this->fragPtr + currentSize, message.data + 1, count);
-        currentSize += count;
-        if (currentSize >= this->fragHeader.size) {
-          uint16_t checksum = 0;
-          for (int i = 0; i < this->fragHeader.size; ++i) {
-            checksum += ((uint8_t *)this->fragPtr)[i];
-          }
-          if (checksum == this->fragHeader.checksum) {
-            FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t(this->fragHeader.fragCommand), this->fragPtr, this->fragHeader.size);
-          }
-        }
-      }
+      FragmentData((header->packageIndex - 1) * 6, message.data + 1, 6);
     }
     break;
-  case fragmented_package_large_data: { // package size less then 64kb, each message contains 7 bytes of data
-    if (this->fragMaxSize == 0)         // no fragmented messages expected?
+  case fragmented_package_large_data: // package size less then 64kb, each message contains 7 bytes of data
+    if (this->fragMaxSize == 0)       // no fragmented messages expected?
       break;
-    int currentSize = this->fragLargeIndex++ * 7;
-    if (currentSize < this->fragMaxSize) {
-      int count = this->fragMaxSize - currentSize;
-      if (count > 7)
-        count = 7;
-      memmove((uint8_t *)this->fragPtr + currentSize, message.data, count);
-      currentSize += count;
-      if (currentSize >= this->fragHeader.size) {
-        uint16_t checksum = 0;
-        for (int i = 0; i < this->fragHeader.size; ++i) {
-          checksum += ((uint8_t *)this->fragPtr)[i];
-        }
-        if (checksum == this->fragHeader.checksum) {
-          FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t(this->fragHeader.fragCommand), this->fragPtr, this->fragHeader.size);
-        }
-      }
-    }
+    FragmentData(this->fragLargeIndex++ * 7, message.data, 7);
     break;
-  }
   case fragmented_package_large_start:
     if (this->fragMaxSize == 0) // no fragmented messages expected?
       break;
     memmove(&this->fragHeader, header, sizeof(this->fragHeader));
     this->fragLargeIndex = 0;
+    FragmentStart();
     break;
   default:
     break;
   }
 }
 
+/***
+ *  A fragmented package starts, the header is in fragHeader
+ ***/
+void LoxLegacyExtension::FragmentStart(void) {
+  this->fragReceived = 0;
+  this->fragChecksum = 0;
+}
+
+/***
+ *  Data block of a fragmented package. The blocks arrive in order, so the checksum is summed up
+ *  while they arrive and the completed package is not read again. A missing block drops the
+ *  package, a repeated one is ignored.
+ ***/
+void LoxLegacyExtension::FragmentData(int offset, const uint8_t *data, int count) {
+  if (this->fragReceived < 0) // no package active or it is already complete
+    return;
+  if (offset != this->fragReceived) {
+    if (offset > this->fragReceived) // block missing
+      this->fragReceived = -1;
+    return;
+  }
+  if (count > this->fragHeader.size - offset) // the last block is padded
+    count = this->fragHeader.size - offset;
+  if (offset + count > this->fragMaxSize) { // package does not fit into the buffer
+    this->fragReceived = -1;
+    return;
+  }
+  memmove((uint8_t *)this->fragPtr + offset, data, count);
+  for (int i = 0; i < count; ++i)
+    this->fragChecksum += data[i];
+  this->fragReceived += count;
+  if (this->fragReceived < this->fragHeader.size)
+    return;
+  this->fragReceived = -1; // the package is only handled once
+  if (this->fragChecksum == this->fragHeader.checksum)
+    FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t(this->fragHeader.fragCommand), this->fragPtr, this->fragHeader.size);
+}
+
 /***
  *  Messages on the CAN bus _from_ this extension. These can be ignored, because they come from this extension anyway
  ***/
-void LoxLegacyExtension::PacketFromExtension(LoxCanMessage &message) {
+void LoxLegacyExtension::PacketFromExtension(const LoxCanMessage &message) {
+}
+
+/***
+ *  Packages with firmware update data, sent to all extensions of a certain type. The lower 16 bits
+ *  of the identifier are the index of the 8 byte block. Blocks are collected per page and a page
+ *  is written into the flash, once it is complete. Two pages are buffered, so the blocks of the
+ *  next page can arrive, before the current one is complete. An incomplete page, which has to make
+ *  room for a newer one, is dropped and requested again after the verify.
+ ***/
+void LoxLegacyExtension::PacketFirmwareUpdate(const LoxCanMessage &message) {
+  if (!this->firmwareUpdateActive)
+    return;
+  uint32_t block = message.identifier & 0xFFFF;
+  int page = block / LEGACY_UPDATE_BLOCKS;
+  if (page >= FIRMWARE_UPDATE_MAX_PAGES)
+    return;
+  tLegacyUpdatePage *buffer = NULL;
+  for (int i = 0; i < 2; ++i) {
+    if (this->firmwareUpdateBuffer[i].page == page)
+      buffer = &this->firmwareUpdateBuffer[i];
+  }
+  if (!buffer) { // use the unused or the older page
+    buffer = &this->firmwareUpdateBuffer[this->firmwareUpdateBuffer[1].page < this->firmwareUpdateBuffer[0].page];
+    buffer->page = page;
+    memset(buffer->blocks, 0, sizeof(buffer->blocks));
+  }
+  block %= LEGACY_UPDATE_BLOCKS;
+  memcpy(buffer->data + block * LEGACY_UPDATE_BLOCK_SIZE, message.can_data, LEGACY_UPDATE_BLOCK_SIZE);
+  buffer->blocks[block / 32] |= 1UL << (block % 32);
+  for (int i = 0; i < LEGACY_UPDATE_BLOCKS / 32; ++i) {
+    if (buffer->blocks[i] != 0xFFFFFFFF) // page not complete
+      return;
+  }
+  gFirmwareUpdate.Write(page * LEGACY_UPDATE_PAGE_SIZE, buffer->data, LEGACY_UPDATE_PAGE_SIZE);
+  buffer->page = -1;
+}
+
+/***
+ *  Begin receiving a new firmware. An interrupted update of the same version is continued.
+ ***/
+void LoxLegacyExtension::FirmwareUpdateStart(uint32_t version) {
+  this->firmwareUpdateActive = true;
+  this->firmwareNewVersion = version;
+  this->firmwareUpdatePages = 0;
+  this->firmwareRetryActive = false;
+  for (int i = 0; i < 2; ++i)
+    this->firmwareUpdateBuffer[i].page = -1;
+  if (!gFirmwareUpdate.Active(version))
+    gFirmwareUpdate.Start(version, LEGACY_UPDATE_PAGE_SIZE);
+  if (!this->updateTimer.Scheduled())
+    TimerSchedule(this->updateTimer, 10);
+}
+
+/***
+ *  Check the received pages against the page CRCs. A correct firmware is started, otherwise only the
+ *  missing or wrong pages are requested again, one after the other.
+ ***/
+void LoxLegacyExtension::FirmwareUpdateVerify(void) {
+  this->firmwareRetryActive = false;
+  if (!gFirmwareUpdate.Active(this->firmwareNewVersion)) { // e.g. already activated by another extension
+    this->firmwareUpdateActive = false;
+    return;
+  }
+  if (this->firmwareUpdatePages == 0)
+    return;
+  uint32_t badPage, badCRC;
+  if (gFirmwareUpdate.Verify(this->firmwareUpdatePages, &badPage, &badCRC)) {
+    gFirmwareUpdate.Activate(this->firmwareUpdatePages);
+    this->firmwareUpdateActive = false;
+    return;
+  }
+  this->firmwareRetryActive = true;
+  this->firmwareRetryPage = 0xFFFFFFFF; // request the first missing page right away
+  FirmwareUpdateRetry();
 }
 
 /***
- *  Packages with firmware update data, sent to all extensions of a certain type.
+ *  Request the first missing page from the Miniserver, until all of them arrived, then verify again
  ***/
-void LoxLegacyExtension::PacketFirmwareUpdate(LoxCanMessage &message) {
+void LoxLegacyExtension::FirmwareUpdateRetry(void) {
+  if (!this->firmwareUpdateActive or !this->firmwareRetryActive)
+    return;
+  uint32_t page = gFirmwareUpdate.MissingPage();
+  if (page >= this->firmwareUpdatePages) {
+    FirmwareUpdateVerify();
+    return;
+  }
+  CTL_TIME_t now = ctl_get_current_time();
+  if (page == this->firmwareRetryPage and (int32_t)(now - this->firmwareRetryTime) < LEGACY_UPDATE_RETRY_TIMEOUT)
+    return;
+  this->firmwareRetryPage = page;
+  this->firmwareRetryTime = now;
+  sendCommandWithValues(software_update_retry_page, this->hardware_version, page, this->firmwareNewVersion);
 }
 
 /***
@@ -327,7 +467,7 @@ void LoxLegacyExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedComma
       decryptData[0] = 0xdeadbeef;
       decryptData[1] = random_range(0, 0xFFFF);
       CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
-      send_fragmented_message(FragCmd_CryptoChallengeReply, decryptData, sizeof(decryptData));
+      send_fragmented_reply(FragCmd_CryptoChallengeReply, decryptData, sizeof(decryptData));
     }
     break;
   case FragCmd_CryptoChallengeReply:
@@ -338,7 +478,7 @@ void LoxLegacyExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedComma
       decryptData[0] = 0xdeadbeef;
       decryptData[1] = random_range(0, 0xFFFF);
       CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
-      send_fragmented_message(FragCmd_CryptoChallengeReply, decryptData, sizeof(decryptData));
+      send_fragmented_reply(FragCmd_CryptoChallengeReply, decryptData, sizeof(decryptData));
     }
     break;
   }
@@ -347,7 +487,7 @@ void LoxLegacyExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedComma
 /***
  *  A message was received. Called from the driver.
  ***/
-void LoxLegacyExtension::ReceiveMessage(LoxCanMessage &message) {
+void LoxLegacyExtension::ReceiveMessage(const LoxCanMessage &message) {
   // ignore NAT packages or messages from devices.
   // This is not necessary with a correct CAN filter.
   if (message.isNATmessage(this->driver) or (message.directionLegacy == LoxMsgLegacyDirection_t_fromDevice and message.identifier != 0))
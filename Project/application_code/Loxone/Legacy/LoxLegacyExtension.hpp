@@ -13,6 +13,11 @@
 #define EXTENSION_RS232 0
 #define EXTENSION_MODBUS 0
 
+#define LEGACY_UPDATE_PAGE_SIZE 1024    // bytes covered by one page CRC
+#define LEGACY_UPDATE_BLOCK_SIZE 8       // bytes in one update data message
+#define LEGACY_UPDATE_RETRY_TIMEOUT 500  // ms until a missing page is requested again
+#define LEGACY_UPDATE_BLOCKS (LEGACY_UPDATE_PAGE_SIZE / LEGACY_UPDATE_BLOCK_SIZE) // data messages per page
+
 /////////////////////////////////////////////////////////////////
 // Legacy protocol
 typedef enum { // some of these commands have different meanings, depending on the extension
@@ -49,39 +54,63 @@ typedef struct {
     uint16_t checksum; // byte checksum over the fragment
 } LoxFragHeader;
 
+// a page of the firmware update being received
+typedef struct {
+  int page; // -1 = unused
+  uint32_t blocks[LEGACY_UPDATE_BLOCKS / 32]; // bitmap of the received data messages
+  uint8_t data[LEGACY_UPDATE_PAGE_SIZE];
+} tLegacyUpdatePage;
+
 class LoxLegacyExtension : public LoxExtension {
 protected:
   bool isMuted;
   bool forceStartMessage;
-  int32_t aliveCountdown;
+  LoxTimer aliveTimer; // sends the start request or the alive package
+  LoxTimer updateTimer; // runs the firmware update, while it is active
+  LoxTimer fragmentTimer; // retries deferredFragment
+  tDeferredFragment deferredFragment; // fragmented reply waiting for the transmit queue
 
   // firmware update
   bool firmwareUpdateActive;
   uint32_t firmwareNewVersion;
-  uint32_t firmwareUpdateCRCs[64];
+  uint32_t firmwareUpdatePages;              // pages with a CRC from the Miniserver
+  tLegacyUpdatePage firmwareUpdateBuffer[2]; // a page can complete, while the next one already arrives
+  bool firmwareRetryActive;                  // missing pages are requested after a failed verify
+  uint32_t firmwareRetryPage;                // last page requested again
+  CTL_TIME_t firmwareRetryTime;
   LoxFragHeader fragHeader;
   int fragLargeIndex;
+  int fragReceived; // bytes of the package received in order, -1 = no package active
+  uint16_t fragChecksum; // byte checksum over the received bytes
   void *fragPtr;
   uint16_t fragMaxSize;
   uint8_t fragMinimalPackage[32];
 
+  void FragmentStart(void);
+  void FragmentData(int offset, const uint8_t *data, int count);
+  void FirmwareUpdateStart(uint32_t version);
+  void FirmwareUpdateVerify(void);
+  void FirmwareUpdateRetry(void);
+  void ForceStartMessage(void);
+
   void sendCommandWithValues(LoxMsgLegacyCommand_t command, uint8_t val8, uint16_t val16, uint32_t val32);
   void sendCommandWithVersion(LoxMsgLegacyCommand_t command);
-  void send_fragmented_message(LoxMsgLegacyFragmentedCommand_t command, const void *buffer, uint32_t byteCount);
+  bool send_fragmented_message(LoxMsgLegacyFragmentedCommand_t command, const void *buffer, uint32_t byteCount, CTL_TIME_t timeout = TRANSMIT_RESERVE_TIMEOUT);
+  void send_fragmented_reply(LoxMsgLegacyFragmentedCommand_t command, const void *buffer, uint32_t byteCount);
 
-  virtual void PacketMulticastAll(LoxCanMessage &message);
-  virtual void PacketMulticastExtension(LoxCanMessage &message);
-  virtual void PacketToExtension(LoxCanMessage &message);
-  virtual void PacketFromExtension(LoxCanMessage &message);
-  virtual void PacketFirmwareUpdate(LoxCanMessage &message);
+  virtual void PacketMulticastAll(const LoxCanMessage &message);
+  virtual void PacketMulticastExtension(const LoxCanMessage &message);
+  virtual void PacketToExtension(const LoxCanMessage &message);
+  virtual void PacketFromExtension(const LoxCanMessage &message);
+  virtual void PacketFirmwareUpdate(const LoxCanMessage &message);
   virtual void FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *fragData, int size);
   virtual void StartRequest() {};
 
 public:
   LoxLegacyExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version, void *fragPtr = 0, uint16_t fragMaxSize = 0);
 
-  virtual void Timer10ms(void);
-  virtual void ReceiveMessage(LoxCanMessage &message);
+  virtual void TimerExpired(LoxTimer &timer);
+  virtual void ReceiveMessage(const LoxCanMessage &message);
 };
 
 #endif /* LoxLegacyExtension_hpp */
\ No newline at end of file
@@ -363,7 +363,7 @@ void LoxLegacyModbusExtension::Startup(void) {
 /***
  *  CAN packet received
  ***/
-void LoxLegacyModbusExtension::PacketToExtension(LoxCanMessage &message) {
+void LoxLegacyModbusExtension::PacketToExtension(const LoxCanMessage &message) {
   switch (message.commandLegacy) {
   case Modbus_485_WriteSingleCoil:
   case Modbus_485_WriteSingleRegister:
@@ -102,7 +102,7 @@ class LoxLegacyModbusExtension : public LoxLegacyExtension {
   static void vModbusRXTask(void *pvParameters);
   static void vModbusTXTask(void *pvParameters);
 
-  virtual void PacketToExtension(LoxCanMessage &message);
+  virtual void PacketToExtension(const LoxCanMessage &message);
   virtual void FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *fragData, int size);
   virtual void StartRequest();
 
@@ -201,7 +201,7 @@ void LoxLegacyRS232Extension::Startup(void) {
   HAL_UART_Receive_IT(&huart1, &gChar, 1);
 }
 
-void LoxLegacyRS232Extension::PacketToExtension(LoxCanMessage &message) {
+void LoxLegacyRS232Extension::PacketToExtension(const LoxCanMessage &message) {
   switch (message.commandLegacy) {
   case RS232_config_hardware: {
     int bits = (message.data[0] & 3) + 5; // 5..8
@@ -45,7 +45,7 @@ class LoxLegacyRS232Extension : public LoxLegacyExtension {
   static void vRS232RXTask(void *pvParameters);
   static void vRS232TXTask(void *pvParameters);
 
-  virtual void PacketToExtension(LoxCanMessage &message);
+  virtual void PacketToExtension(const LoxCanMessage &message);
 
 public:
   LoxLegacyRS232Extension(LoxCANBaseDriver &driver, uint32_t serial);
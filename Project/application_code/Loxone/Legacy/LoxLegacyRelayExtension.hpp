@@ -17,16 +17,16 @@ class LoxLegacyRelayExtension : public LoxLegacyExtension {
   bool temperatureForceSend;
   bool temperatureOverheatingFlag; // emergency shutdown, if relays/dimmers got too hot
   float temperature;
-  uint32_t temperatureMsTimer;
+  LoxTimer temperatureTimer;
 
   void update_relays(uint16_t bitmask);
-  virtual void PacketToExtension(LoxCanMessage &message);
+  virtual void PacketToExtension(const LoxCanMessage &message);
 
 public:
   LoxLegacyRelayExtension(LoxCANBaseDriver &driver, uint32_t serial);
 
   virtual void Startup(void);
-  virtual void Timer10ms(void);
+  virtual void TimerExpired(LoxTimer &timer);
 };
 
 #endif /* LoxLegacyRelayExtension_hpp */
\ No newline at end of file
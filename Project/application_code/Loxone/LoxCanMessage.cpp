@@ -10,7 +10,7 @@
 #include <assert.h>
 #include <__cross_studio_io.h>
 
-bool LoxCanMessage::isNATmessage(LoxCANBaseDriver &driver) const {
+bool LoxCanMessage::isNATmessage(const LoxCANBaseDriver &driver) const {
   return (driver.isLoxoneLinkBusDriver() && this->busType == LoxCmdNATBus_t_LoxoneLink) || (driver.isTreeBusDriver() && this->busType == LoxCmdNATBus_t_TreeBus);
 }
 
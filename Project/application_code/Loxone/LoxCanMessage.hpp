@@ -362,7 +362,7 @@ public:
     };
   };
 
-  bool isNATmessage(LoxCANBaseDriver &driver) const;
+  bool isNATmessage(const LoxCANBaseDriver &driver) const;
 #if DEBUG
   void print(LoxCANBaseDriver &driver) const;
 
@@ -10,6 +10,7 @@
 
 #include "LoxCANBaseDriver.hpp"
 #include "LoxCanMessage.hpp"
+#include "LoxNATFragmentReassembly.hpp"
 
 // The different state, in which the extension can be
 typedef enum {
@@ -18,6 +19,17 @@ typedef enum {
   eDeviceState_online,      // fully active Extension
 } eDeviceState;
 
+// largest fragmented reply sent by a receive handler (CryptoDeviceIdReply)
+#define DEFERRED_FRAGMENT_SIZE 32
+
+// a fragmented reply, which has to wait for free transmit queue entries
+typedef struct {
+  uint8_t command;
+  uint8_t size;
+  uint8_t retries;
+  uint32_t data[DEFERRED_FRAGMENT_SIZE / 4];
+} tDeferredFragment;
+
 /***
  *  Virtual baseclass for legacy and NAT extensions and devices
  ***/
@@ -37,16 +49,23 @@ protected:
   uint8_t cryptDeviceID[12];
 
   virtual void SetState(eDeviceState state);
-  virtual void ReceiveDirect(LoxCanMessage &message){};
-  virtual void ReceiveBroadcast(LoxCanMessage &message){};
+  void TimerSchedule(LoxTimer &timer, CTL_TIME_t msDelay) { this->driver.TimerWheel().Schedule(timer, msDelay); };
+  void TimerCancel(LoxTimer &timer) { this->driver.TimerWheel().Cancel(timer); };
+  virtual void ReceiveDirect(const LoxCanMessage &message){};
+  virtual void ReceiveBroadcast(const LoxCanMessage &message){};
 
 public:
   LoxExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version);
 
   // Need to be called by the main
   virtual void Startup(void){};
-  virtual void Timer10ms(void){};
-  virtual void ReceiveMessage(LoxCanMessage &message){};
+  // a timer of this extension expired, see TimerSchedule()
+  virtual void TimerExpired(LoxTimer &timer){};
+  virtual void ReceiveMessage(const LoxCanMessage &message){};
+  // a complete fragmented NAT package, reassembled by the driver. The message is the last Fragment_Data.
+  virtual void ReceiveFragment(LoxMsgNATCommand_t command, const LoxCanMessage &message, const uint8_t *data, uint16_t size){};
+  // the next bytes of a streamed NAT package, they are in the message and end at fragment->offset
+  virtual void ReceiveFragmentStream(const tNATFragmentSlot *fragment, const LoxCanMessage &message){};
 };
 
 #endif /* LoxExtension_hpp */
\ No newline at end of file
@@ -76,7 +76,7 @@ extern "C" void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
 }
 
 LoxBusDIExtension::LoxBusDIExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive)
-  : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, alive), hardwareBitmask(0), lastBitmaskSendTime(0), lastBitmaskSend(0), lastFrequencyTime(0) {
+  : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, alive), hardwareBitmask(0), lastBitmaskSend(0), bitmaskTimer(this), frequencyTimer(this) {
   gDIExt = this;
 }
 
@@ -104,6 +104,9 @@ void LoxBusDIExtension::Startup(void) {
 
   HAL_TIM_Base_Init(&g1000HzTimer);
   HAL_TIM_Base_Start_IT(&g1000HzTimer);
+
+  TimerSchedule(this->bitmaskTimer, 50);
+  ConfigUpdate();
 }
 
 /***
@@ -130,16 +133,20 @@ void LoxBusDIExtension::SendValues() {
  ***/
 void LoxBusDIExtension::ConfigUpdate(void) {
   //debug_printf("Config updated: 0x%04x\n", this->config.frequencyInputsBitmask);
+  if (!this->config.frequencyInputsBitmask)
+    TimerCancel(this->frequencyTimer);
+  else if (!this->frequencyTimer.Scheduled())
+    TimerSchedule(this->frequencyTimer, 1000);
 }
 
 /***
- *  10ms Timer to be called 100x per second
+ *  A timer of this extension expired
  ***/
-void LoxBusDIExtension::Timer10ms(void) {
-  LoxNATExtension::Timer10ms();
+void LoxBusDIExtension::TimerExpired(LoxTimer &timer) {
+  LoxNATExtension::TimerExpired(timer);
 
-  if (this->lastFrequencyTime >= 1000) { // frequencies are sent once per second
-    this->lastFrequencyTime = 0;
+  if (&timer == &this->frequencyTimer) { // frequencies are sent once per second
+    TimerSchedule(this->frequencyTimer, 1000);
     for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
       if (this->config.frequencyInputsBitmask & (1 << i)) { // is this pin a frequency counter?
         uint16_t freq = this->hardwareFrequencyStates[i].frequencyHz;
@@ -156,16 +163,13 @@ void LoxBusDIExtension::Timer10ms(void) {
       }
     }
   }
-  this->lastFrequencyTime += 10;
 
-  // simulate the inputs changing every second. They are sent back on every value change,
-  // but not faster than 20ms (= 50Hz)
-  if ((this->lastBitmaskSendTime % 50) == 0) { // throttle to 50Hz
+  // The inputs are sent back on every value change, but not faster than every 50ms
+  if (&timer == &this->bitmaskTimer) {
+    TimerSchedule(this->bitmaskTimer, 50);
     if (this->lastBitmaskSend != this->hardwareBitmask) {
       this->lastBitmaskSend = this->hardwareBitmask;
-      this->lastBitmaskSendTime = 0;
       send_digital_value(0, this->lastBitmaskSend);
     }
   }
-  this->lastBitmaskSendTime += 10;
 }
\ No newline at end of file
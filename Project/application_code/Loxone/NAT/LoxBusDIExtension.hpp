@@ -35,9 +35,9 @@ public:
   tDIExtensionConfig config;
 
 private:
-  uint32_t lastBitmaskSendTime;
   uint32_t lastBitmaskSend;
-  uint32_t lastFrequencyTime;
+  LoxTimer bitmaskTimer;   // polls the inputs for changes
+  LoxTimer frequencyTimer; // sends the frequencies, if inputs are used as frequency counters
 
   virtual void ConfigUpdate(void);
   virtual void SendValues();
@@ -46,7 +46,7 @@ public:
   LoxBusDIExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive);
 
   virtual void Startup(void);
-  virtual void Timer10ms(void);
+  virtual void TimerExpired(LoxTimer &timer);
 };
 
 #endif /* LoxBusDIExtension_hpp */
\ No newline at end of file
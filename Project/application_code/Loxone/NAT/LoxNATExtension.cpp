@@ -6,6 +6,8 @@
 //
 
 #include "LoxNATExtension.hpp"
+#include "LoxNATFragmentReassembly.hpp"
+#include "LoxFirmwareUpdate.hpp"
 #include "LED.hpp"
 #include "LoxCANBaseDriver.hpp"
 #include "global_functions.hpp"
@@ -14,48 +16,64 @@ extern "C" {
 }
 #include "stm32f1xx_hal.h" // HAL_IncTick
 #include <assert.h>
+#include <stddef.h>
 #include <__cross_studio_io.h>
 #include <string.h>
 
+/***
+ *  Set the NAT of the extension, the driver routes all messages to this NAT to us
+ ***/
+void LoxNATExtension::SetNAT(uint8_t nat) {
+  this->extensionNAT = nat;
+  driver.FilterSetupNAT(this, 1, this->busType, nat);
+}
+
 /***
  *  Internal function to send a message to the driver
  ***/
-void LoxNATExtension::send_message(LoxMsgNATCommand_t command, LoxCanMessage &msg) {
+void LoxNATExtension::send_message(LoxMsgNATCommand_t command, LoxCanMessage &msg, eSendPolicy policy, CTL_TIME_t timeout, tTransmitReservation *reservation) {
   msg.commandNat = command;
   msg.directionNat = LoxCmdNATDirection_t_fromDevice;
   msg.busType = this->busType;
-  driver.SendMessage(msg);
+  driver.SendMessage(msg, policy, timeout, reservation);
 }
 
 /***
- *  Send a Search_Reply or NAT_Index_Request command, even if the extension does not have a NAT
+ *  Send a Search_Reply or NAT_Index_Request command, even if the extension does not have a NAT.
+ *  With a delay the driver sends it later, the receive task is not blocked.
  ***/
-void LoxNATExtension::send_special_message(LoxMsgNATCommand_t command) {
+void LoxNATExtension::send_special_message(LoxMsgNATCommand_t command, CTL_TIME_t msDelay) {
   assert(command == Search_Reply || command == NAT_Index_Request);
   LoxCanMessage msg;
   msg.commandNat = command;
+  msg.directionNat = LoxCmdNATDirection_t_fromDevice;
+  msg.busType = this->busType;
   msg.extensionNat = (this->state == eDeviceState_offline) ? (crc8_default(&this->serial, 4) | 0x80) : this->extensionNAT;
   msg.value16 = this->device_type;
   msg.value32 = this->serial;
-  send_message(command, msg);
+  if (msDelay) {
+    driver.SendMessageDelayed(msg, msDelay);
+  } else {
+    driver.SendMessage(msg);
+  }
   // Extension only accept broadcast messages, after the NAT Index Request has been sent.
   // This seems to be ok for way the Miniserver works.
   if (command == NAT_Index_Request) {
-    driver.FilterSetupNAT(0, this->busType, 0xFF); // 0xFF = broadcast extension NAT
+    driver.FilterSetupNAT(this, 0, this->busType, 0xFF); // 0xFF = broadcast extension NAT
   }
 }
 
 /***
  *  Send regular package, but only if a NAT has been assigned to the extension
  ***/
-void LoxNATExtension::lox_send_package_if_nat(LoxMsgNATCommand_t command, LoxCanMessage &msg) {
+void LoxNATExtension::lox_send_package_if_nat(LoxMsgNATCommand_t command, LoxCanMessage &msg, eSendPolicy policy, CTL_TIME_t timeout, tTransmitReservation *reservation) {
   // extension NAT not set?
   if (this->extensionNAT == 0x00)
     return;
   msg.deviceNAT = driver.isLoxoneLinkBusDriver() ? this->deviceNAT : this->extensionNAT;
   msg.commandNat = command;
   msg.extensionNat = this->extensionNAT;
-  send_message(command, msg);
+  send_message(command, msg, policy, timeout, reservation);
 }
 
 /***
@@ -91,9 +109,32 @@ void LoxNATExtension::send_frequency_value(uint8_t index, uint32_t value) {
 }
 
 /***
- *  Send a fragmented package, which can be longer than 7 bytes.
+ *  Send a package larger than 8 bytes as a Fragment_Start and Fragment_Data messages. All callers
+ *  run in the RX task, so it never waits for the transmit queue: a package, which does not fit,
+ *  is kept and retried every timer tick for up to TRANSMIT_RESERVE_TIMEOUT. A newer package
+ *  replaces a waiting one, the Miniserver repeats its requests anyway.
  ***/
 void LoxNATExtension::send_fragmented_message(LoxMsgNATCommand_t command, const void *data, int size) {
+  // extension NAT not set?
+  if (this->extensionNAT == 0x00)
+    return;
+  // the header and all data messages have to fit into the transmit queue
+  tTransmitReservation reservation = {0};
+  if (driver.TransmitReserve(reservation, 1 + (size + 6) / 7, 0, LoxCANBaseDriver::FragmentTransmitClass(command))) {
+    send_fragments(command, data, size, reservation);
+  } else if (size <= (int)sizeof(this->deferredFragment.data)) {
+    this->deferredFragment.command = command;
+    this->deferredFragment.size = size;
+    this->deferredFragment.retries = TRANSMIT_RESERVE_TIMEOUT / TIMER_WHEEL_TICK;
+    memcpy(this->deferredFragment.data, data, size);
+    TimerSchedule(this->fragmentTimer, TIMER_WHEEL_TICK);
+  }
+}
+
+/***
+ *  Send the messages of a fragmented package into the reserved transmit queue entries
+ ***/
+void LoxNATExtension::send_fragments(LoxMsgNATCommand_t command, const void *data, int size, tTransmitReservation &reservation) {
   LoxCanMessage msg;
 
   // Send the fragmented header
@@ -102,7 +143,7 @@ void LoxNATExtension::send_fragmented_message(LoxMsgNATCommand_t command, const
   msg.value32 = crc32_stm32_aligned(data, size);
   msg.deviceNAT = this->deviceNAT;
   msg.fragmented = LoxCmdNATPackage_t_fragmented;
-  lox_send_package_if_nat(Fragment_Start, msg);
+  lox_send_package_if_nat(Fragment_Start, msg, eSendPolicy_dropNewest, 0, &reservation);
 
   // send the rest of the data in 7 bytes blocks
   int packageCount = (size + 6) / 7;
@@ -116,8 +157,9 @@ void LoxNATExtension::send_fragmented_message(LoxMsgNATCommand_t command, const
 #endif
     memmove(&msg.data, (uint8_t *)data + offset, packageSize);
     offset += 7;
-    lox_send_package_if_nat(Fragment_Data, msg);
+    lox_send_package_if_nat(Fragment_Data, msg, eSendPolicy_dropNewest, 0, &reservation);
   }
+  driver.TransmitRelease(reservation);
 }
 
 /***
@@ -136,11 +178,12 @@ void LoxNATExtension::send_alive_package(void) {
  *  
  ***/
 void LoxNATExtension::send_can_status(LoxMsgNATCommand_t command, eTreeBranch branch) {
+  const LoxCANBaseDriver &bus = StatusDriver(branch);
   LoxCanMessage msg;
   msg.value8 = branch; // from the device (!=0 => from a Tree bus)
-  msg.data[1] = this->driver.GetReceiveErrorCounter();
-  msg.data[2] = this->driver.GetTransmitErrorCounter();
-  msg.value32 = this->driver.GetErrorCounter();
+  msg.data[1] = bus.GetReceiveErrorCounter();
+  msg.data[2] = bus.GetTransmitErrorCounter();
+  msg.value32 = bus.GetErrorCounter();
   lox_send_package_if_nat(command, msg);
 }
 
@@ -169,29 +212,63 @@ void LoxNATExtension::send_info_package(LoxMsgNATCommand_t command, uint8_t /*eA
 }
 
 /***
- *  Update package received. We do not support a firmware update, so this does nothing.
+ *  Is an update for this extension?
  ***/
-void LoxNATExtension::update(const eUpdatePackage *updatePackage) {
+bool LoxNATExtension::update_accepted(eDeviceType_t device_type, uint32_t version) {
   if (this->state == eDeviceState_parked)
+    return false;
+  if (device_type != this->device_type)
+    return false;
+  return version != this->version; // this firmware is already running?
+}
+
+/***
+ *  Update package received. The firmware is written into the inactive flash slot, see LoxFirmwareUpdate.
+ *  Pages have 512 bytes, each write_flash package carries a 16 byte block of a page. A verify error
+ *  replies the first page, which has to be sent again.
+ ***/
+void LoxNATExtension::update(const eUpdatePackage *updatePackage) {
+  if (!update_accepted(updatePackage->device_type, updatePackage->version))
     return;
-  if (updatePackage->device_type != this->device_type)
-    return;
-  if (updatePackage->version > this->version)
-    return;
+  update_timer_start();
 
   switch (updatePackage->updatePackageType) {
   case eUpdatePackageType_write_flash:
-    debug_printf("write flash\n");
+    if (!gFirmwareUpdate.Active(updatePackage->version))
+      gFirmwareUpdate.Start(updatePackage->version, 512);
+    gFirmwareUpdate.Write(updatePackage->pageNumber * 512 + updatePackage->blockNumber * 16, updatePackage->data, sizeof(updatePackage->data));
     break;
   case eUpdatePackageType_receive_crc:
-    debug_printf("receive CRC\n");
+    if (gFirmwareUpdate.Active(updatePackage->version)) {
+      int count = (updatePackage->size - offsetof(eUpdatePackage, crc)) / sizeof(uint32_t);
+      for (int i = 0; i < count && i < 16; ++i)
+        gFirmwareUpdate.SetPageCRC(updatePackage->pageNumber + i, updatePackage->crc[i]);
+    }
     break;
   case eUpdatePackageType_verify:
-    debug_printf("verify\n");
-    break;
-  case eUpdatePackageType_verify_and_reset:
-    debug_printf("verify and reset\n");
+  case eUpdatePackageType_verify_and_reset: {
+    eUpdatePackage reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.size = offsetof(eUpdatePackage, crc) + sizeof(reply.crc[0]);
+    reply.device_type = eDeviceType_t(this->device_type);
+    reply.version = updatePackage->version;
+    uint32_t badPage, badCRC;
+    bool ok;
+    if (!gFirmwareUpdate.Active(updatePackage->version)) {
+      ok = false;
+      badPage = 0;
+      badCRC = 0;
+    } else if (updatePackage->updatePackageType == eUpdatePackageType_verify_and_reset) {
+      ok = gFirmwareUpdate.Verify(updatePackage->pageNumber, &badPage, &badCRC) && gFirmwareUpdate.Activate(updatePackage->pageNumber);
+    } else {
+      ok = gFirmwareUpdate.Verify(updatePackage->pageNumber, &badPage, &badCRC);
+    }
+    reply.updatePackageType = ok ? eUpdatePackageType_reply_verify_ok : eUpdatePackageType_reply_verify_error;
+    reply.pageNumber = badPage;
+    reply.crc[0] = badCRC;
+    send_fragmented_message(Update_Reply, &reply, reply.size);
     break;
+  }
   default:
     break;
   }
@@ -200,11 +277,33 @@ void LoxNATExtension::update(const eUpdatePackage *updatePackage) {
 /***
  *  Calculation of the configuration CRC
  ***/
-uint32_t LoxNATExtension::config_CRC(void) {
+uint32_t LoxNATExtension::config_CRC_calculate(void) {
   memset((uint8_t *)this->configPtr + this->configPtr->size - 4, 0, 4);           // erase the last 4 bytes of the configuration
   return crc32_stm32_aligned(this->configPtr, ((configPtr->size - 1) >> 2) << 2); // the CRC is calculated rounded down to dividable by 4
 }
 
+/***
+ *  The configuration CRC is requested with every alive and info package, so it is only
+ *  calculated again after the configuration changed
+ ***/
+uint32_t LoxNATExtension::config_CRC(void) {
+  if (!this->configCRCValid) {
+    this->configCRC = config_CRC_calculate();
+    this->configCRCValid = true;
+  }
+#if DEBUG
+  assert(this->configCRC == config_CRC_calculate()); // configuration changed without config_CRC_invalidate()?
+#endif
+  return this->configCRC;
+}
+
+/***
+ *  Has to be called after every change of the configuration
+ ***/
+void LoxNATExtension::config_CRC_invalidate(void) {
+  this->configCRCValid = false;
+}
+
 /***
  *  New configuration sent from the server
  ***/
@@ -214,7 +313,9 @@ void LoxNATExtension::config_data(const tConfigHeader *config) {
   assert(config->size >= 12);
   if (config->size == configSize && config->version == configVersion) {
     memmove(this->configPtr, config, config->size);
+    config_CRC_invalidate(); // offline_timer_update() and ConfigUpdate() can already send the CRC
     this->offlineTimeout = this->configPtr->offlineTimeout;
+    offline_timer_update();
     gLED.set_sync_offset(this->configPtr->blinkSyncOffset);
     ConfigUpdate();
   } else { // undefined values trigger a reset of the structure
@@ -222,6 +323,7 @@ void LoxNATExtension::config_data(const tConfigHeader *config) {
     this->configPtr->size = this->configSize;
     this->configPtr->version = this->configVersion;
     ConfigLoadDefaults();
+    config_CRC_invalidate();
   }
 }
 
@@ -230,23 +332,29 @@ void LoxNATExtension::config_data(const tConfigHeader *config) {
  ***/
 void LoxNATExtension::SetState(eDeviceState state) {
   LoxExtension::SetState(state);
-  if (state != eDeviceState_offline)
+  if (state != eDeviceState_offline) {
     this->NATStateCounter = 0;
+    TimerCancel(this->NATRequestTimer);
+  } else if (!this->NATRequestTimer.Scheduled()) { // try to get a NAT from the Miniserver
+    TimerSchedule(this->NATRequestTimer, this->randomNATIndexRequestDelay);
+  }
 }
 
 /***
  *  Constructor
  ***/
 LoxNATExtension::LoxNATExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version, uint8_t configVersion, uint8_t configSize, tConfigHeader *configPtr, eAliveReason_t alive)
-  : LoxExtension(driver, serial, device_type, hardware_version, version), busType(LoxCmdNATBus_t_LoxoneLink), configVersion(configVersion), configSize(configSize), configPtr(configPtr), aliveReason(alive), extensionNAT(0x00), deviceNAT(0x00), upTimeInMs(0) {
+  : LoxExtension(driver, serial, device_type, hardware_version, version), configVersion(configVersion), configSize(configSize), configPtr(configPtr), configCRCValid(false), busType(LoxCmdNATBus_t_LoxoneLink), extensionNAT(0x00), deviceNAT(0x00), aliveReason(alive), NATRequestTimer(this), offlineTimer(this), updateTimer(this), updateNewActive(false), fragmentTimer(this) {
   assert(configPtr != NULL);
-  assert(configSize <= MAX_FRAGMENT_SIZE);
+  assert(configSize <= NAT_FRAGMENT_POOL_BLOCKS * NAT_FRAGMENT_BLOCK_SIZE); // received as a fragmented package
   this->configPtr->size = configSize;
   this->configPtr->version = configVersion;
   this->NATStateCounter = 0;
   this->randomNATIndexRequestDelay = random_range(10, 500);
   this->offlineTimeout = 15 * 60;
-  this->offlineCountdownInMs = this->offlineTimeout * 1000;
+  this->lastServerMessageTime = ctl_get_current_time();
+  this->offlineAliveSent = false;
+  offline_timer_update();
   SetState(eDeviceState_offline);
   gLED.identify_off();
 }
@@ -254,7 +362,7 @@ LoxNATExtension::LoxNATExtension(LoxCANBaseDriver &driver, uint32_t serial, eDev
 /***
  *  A direct message received
  ***/
-void LoxNATExtension::ReceiveDirect(LoxCanMessage &message) {
+void LoxNATExtension::ReceiveDirect(const LoxCanMessage &message) {
   LoxCanMessage msg;
   switch (message.commandNat) {
   case Ping:
@@ -285,7 +393,7 @@ void LoxNATExtension::ReceiveDirect(LoxCanMessage &message) {
 /***
  *  A broadcast message received
  ***/
-void LoxNATExtension::ReceiveBroadcast(LoxCanMessage &message) {
+void LoxNATExtension::ReceiveBroadcast(const LoxCanMessage &message) {
   switch (message.commandNat) {
   case Identify_LED:
     if (this->serial == message.value32) {
@@ -295,19 +403,17 @@ void LoxNATExtension::ReceiveBroadcast(LoxCanMessage &message) {
     }
     break;
   case Search_Devices:
-    driver.Delay(random_range(0, 100));
-    send_special_message(Search_Reply);
+    send_special_message(Search_Reply, random_range(0, 100));
     break;
   case NAT_Offer:
     if (this->serial == message.value32) {
       uint8_t nat = message.data[0]; // NAT Index of the offer
       if (message.data[1] & 1) {
-        this->extensionNAT = nat;
+        SetNAT(nat);
         send_info_package(Start, this->aliveReason ? this->aliveReason : eAliveReason_t_pairing);
         SetState(eDeviceState_parked);
       } else if ((nat & 0x80) == 0x00) { // a parked NAT index is ignored
-        this->extensionNAT = nat;
-        driver.FilterSetupNAT(1, this->busType, nat);
+        SetNAT(nat);
         SetState(eDeviceState_online);
         send_info_package(Start, this->aliveReason ? this->aliveReason : eAliveReason_t_pairing);
         if ((message.data[1] & 2) == 0x00) {
@@ -319,12 +425,11 @@ void LoxNATExtension::ReceiveBroadcast(LoxCanMessage &message) {
     break;
   case Identify_Unknown_Extensions:
     if (this->state == eDeviceState_parked) {
-      driver.Delay(random_range(0, 100));
-      send_special_message(NAT_Index_Request);
+      send_special_message(NAT_Index_Request, random_range(0, 100));
     }
     break;
   case Park_Devices:
-    this->extensionNAT = crc8_default(&this->serial, 4) | 0x80; // mark as a parked device
+    SetNAT(crc8_default(&this->serial, 4) | 0x80); // mark as a parked device
     SetState(eDeviceState_parked);
     break;
   case Sync_Packet:
@@ -415,92 +520,100 @@ void LoxNATExtension::ReceiveBroadcastFragment(LoxMsgNATCommand_t command, uint8
 }
 
 /***
- *  10ms Timer to be called 100x per second
+ *  Monitor incoming package from the Miniserver. The server sends at least one package per minute
+ *  (the Sync_Packet). If this package doesn't arrive for several minutes, try contacting the
+ *  Miniserver and if this doesn't work, switch to the offline state. 10% before the end of the
+ *  timeout, an Alive package is sent to the Miniserver.
+ *  A received message only stores its time. The deadlines are calculated from it, when the timer
+ *  expires, and the timer is restarted for the remaining time.
  ***/
-void LoxNATExtension::Timer10ms(void) {
-  this->upTimeInMs += 10; // just for debugging purposes
-
-  // If offline, try to get a NAT from the Miniserver.
-  // The timing is quasi-random to avoid too much load on the bus after power-on
-  if (this->state == eDeviceState_offline) {
-    this->randomNATIndexRequestDelay -= 10;
-    if (this->randomNATIndexRequestDelay <= 0) {
-      int minv, maxv;
-      if (this->NATStateCounter <= 2) {
-        this->NATStateCounter++;
-        minv = 1000;
-        maxv = 2.5 * 1000;
-      } else if (this->NATStateCounter < 10) {
-        this->NATStateCounter++;
-        minv = 5 * 1000;
-        maxv = 10 * 1000;
-      } else {
-        minv = 10 * 1000;
-        maxv = 30 * 1000;
-      }
-      this->randomNATIndexRequestDelay = random_range(minv, maxv);
-      send_special_message(NAT_Index_Request);
-    }
+void LoxNATExtension::offline_timer_update(void) {
+  if (this->offlineTimeout <= 0) {
+    TimerCancel(this->offlineTimer);
+    return;
   }
+  CTL_TIME_t elapsed = ctl_get_current_time() - this->lastServerMessageTime;
+  CTL_TIME_t aliveTime = (this->offlineTimeout - this->offlineTimeout / 10) * 1000;
+  CTL_TIME_t offlineTime = (this->offlineTimeout - 1) * 1000; // during the last second of the timeout
+  if (elapsed < aliveTime) {
+    this->offlineAliveSent = false; // a message arrived since the last Alive package
+  } else if (!this->offlineAliveSent && this->offlineTimeout >= 10) {
+    this->offlineAliveSent = true;
+    send_alive_package();
+  }
+  if (elapsed >= offlineTime) { // the next message restarts the timer
+    SetState(eDeviceState_offline);
+    return;
+  }
+  TimerSchedule(this->offlineTimer, (!this->offlineAliveSent && aliveTime < offlineTime ? aliveTime : offlineTime) - elapsed);
+}
+
+/***
+ *  The firmware update needs the 10ms timer, while it is active
+ ***/
+void LoxNATExtension::update_timer_start(void) {
+  if (!this->updateTimer.Scheduled())
+    TimerSchedule(this->updateTimer, 10);
+}
 
-  // monitor incoming package from the Miniserver. The server sends at least
-  // one package per minute (the Sync_Packet). If this package doesn't
-  // arrive for several minutes, try contacting the Miniserver and if this
-  // doesn't work, switch to the offline state.
-  if (this->offlineCountdownInMs) {                 // is the offline timer active?
-    if ((this->offlineCountdownInMs % 1000) == 0) { // once per second
-      int seconds = this->offlineCountdownInMs / 1000;
-      // 10% before the end of the timeout, an Alive package is sent to the Miniserver
-      if (seconds == this->offlineTimeout / 10)
-        send_alive_package();
-      if (seconds == 1) // at the end of the timeout
-        SetState(eDeviceState_offline);
+/***
+ *  A timer of this extension expired
+ ***/
+void LoxNATExtension::TimerExpired(LoxTimer &timer) {
+  if (&timer == &this->NATRequestTimer) {
+    // If offline, try to get a NAT from the Miniserver.
+    // The timing is quasi-random to avoid too much load on the bus after power-on
+    int minv, maxv;
+    if (this->NATStateCounter <= 2) {
+      this->NATStateCounter++;
+      minv = 1000;
+      maxv = 2.5 * 1000;
+    } else if (this->NATStateCounter < 10) {
+      this->NATStateCounter++;
+      minv = 5 * 1000;
+      maxv = 10 * 1000;
+    } else {
+      minv = 10 * 1000;
+      maxv = 30 * 1000;
     }
-    this->offlineCountdownInMs -= 10;
+    this->randomNATIndexRequestDelay = random_range(minv, maxv);
+    send_special_message(NAT_Index_Request);
+    TimerSchedule(this->NATRequestTimer, this->randomNATIndexRequestDelay);
+  } else if (&timer == &this->offlineTimer) {
+    offline_timer_update();
+  } else if (&timer == &this->updateTimer) {
+    gFirmwareUpdate.Timer10ms();
+    if (gFirmwareUpdate.TimerNeeded())
+      TimerSchedule(this->updateTimer, 10);
+  } else if (&timer == &this->fragmentTimer) {
+    tDeferredFragment &fragment = this->deferredFragment;
+    tTransmitReservation reservation = {0};
+    if (this->extensionNAT == 0x00)
+      return;
+    if (driver.TransmitReserve(reservation, 1 + (fragment.size + 6) / 7, 0, LoxCANBaseDriver::FragmentTransmitClass(LoxMsgNATCommand_t(fragment.command))))
+      send_fragments(LoxMsgNATCommand_t(fragment.command), fragment.data, fragment.size, reservation);
+    else if (--fragment.retries > 0)
+      TimerSchedule(this->fragmentTimer, TIMER_WHEEL_TICK);
   }
 }
 
 /***
  *  A message was received. Called from the driver.
  ***/
-void LoxNATExtension::ReceiveMessage(LoxCanMessage &message) {
+void LoxNATExtension::ReceiveMessage(const LoxCanMessage &message) {
   // ignore non-NAT packages or messages from devices.
   // This is not necessary with a correct CAN filter.
   if (!message.isNATmessage(this->driver) || message.directionNat < LoxCmdNATDirection_t_fromServerShortcut)
     return;
 
-  this->offlineCountdownInMs = this->offlineTimeout * 1000;
+  this->lastServerMessageTime = ctl_get_current_time();
+  if (!this->offlineTimer.Scheduled()) // stopped after the timeout
+    offline_timer_update();
 
   switch (message.commandNat) {
   case Fragment_Start:
-    if (message.fragmented) { // This bit has to be set in the message for fragmented messages
-      this->fragCommand = LoxMsgNATCommand_t(message.value8);
-      this->fragSize = message.value16;
-      this->fragCRC = message.value32;
-      this->fragOffset = 0;
-      if (this->fragSize >= sizeof(this->fragBuffer) - sizeof(message.data)) // package too large for our buffer
-        this->fragSize = 0;
-    }
-    break;
   case Fragment_Data:
-    if (message.fragmented) { // This bit has to be set in the message for fragmented messages
-      int size = this->fragSize - this->fragOffset;
-      if (size > sizeof(message.data))
-        size = sizeof(message.data);
-      memmove(this->fragBuffer + this->fragOffset, message.data, size);
-      this->fragOffset += size;
-      if (this->fragOffset != this->fragSize) // not enough bytes received?
-        break;
-      if (this->fragCRC != crc32_stm32_aligned(this->fragBuffer, this->fragSize)) // checksum wrong?
-        break;
-      // complete fragmented message received
-      if (message.extensionNat == 0xFF) {
-        ReceiveBroadcastFragment(this->fragCommand, message.extensionNat, message.deviceNAT, this->fragBuffer, this->fragSize);
-      } else if (this->extensionNAT && message.extensionNat == this->extensionNAT) {
-          ReceiveDirectFragment(this->fragCommand, message.extensionNat, message.deviceNAT, this->fragBuffer, this->fragSize);
-      }
-    }
-    break;
+    break; // the driver reassembles the package, see ReceiveFragment()
   default:
     // standard messages received
     if (message.extensionNat == 0xFF) {
@@ -511,4 +624,58 @@ void LoxNATExtension::ReceiveMessage(LoxCanMessage &message) {
 //      }
     }
   }
-}
\ No newline at end of file
+}
+
+/***
+ *  Update_New package: the data is written to the flash as it arrives, nothing is buffered. A package,
+ *  which was interrupted, is continued with the next one. One with a wrong CRC is received again.
+ ***/
+void LoxNATExtension::ReceiveFragmentStream(const tNATFragmentSlot *fragment, const LoxCanMessage &message) {
+  if (fragment->command != Update_New)
+    return;
+  if (message.extensionNat != 0xFF && (!this->extensionNAT || message.extensionNat != this->extensionNAT))
+    return;
+  uint32_t offset = fragment->offset - fragment->chunkSize; // offset in the package
+  const uint8_t *data = message.data;
+  int count = fragment->chunkSize;
+  if (offset < sizeof(this->updateNewHeader)) {
+    if (offset == 0)
+      this->updateNewActive = false;
+    int headerCount = sizeof(this->updateNewHeader) - offset;
+    if (headerCount > count)
+      headerCount = count;
+    memcpy((uint8_t *)&this->updateNewHeader + offset, data, headerCount);
+    offset += headerCount;
+    data += headerCount;
+    count -= headerCount;
+    if (offset == sizeof(this->updateNewHeader) && update_accepted(this->updateNewHeader.device_type, this->updateNewHeader.version)) {
+      if (!gFirmwareUpdate.Active(this->updateNewHeader.version))
+        gFirmwareUpdate.Start(this->updateNewHeader.version, 512);
+      this->updateNewActive = true;
+      update_timer_start();
+    }
+  }
+  if (!this->updateNewActive)
+    return;
+  if (count > 0)
+    gFirmwareUpdate.Write(this->updateNewHeader.offset + offset - sizeof(this->updateNewHeader), data, count);
+  if (fragment->offset == fragment->size) { // package complete
+    this->updateNewActive = false;
+    if (!fragment->valid) // wrong CRC: the data of this package is not trusted
+      gFirmwareUpdate.Rewind(this->updateNewHeader.offset, fragment->size - sizeof(this->updateNewHeader));
+#if DEBUG
+    gFirmwareUpdate.StatisticsPrint();
+#endif
+  }
+}
+
+/***
+ *  A complete fragmented package was received. Called from the driver.
+ ***/
+void LoxNATExtension::ReceiveFragment(LoxMsgNATCommand_t command, const LoxCanMessage &message, const uint8_t *data, uint16_t size) {
+  if (message.extensionNat == 0xFF) {
+    ReceiveBroadcastFragment(command, message.extensionNat, message.deviceNAT, data, size);
+  } else if (this->extensionNAT && message.extensionNat == this->extensionNAT) {
+    ReceiveDirectFragment(command, message.extensionNat, message.deviceNAT, data, size);
+  }
+}
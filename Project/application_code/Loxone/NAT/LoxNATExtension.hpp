@@ -11,8 +11,6 @@
 #include "LoxExtension.hpp"
 #include "system.hpp"
 
-#define MAX_FRAGMENT_SIZE     64
-
 // Configuration for extensions all share the same header. The configuration is stored in FLASH and
 // validated via a CRC with the Miniserver to be current. If not, the Miniserver automatically uploads
 // a new configuration to the extension.
@@ -53,6 +51,16 @@ typedef struct __attribute__((__packed__)) {
   };
 } eUpdatePackage;
 
+// Update_New: a large fragmented package with this header, followed by the firmware data for the
+// offset. The layout is an assumption, the Miniserver documentation is not available. The data is
+// written to the flash as it arrives and verified with the page CRCs of the eUpdatePackage packages.
+typedef struct __attribute__((__packed__)) {
+  eDeviceType_t device_type; // for which hardware is this update
+  uint16_t reserved;
+  uint32_t version; // what is the new version number for this update
+  uint32_t offset;  // offset of the data in the firmware
+} tUpdateNewHeader;
+
 typedef enum {
   // Bit 0..3 // multiplication factor for floating point numbers
   eAnalogFormat_mul_1 = 0,
@@ -83,55 +91,71 @@ protected:
   const uint8_t configVersion;    // version of the configuration, typically 0.
   const uint8_t configSize;       // size of the expected configuration, at least 12 bytes
   tConfigHeader *const configPtr; // pointer to the configuration
-
-  // fragmented command support
-  LoxMsgNATCommand_t fragCommand;
-  uint16_t fragSize;
-  uint16_t fragOffset;
-  uint32_t fragCRC;
-  uint8_t fragBuffer[MAX_FRAGMENT_SIZE];
+  uint32_t configCRC;             // cached CRC of the configuration
+  bool configCRCValid;            // configCRC matches the configuration
 
   // some internal state variables
   LoxCmdNATBus_t busType;                 // LoxoneLink extension or a Tree device?
   uint8_t extensionNAT;                   // NAT of the extension
   uint8_t deviceNAT;                      // NAT for the device on a Tree bus, otherwise 0
   uint8_t /*eAliveReason_t*/ aliveReason; // reason for a reset or current state
-  uint32_t upTimeInMs;                    // time since boot in ms
   int32_t NATStateCounter;                //
-  int32_t randomNATIndexRequestDelay;
-  int32_t offlineTimeout;
-  int32_t offlineCountdownInMs;
+  int32_t randomNATIndexRequestDelay;     // delay of the next NAT_Index_Request, while offline
+  LoxTimer NATRequestTimer;
+  int32_t offlineTimeout;                 // in seconds without a message from the Miniserver
+  CTL_TIME_t lastServerMessageTime;       // the offline deadlines are calculated from it
+  bool offlineAliveSent;                  // the Alive package before the timeout was sent
+  LoxTimer offlineTimer;
+  LoxTimer updateTimer;                   // runs the firmware update, while it is active
+  tUpdateNewHeader updateNewHeader; // header of the Update_New package being received
+  bool updateNewActive;             // the data of the package is written to the flash
+  tDeferredFragment deferredFragment; // fragmented reply waiting for the transmit queue
+  LoxTimer fragmentTimer;             // retries deferredFragment
 
   // internal functions
-  void send_message(LoxMsgNATCommand_t command, LoxCanMessage &msg);
-  void send_special_message(LoxMsgNATCommand_t command);
-  void lox_send_package_if_nat(LoxMsgNATCommand_t command, LoxCanMessage &msg);
+  void SetNAT(uint8_t nat);
+  void send_message(LoxMsgNATCommand_t command, LoxCanMessage &msg, eSendPolicy policy = eSendPolicy_dropNewest, CTL_TIME_t timeout = 0, tTransmitReservation *reservation = NULL);
+  void send_special_message(LoxMsgNATCommand_t command, CTL_TIME_t msDelay = 0);
+  void lox_send_package_if_nat(LoxMsgNATCommand_t command, LoxCanMessage &msg, eSendPolicy policy = eSendPolicy_dropNewest, CTL_TIME_t timeout = 0, tTransmitReservation *reservation = NULL);
   void send_fragmented_message(LoxMsgNATCommand_t command, const void *data, int dataCount);
+  void send_fragments(LoxMsgNATCommand_t command, const void *data, int dataCount, tTransmitReservation &reservation);
   void send_alive_package(void);
   void send_can_status(LoxMsgNATCommand_t command, eTreeBranch branch);
   void send_info_package(LoxMsgNATCommand_t command, uint8_t /*eAliveReason_t*/ reason);
   void send_digital_value(uint8_t index, uint32_t value);
   void send_analog_value(uint8_t index, uint32_t value, uint16_t flags, eAnalogFormat format);
   void send_frequency_value(uint8_t index, uint32_t value);
+  void offline_timer_update(void);
   void update(const eUpdatePackage *updatePackage);
+  void update_timer_start(void);
+  bool update_accepted(eDeviceType_t device_type, uint32_t version);
   void config_data(const tConfigHeader *config);
   uint32_t config_CRC(void);
+  uint32_t config_CRC_calculate(void);
+  void config_CRC_invalidate(void);
 
   virtual void ConfigUpdate(void){};
   virtual void ConfigLoadDefaults(void){};
   virtual void SendValues(void){};
+  // CAN bus of a branch, whose error counters send_can_status() reports
+  virtual const LoxCANBaseDriver &StatusDriver(eTreeBranch branch) { return this->driver; };
   virtual void SetState(eDeviceState state);
  public:
-  virtual void ReceiveDirect(LoxCanMessage &message);
-  virtual void ReceiveBroadcast(LoxCanMessage &message);
+  virtual void ReceiveDirect(const LoxCanMessage &message);
+  virtual void ReceiveBroadcast(const LoxCanMessage &message);
   virtual void ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size);
   virtual void ReceiveBroadcastFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size);
 
 public:
   LoxNATExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version, uint8_t configVersion, uint8_t configSize, tConfigHeader *configPtr, eAliveReason_t alive);
 
-  virtual void Timer10ms(void);
-  virtual void ReceiveMessage(LoxCanMessage &message);
+  // NAT of the extension, 0x00 = none, bit 7 set = parked
+  uint8_t GetNAT(void) const { return this->extensionNAT; };
+
+  virtual void TimerExpired(LoxTimer &timer);
+  virtual void ReceiveMessage(const LoxCanMessage &message);
+  virtual void ReceiveFragment(LoxMsgNATCommand_t command, const LoxCanMessage &message, const uint8_t *data, uint16_t size);
+  virtual void ReceiveFragmentStream(const tNATFragmentSlot *fragment, const LoxCanMessage &message);
 };
 
 #endif /* LoxNATExtension_hpp */
\ No newline at end of file
@@ -12,11 +12,23 @@
  *  Constructor
  ***/
 LoxBusTreeAlarmSiren::LoxBusTreeAlarmSiren(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive)
-  : LoxBusTreeDevice(driver, serial, eDeviceType_t_AlarmSirenTree, 0, 10031114, 1, sizeof(config), &config, alive), hardwareTamperStatusOk(true), tamperStatusOk(true), tamperStatusTimer(0), alarmSoundMaxDurationTimer(-1) {
+  : LoxBusTreeDevice(driver, serial, eDeviceType_t_AlarmSirenTree, 0, 10031114, 1, sizeof(config), &config, alive), hardwareTamperStatusOk(true), tamperStatusTimer(this), alarmSoundMaxDurationTimer(this) {
+  TimerSchedule(this->tamperStatusTimer, 30 * 1000);
 }
 
 void LoxBusTreeAlarmSiren::send_tamper_status(void) {
   send_digital_value(0, this->hardwareTamperStatusOk); // 1 = tamper status ok, 0 = tamper status failure
+  TimerSchedule(this->tamperStatusTimer, 30 * 1000);
+}
+
+/***
+ *  The tamper status is sent on every change
+ ***/
+void LoxBusTreeAlarmSiren::hardware_tamper_status(bool statusOk) {
+  if (statusOk == this->hardwareTamperStatusOk)
+    return;
+  this->hardwareTamperStatusOk = statusOk;
+  send_tamper_status();
 }
 
 void LoxBusTreeAlarmSiren::hardware_strobe_light(bool status) {
@@ -24,27 +36,20 @@ void LoxBusTreeAlarmSiren::hardware_strobe_light(bool status) {
 }
 
 void LoxBusTreeAlarmSiren::hardware_alarm_sound(bool status) {
-  this->alarmSoundMaxDurationTimer = status ? config.maxAudibleAlarmDuration * 1000 : -1;
+  if (status and config.maxAudibleAlarmDuration) // 0 = no limit
+    TimerSchedule(this->alarmSoundMaxDurationTimer, config.maxAudibleAlarmDuration * 1000);
+  else
+    TimerCancel(this->alarmSoundMaxDurationTimer);
   debug_printf("# Alarm sound %s\n", status ? "on" : "off");
 }
 
-void LoxBusTreeAlarmSiren::Timer10ms(void) {
-  // send tamper status, if changed or an update every 30s as an alive message
-  if (this->hardwareTamperStatusOk != this->tamperStatusOk or this->tamperStatusTimer >= 30 * 1000) {
-    this->tamperStatusTimer = 0;
-    this->tamperStatusOk = this->hardwareTamperStatusOk;
+void LoxBusTreeAlarmSiren::TimerExpired(LoxTimer &timer) {
+  if (&timer == &this->tamperStatusTimer) // an update every 30s as an alive message
     send_tamper_status();
-  }
-  this->tamperStatusTimer += 10;
-
-  // check the alarm sound timeout
-  if (this->alarmSoundMaxDurationTimer >= 0) {
-    this->alarmSoundMaxDurationTimer -= 10;
-    if (this->alarmSoundMaxDurationTimer < 0) {
-      hardware_alarm_sound(false);
-    }
-  }
-  LoxBusTreeDevice::Timer10ms();
+  else if (&timer == &this->alarmSoundMaxDurationTimer) // the alarm sound timeout
+    hardware_alarm_sound(false);
+  else
+    LoxBusTreeDevice::TimerExpired(timer);
 }
 
 void LoxBusTreeAlarmSiren::ConfigUpdate(void) {
@@ -65,7 +70,7 @@ void LoxBusTreeAlarmSiren::SendValues(void) {
   send_tamper_status();
 }
 
-void LoxBusTreeAlarmSiren::ReceiveDirect(LoxCanMessage &message) {
+void LoxBusTreeAlarmSiren::ReceiveDirect(const LoxCanMessage &message) {
   switch (message.commandNat) {
   case Digital_Value:
     hardware_strobe_light((message.value32 & 1) == 1);
@@ -22,18 +22,18 @@ class LoxBusTreeAlarmSiren : public LoxBusTreeDevice {
   tTreeAlarmSirenConfig config;
 
   bool hardwareTamperStatusOk;
-  bool tamperStatusOk;
-  int32_t tamperStatusTimer;
-  int32_t alarmSoundMaxDurationTimer;
+  LoxTimer tamperStatusTimer;         // the tamper status is sent every 30s as an alive message
+  LoxTimer alarmSoundMaxDurationTimer;
 
   void send_tamper_status(void);
   void hardware_strobe_light(bool status);
   void hardware_alarm_sound(bool status);
+  void hardware_tamper_status(bool statusOk);
 
   virtual void ConfigUpdate(void);
   virtual void SendValues(void);
-  virtual void Timer10ms(void);
-  virtual void ReceiveDirect(LoxCanMessage &message);
+  virtual void TimerExpired(LoxTimer &timer);
+  virtual void ReceiveDirect(const LoxCanMessage &message);
   virtual void SetState(eDeviceState state);
 
 public:
@@ -24,7 +24,7 @@ void LoxBusTreeRgbwDimmer::ConfigUpdate(void) {
 void LoxBusTreeRgbwDimmer::ConfigLoadDefaults(void) {
 }
 
-void LoxBusTreeRgbwDimmer::ReceiveDirect(LoxCanMessage &message) {
+void LoxBusTreeRgbwDimmer::ReceiveDirect(const LoxCanMessage &message) {
     #if DEBUG
     message.print(this->driver);
     #endif
@@ -25,7 +25,7 @@ class LoxBusTreeRgbwDimmer : public LoxBusTreeDevice {
 
   virtual void ConfigUpdate(void);
   virtual void ConfigLoadDefaults(void);
-  virtual void ReceiveDirect(LoxCanMessage &message);
+  virtual void ReceiveDirect(const LoxCanMessage &message);
   virtual void ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size);
 
 public:
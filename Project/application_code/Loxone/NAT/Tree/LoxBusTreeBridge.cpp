@@ -0,0 +1,129 @@
+//
+//  LoxBusTreeBridge.cpp
+//
+//  Created by Markus Fritze on 06.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxBusTreeBridge.hpp"
+#include "LoxBusTreeExtension.hpp"
+#include <__cross_studio_io.h>
+#include <string.h>
+
+LoxBusTreeBridge::LoxBusTreeBridge(LoxCANBaseDriver &treeBusDriver, LoxBusTreeExtension &treeExtension, eTreeBranch treeBranch)
+  : LoxExtension(treeBusDriver, treeExtension.serial, eDeviceType_t(treeExtension.device_type), treeExtension.hardware_version, treeExtension.version), treeExtension(treeExtension), treeBranch(treeBranch), fragmentDropped(false), shortcutTime(0), shortcutReportTime(0) {
+  memset(&this->statistics, 0, sizeof(this->statistics));
+  this->reservation.count = 0;
+  this->reservation.transmitClass = eTransmitClass_bulk;
+  treeExtension.Driver(treeBranch).Attach(this);
+}
+
+/***
+ *  All messages of the devices on the Tree bus are forwarded to the Loxone Link. The bridge
+ *  requests no filters, so it receives every message of the bus. Messages of the Miniserver
+ *  are only on the bus, if it is wired to the other Tree bus.
+ ***/
+void LoxBusTreeBridge::ReceiveMessage(const LoxCanMessage &message) {
+  if (!message.isNATmessage(this->driver))
+    return;
+  if (message.directionNat == LoxCmdNATDirection_t_fromServer) {
+    ReceiveShortcut(message);
+    return;
+  }
+  if (message.directionNat != LoxCmdNATDirection_t_fromDevice)
+    return;
+  if (this->treeBranch == eTreeBranch_rightBranch and this->treeExtension.Shortcut()) { // the left branch received it as well
+    ++this->statistics.SDup;
+    return;
+  }
+  LoxCanMessage msg = message;
+  this->treeExtension.from_treebus_to_loxonelink(this->treeBranch, msg, eSendPolicy_dropNewest, 0);
+  ++this->statistics.Up;
+}
+
+/***
+ *  Only the Tree Base Extension sends Miniserver messages onto a Tree bus, so this one was sent
+ *  by the other branch onto the same wire. A Tree_Shortcut_Test is answered every time, it tells
+ *  the Miniserver, that the shortcut still exists. All other messages are reported as a
+ *  Tree_Shortcut, at most once per TREE_SHORTCUT_REPORT_INTERVAL, so the reports do not double
+ *  the load of the Loxone Link again.
+ ***/
+void LoxBusTreeBridge::ReceiveShortcut(const LoxCanMessage &message) {
+  CTL_TIME_t now = ctl_get_current_time();
+  ++this->statistics.Shrt;
+  this->shortcutTime = now | 1; // 0 = never
+  LoxCanMessage msg = message;
+  msg.directionNat = LoxCmdNATDirection_t_fromServerShortcut;
+  if (msg.commandNat == Tree_Shortcut_Test) {
+    msg.deviceNAT = 0x00;
+    ++this->statistics.STst;
+  } else {
+    if (this->shortcutReportTime and now - this->shortcutReportTime < TREE_SHORTCUT_REPORT_INTERVAL)
+      return;
+    this->shortcutReportTime = now | 1;
+    msg.commandNat = Tree_Shortcut;
+    msg.fragmented = LoxCmdNATPackage_t_standard;
+    memset(msg.can_data, 0, sizeof(msg.can_data));
+    ++this->statistics.SRep;
+  }
+  msg.value8 = (this->treeBranch == eTreeBranch_leftBranch) ? 0x40 : 0x00;
+  this->treeExtension.from_treebus_to_loxonelink(this->treeBranch, msg, eSendPolicy_dropNewest, 0);
+}
+
+bool LoxBusTreeBridge::Shortcut(void) const {
+  CTL_TIME_t time = this->shortcutTime;
+  return time and ctl_get_current_time() - time < TREE_SHORTCUT_TIMEOUT;
+}
+
+/***
+ *  Queue a message of the Miniserver for the devices. This is called in the RX task of the
+ *  Loxone Link and never blocks it, a message, which does not fit, is dropped and the Miniserver
+ *  repeats it. The fragments of a package are sent without a gap, so the whole package is
+ *  reserved with its Fragment_Start, the entries left over by a lost fragment are returned with
+ *  the next package. Packages larger than the bulk queue have to be sent by the Miniserver slowly
+ *  enough for the Tree bus.
+ ***/
+void LoxBusTreeBridge::Downstream(const LoxCanMessage &treeMessage) {
+  LoxCanMessage msg = treeMessage;
+  eSendPolicy policy = eSendPolicy_dropNewest;
+  if (msg.commandNat == Fragment_Start) {
+    this->fragmentDropped = !this->driver.TransmitReserve(this->reservation, 1 + (msg.value16 + 6) / 7, 0, LoxCANBaseDriver::FragmentTransmitClass(LoxMsgNATCommand_t(msg.value8)));
+  } else if (msg.commandNat != Fragment_Data) {
+    if (this->driver.TransmitClass(msg) == eTransmitClass_value)
+      policy = eSendPolicy_coalesce; // only the latest value of an output matters
+  }
+  if (msg.fragmented && this->fragmentDropped) {
+    ++this->statistics.Drop;
+    return;
+  }
+  switch (this->driver.SendMessage(msg, policy, 0, msg.fragmented ? &this->reservation : NULL)) {
+  case eSendStatus_queued:
+    ++this->statistics.Down;
+    break;
+  case eSendStatus_coalesced:
+    ++this->statistics.Coal;
+    break;
+  default:
+    ++this->statistics.Drop;
+    if (msg.fragmented) { // the rest of the package is useless
+      this->fragmentDropped = true;
+      this->driver.TransmitRelease(this->reservation);
+    }
+    break;
+  }
+}
+
+#if DEBUG
+void LoxBusTreeBridge::StatisticsPrint() const {
+  debug_printf("Tree%d Up:%d;", this->treeBranch, this->statistics.Up);
+  debug_printf("Down:%d;", this->statistics.Down);
+  debug_printf("Coal:%d;", this->statistics.Coal);
+  debug_printf("Drop:%d;", this->statistics.Drop);
+  debug_printf("Shrt:%d;", this->statistics.Shrt);
+  debug_printf("SRep:%d;", this->statistics.SRep);
+  debug_printf("STst:%d;", this->statistics.STst);
+  debug_printf("SDup:%d;", this->statistics.SDup);
+  debug_printf("REC:%d;", this->driver.GetReceiveErrorCounter());
+  debug_printf("TEC:%d\n", this->driver.GetTransmitErrorCounter());
+}
+#endif
@@ -0,0 +1,70 @@
+//
+//  LoxBusTreeBridge.hpp
+//
+//  Created by Markus Fritze on 06.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxBusTreeBridge_hpp
+#define LoxBusTreeBridge_hpp
+
+#include "LoxExtension.hpp"
+#include "LoxNATExtension.hpp"
+
+class LoxBusTreeExtension;
+
+#define TREE_SHORTCUT_TIMEOUT 60000        // ms without a Miniserver message on the Tree bus, till the shortcut is considered fixed
+#define TREE_SHORTCUT_REPORT_INTERVAL 1000 // ms between two Tree_Shortcut messages of a branch
+
+/***
+ *  Connects a branch of the Tree Base Extension to a physical Tree bus. It is an extension on the
+ *  driver of the Tree bus, which receives all messages of the devices and forwards them to the
+ *  Loxone Link. The messages of the Miniserver to the branch are queued in the transmit queues
+ *  of the Tree bus driver, which run at 50kbit/s instead of the 125kbit/s of the Loxone Link.
+ *  A burst of the Miniserver therefore has to be thinned out: values to the same output replace
+ *  the queued value, a fragmented package is queued completely or not at all.
+ *
+ *  A message of the Miniserver received on the Tree bus means both Tree buses are wired together.
+ *  It is reported to the Miniserver as a Tree_Shortcut instead of being forwarded, see
+ *  LoxCanMessage.hpp. While the shortcut exists, messages to both branches are only sent on
+ *  one of them, otherwise every message is on the wire twice. The Miniserver sends Tree_Shortcut_Test
+ *  messages to check the wiring, they keep the shortcut alive, till it is fixed.
+ ***/
+class LoxBusTreeBridge : public LoxExtension {
+  LoxBusTreeExtension &treeExtension;
+  const eTreeBranch treeBranch;
+  bool fragmentDropped;              // the current fragmented package did not fit into the transmit queue
+  tTransmitReservation reservation; // transmit entries of the current fragmented package
+  CTL_TIME_t shortcutTime;       // last Miniserver message received on the Tree bus
+  CTL_TIME_t shortcutReportTime; // last Tree_Shortcut sent to the Miniserver
+
+  void ReceiveShortcut(const LoxCanMessage &message);
+
+public:
+  struct {
+    uint32_t Up;   // messages from the devices to the Loxone Link
+    uint32_t Down; // messages from the Loxone Link to the devices
+    uint32_t Coal; // values, which replaced a queued value
+    uint32_t Drop; // messages to the devices, which did not fit into the transmit queue
+    uint32_t Shrt; // messages of the Miniserver received on the Tree bus
+    uint32_t SRep; // Tree_Shortcut messages sent to the Miniserver
+    uint32_t STst; // Tree_Shortcut_Test messages answered
+    uint32_t SDup; // messages not forwarded, because the other branch did it on the same wire
+  } statistics;
+
+  LoxBusTreeBridge(LoxCANBaseDriver &treeBusDriver, LoxBusTreeExtension &treeExtension, eTreeBranch treeBranch);
+
+  // driver of the physical Tree bus
+  const LoxCANBaseDriver &Bus(void) const { return this->driver; };
+  // queue a message of the Miniserver for the devices, it is already addressed for the Tree bus
+  void Downstream(const LoxCanMessage &treeMessage);
+  // is the Tree bus wired to the other Tree bus?
+  bool Shortcut(void) const;
+
+  virtual void ReceiveMessage(const LoxCanMessage &message);
+#if DEBUG
+  void StatisticsPrint() const;
+#endif
+};
+
+#endif /* LoxBusTreeBridge_hpp */
@@ -6,12 +6,35 @@
 //
 
 #include "LoxBusTreeExtension.hpp"
+#include "LoxBusTreeBridge.hpp"
 #include "global_functions.hpp"
 #include <stdio.h>
 #include <string.h>
 
 LoxBusTreeExtension::LoxBusTreeExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive)
-  : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_TreeBaseExtension << 24), eDeviceType_t_TreeBaseExtension, 0, 10031125, 0, sizeof(config), &config, alive), treeDevicesLeftCount(0), treeDevicesRightCount(0), leftDriver(this, eTreeBranch_leftBranch), rightDriver(this, eTreeBranch_rightBranch) {
+  : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_TreeBaseExtension << 24), eDeviceType_t_TreeBaseExtension, 0, 10031125, 0, sizeof(config), &config, alive), treeDevicesLeftCount(0), treeDevicesRightCount(0), leftDriver(this, eTreeBranch_leftBranch), rightDriver(this, eTreeBranch_rightBranch), upstreamNext(0), upstreamTimer(this) {
+  memset(this->treeDeviceRoute, 0, sizeof(this->treeDeviceRoute));
+  memset(this->upstreamStatistics, 0, sizeof(this->upstreamStatistics));
+}
+
+/***
+ *  Messages from physical Tree buses arrive in their RX tasks, which can not use the timers.
+ *  Their queues are forwarded every 10ms.
+ ***/
+void LoxBusTreeExtension::Startup(void) {
+  if (this->leftDriver.Bridge() or this->rightDriver.Bridge())
+    TimerSchedule(this->upstreamTimer, TIMER_WHEEL_TICK);
+}
+
+void LoxBusTreeExtension::TimerExpired(LoxTimer &timer) {
+  if (&timer == &this->upstreamTimer) {
+    UpstreamDeferred();
+    UpstreamForward();
+    if (this->leftDriver.Bridge() or this->rightDriver.Bridge() or this->upstreamQueue[0].Count() or this->upstreamQueue[1].Count() or this->upstreamDeferred[0].Count() or this->upstreamDeferred[1].Count())
+      TimerSchedule(this->upstreamTimer, TIMER_WHEEL_TICK);
+  } else {
+    LoxNATExtension::TimerExpired(timer);
+  }
 }
 
 /***
@@ -27,12 +50,95 @@ void LoxBusTreeExtension::AddDevice(LoxBusTreeDevice *device, eTreeBranch branch
   }
 }
 
+/***
+ *  Find a device on both branches by its serial number
+ ***/
+LoxBusTreeDevice *LoxBusTreeExtension::FindDevice(uint32_t serial) const {
+  for (int i = 0; i < this->treeDevicesLeftCount; ++i)
+    if (this->treeDevicesLeft[i]->serial == serial)
+      return this->treeDevicesLeft[i];
+  for (int i = 0; i < this->treeDevicesRightCount; ++i)
+    if (this->treeDevicesRight[i]->serial == serial)
+      return this->treeDevicesRight[i];
+  return NULL;
+}
+
+/***
+ *  Keep the routing table in sync with the NATs of the devices. The devices only change their
+ *  NAT with a NAT_Offer or Park_Devices, so the table is updated after these were forwarded.
+ ***/
+void LoxBusTreeExtension::RouteUpdate(const LoxCanMessage &message) {
+  if (message.commandNat == Park_Devices) {
+    memset(this->treeDeviceRoute, 0, sizeof(this->treeDeviceRoute));
+    for (int i = 0; i < this->treeDevicesLeftCount; ++i)
+      RouteDevice(this->treeDevicesLeft[i]);
+    for (int i = 0; i < this->treeDevicesRightCount; ++i)
+      RouteDevice(this->treeDevicesRight[i]);
+  } else if (message.commandNat == NAT_Offer) {
+    LoxBusTreeDevice *device = FindDevice(message.value32);
+    if (!device)
+      return;
+    for (int i = 0; i < TREE_NAT_COUNT; ++i) { // remove the previous NAT
+      if (this->treeDeviceRoute[i] == device)
+        this->treeDeviceRoute[i] = NULL;
+    }
+    RouteDevice(device);
+  }
+}
+
+/***
+ *  Add a device with its current NAT to the routing table. Parked devices are not in it,
+ *  messages to them are forwarded to all devices.
+ ***/
+void LoxBusTreeExtension::RouteDevice(LoxBusTreeDevice *device) {
+  uint8_t nat = device->GetNAT();
+  if (nat != 0x00 and (nat & 0x80) == 0x00)
+    this->treeDeviceRoute[nat] = device;
+}
+
 LoxBusTreeExtensionCANDriver &LoxBusTreeExtension::Driver(eTreeBranch branch) {
   if (branch == eTreeBranch_leftBranch)
     return this->leftDriver;
   return this->rightDriver;
 }
 
+/***
+ *  The error counters of a branch are the ones of its physical Tree bus
+ ***/
+const LoxCANBaseDriver &LoxBusTreeExtension::StatusDriver(eTreeBranch branch) {
+  if (branch == eTreeBranch_extension)
+    return this->driver;
+  return Driver(branch);
+}
+
+/***
+ *  Forward a message to the devices on the physical Tree bus of a branch, if there is one
+ ***/
+void LoxBusTreeExtension::Downstream(eTreeBranch branch, const LoxCanMessage &treeMessage) {
+  LoxBusTreeBridge *bridge = Driver(branch).Bridge();
+  if (bridge)
+    bridge->Downstream(treeMessage);
+}
+
+bool LoxBusTreeExtension::Shortcut(void) const {
+  LoxBusTreeBridge *left = this->leftDriver.Bridge();
+  LoxBusTreeBridge *right = this->rightDriver.Bridge();
+  return left and right and (left->Shortcut() or right->Shortcut());
+}
+
+/***
+ *  Forward a message to the devices on both physical Tree buses. If they are wired together,
+ *  the devices of the right branch already received it from the left one.
+ ***/
+void LoxBusTreeExtension::DownstreamBoth(const LoxCanMessage &treeMessage) {
+  Downstream(eTreeBranch_leftBranch, treeMessage);
+  if (Shortcut()) {
+    ++this->rightDriver.Bridge()->statistics.SDup;
+    return;
+  }
+  Downstream(eTreeBranch_rightBranch, treeMessage);
+}
+
 /***
  *  Send values after the start
  ***/
@@ -42,41 +148,160 @@ void LoxBusTreeExtension::SendValues(void) {
 }
 
 /***
- *
+ *  Forward a message from a Tree device to the Loxone Link, optionally delayed. When all devices
+ *  answer at once, e.g. to a Search_Devices, the messages wait in the queue of their branch
+ *  and the branches take turns, see UpstreamForward(). Delayed messages of the emulated devices
+ *  wait per branch till they are due, a search reaches up to MAX_TREE_DEVICECOUNT devices per
+ *  branch, far more than the deferred queue of the driver holds. Fragmented packages, which
+ *  reserved their transmit entries, are sent directly.
  ***/
-void LoxBusTreeExtension::from_treebus_to_loxonelink(eTreeBranch treeBranch, LoxCanMessage &message) {
+eSendStatus LoxBusTreeExtension::from_treebus_to_loxonelink(eTreeBranch treeBranch, LoxCanMessage &message, eSendPolicy policy, CTL_TIME_t timeout, CTL_TIME_t msDelay, tTransmitReservation *reservation) {
   message.busType = LoxCmdNATBus_t_LoxoneLink;
   message.extensionNat = this->extensionNAT;
   if (treeBranch == eTreeBranch_leftBranch and (message.commandNat == Search_Reply or message.commandNat == NAT_Index_Request))
     message.data[0] |= 0x40;
-  this->driver.SendMessage(message);
+  if (treeBranch == eTreeBranch_extension) {
+    if (msDelay)
+      return this->driver.SendMessageDelayed(message, msDelay);
+    return this->driver.SendMessage(message, policy, timeout, reservation);
+  }
+  if (reservation or policy == eSendPolicy_block)
+    return this->driver.SendMessage(message, policy, timeout, reservation);
+
+  int b = treeBranch - eTreeBranch_leftBranch;
+  if (msDelay) { // only the emulated devices delay their replies, they run in the RX task of the Loxone Link
+    if (!this->upstreamDeferred[b].Add(message, ctl_get_current_time() + msDelay)) {
+      ++this->upstreamStatistics[b].Drop;
+      return eSendStatus_dropped;
+    }
+    if (!this->upstreamTimer.Scheduled())
+      TimerSchedule(this->upstreamTimer, TIMER_WHEEL_TICK);
+    return eSendStatus_queued;
+  }
+  if (!UpstreamAdd(b, message)) {
+    ++this->upstreamStatistics[b].Drop;
+    return eSendStatus_dropped;
+  }
+  if (!Driver(treeBranch).Bridge()) { // emulated devices run in the RX task of the Loxone Link
+    UpstreamForward();
+    if (this->upstreamQueue[b].Count() and !this->upstreamTimer.Scheduled())
+      TimerSchedule(this->upstreamTimer, TIMER_WHEEL_TICK);
+  }
+  return eSendStatus_queued;
+}
+
+/***
+ *  Add a message to the queue of a branch, false if it is full
+ ***/
+bool LoxBusTreeExtension::UpstreamAdd(int b, const LoxCanMessage &message) {
+  LoxCanMessage *slot = this->upstreamQueue[b].ProducerSlot();
+  if (!slot)
+    return false;
+  *slot = message;
+  this->upstreamQueue[b].ProducerCommit();
+  if (this->upstreamQueue[b].Count() > this->upstreamStatistics[b].mQ)
+    this->upstreamStatistics[b].mQ = this->upstreamQueue[b].Count();
+  return true;
+}
+
+/***
+ *  Move the delayed replies, which are due, into the queue of their branch. A reply, which
+ *  does not fit, waits for the next tick. Only called in the RX task of the Loxone Link.
+ ***/
+void LoxBusTreeExtension::UpstreamDeferred(void) {
+  CTL_TIME_t now = ctl_get_current_time();
+  for (int b = 0; b < 2; ++b) {
+    const tDeferredEntry *entry;
+    while ((entry = this->upstreamDeferred[b].Peek()) != NULL and (int32_t)(now - entry->time) >= 0) {
+      if (!UpstreamAdd(b, entry->message))
+        break;
+      this->upstreamDeferred[b].Remove();
+    }
+  }
+}
+
+/***
+ *  Move the waiting messages of the branches alternately into the transmit queues of the
+ *  Loxone Link. A message stays waiting, while its Link queue has less than TREE_UPSTREAM_HEADROOM
+ *  free entries, so the own replies of the extension (Pong, Alive_Packet, ...) always fit.
+ *  Only called in the RX task of the Loxone Link, it is the single consumer of the queues.
+ ***/
+void LoxBusTreeExtension::UpstreamForward(void) {
+  int idle = 0; // branches in a row, which had nothing to forward
+  while (idle < 2) {
+    int b = this->upstreamNext;
+    this->upstreamNext = b ^ 1;
+    LoxCanMessageRing<TREE_UPSTREAM_QUEUE> &queue = this->upstreamQueue[b];
+    if (queue.Count() == 0 or this->driver.TransmitFree(this->driver.TransmitClass(queue.Peek(0))) <= TREE_UPSTREAM_HEADROOM) {
+      ++idle;
+      continue;
+    }
+    this->driver.SendMessage(queue.Peek(0));
+    queue.Release(1);
+    ++this->upstreamStatistics[b].Up;
+    idle = 0;
+  }
+}
+
+/***
+ *  The message as the devices receive it: on the Tree bus, addressed with the device NAT.
+ *  It is a copy, the received message is shared with the other extensions of the driver.
+ ***/
+static LoxCanMessage tree_message(const LoxCanMessage &message) {
+  LoxCanMessage treeMessage = message;
+  treeMessage.busType = LoxCmdNATBus_t_TreeBus;
+  treeMessage.extensionNat = message.deviceNAT;
+  return treeMessage;
+}
+
+/***
+ *  The fragments of packages to the devices on a physical Tree bus are forwarded as they arrive,
+ *  the emulated devices receive the package reassembled by the driver.
+ ***/
+void LoxBusTreeExtension::ReceiveMessage(const LoxCanMessage &message) {
+  LoxNATExtension::ReceiveMessage(message);
+  if (!message.isNATmessage(this->driver) || message.directionNat < LoxCmdNATDirection_t_fromServerShortcut || !message.fragmented || message.deviceNAT == 0x00)
+    return;
+  if (message.extensionNat != 0xFF and (this->extensionNAT == 0x00 or message.extensionNat != this->extensionNAT))
+    return;
+  const LoxCanMessage treeMessage = tree_message(message);
+  if (message.deviceNAT == 0xFF) // to all devices
+    DownstreamBoth(treeMessage);
+  else // a device or the parked devices of a branch
+    Downstream((message.deviceNAT & 0x40) ? eTreeBranch_leftBranch : eTreeBranch_rightBranch, treeMessage);
 }
 
 /***
  *  A direct message received
  ***/
-void LoxBusTreeExtension::ReceiveDirect(LoxCanMessage &message) {
+void LoxBusTreeExtension::ReceiveDirect(const LoxCanMessage &message) {
   if (message.deviceNAT != 0) { // forward to a tree device?
-    message.busType = LoxCmdNATBus_t_TreeBus;
+    const LoxCanMessage treeMessage = tree_message(message);
     uint8_t nat = message.deviceNAT;
-    message.extensionNat = nat;
     // messages to parked devices is sent to both branches for parked devices, except for a NAT offer
     if ((nat & 0x80) == 0x80 and message.commandNat != NAT_Offer) {
       for (int i = 0; i < this->treeDevicesLeftCount; ++i)
-        this->treeDevicesLeft[i]->ReceiveMessage(message);
+        this->treeDevicesLeft[i]->ReceiveMessage(treeMessage);
       for (int i = 0; i < this->treeDevicesRightCount; ++i)
-        this->treeDevicesRight[i]->ReceiveMessage(message);
-    } else {
-      if (message.commandNat == NAT_Offer)
-        nat = message.data[0]; // for NAT offset use the new NAT
-      if (nat & 0x40) {        // left branch?
+        this->treeDevicesRight[i]->ReceiveMessage(treeMessage);
+      DownstreamBoth(treeMessage);
+    } else if (message.commandNat == NAT_Offer) {
+      nat = message.data[0]; // for NAT offset use the new NAT
+      if (nat & 0x40) {      // left branch?
         for (int i = 0; i < this->treeDevicesLeftCount; ++i)
-          this->treeDevicesLeft[i]->ReceiveMessage(message);
+          this->treeDevicesLeft[i]->ReceiveMessage(treeMessage);
+        Downstream(eTreeBranch_leftBranch, treeMessage);
       } else { // right branch
         for (int i = 0; i < this->treeDevicesRightCount; ++i)
-          this->treeDevicesRight[i]->ReceiveMessage(message);
+          this->treeDevicesRight[i]->ReceiveMessage(treeMessage);
+        Downstream(eTreeBranch_rightBranch, treeMessage);
       }
+    } else if (this->treeDeviceRoute[nat]) { // only the device with this NAT
+      this->treeDeviceRoute[nat]->ReceiveMessage(treeMessage);
+    } else { // a device on the physical Tree bus of its branch
+      Downstream((nat & 0x40) ? eTreeBranch_leftBranch : eTreeBranch_rightBranch, treeMessage);
     }
+    RouteUpdate(treeMessage);
   } else {
     LoxCanMessage msg;
     switch (message.commandNat) {
@@ -98,29 +323,32 @@ void LoxBusTreeExtension::ReceiveDirect(LoxCanMessage &message) {
 }
 
 // Forward other messages to the tree devices
-void LoxBusTreeExtension::ReceiveBroadcast(LoxCanMessage &message) {
+void LoxBusTreeExtension::ReceiveBroadcast(const LoxCanMessage &message) {
   LoxNATExtension::ReceiveBroadcast(message);
 
-  message.busType = LoxCmdNATBus_t_TreeBus;
-  uint8_t nat = message.deviceNAT;
-  message.extensionNat = nat;
+  const LoxCanMessage treeMessage = tree_message(message);
   for (int i = 0; i < this->treeDevicesLeftCount; ++i)
-    this->treeDevicesLeft[i]->ReceiveMessage(message);
+    this->treeDevicesLeft[i]->ReceiveMessage(treeMessage);
   for (int i = 0; i < this->treeDevicesRightCount; ++i)
-    this->treeDevicesRight[i]->ReceiveMessage(message);
+    this->treeDevicesRight[i]->ReceiveMessage(treeMessage);
+  if (treeMessage.extensionNat != 0x00) { // the devices ignore broadcasts to the extensions
+    DownstreamBoth(treeMessage);
+  }
+  RouteUpdate(treeMessage);
 }
 
 void LoxBusTreeExtension::ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size) {
   if (deviceNAT == 0x00 || driver.isTreeBusDriver()) { // to this device?
     LoxNATExtension::ReceiveDirectFragment(command, extensionNAT, deviceNAT, data, size);
+  } else if ((deviceNAT & 0x80) == 0x00) { // only the device with this NAT
+    if (this->treeDeviceRoute[deviceNAT])
+      this->treeDeviceRoute[deviceNAT]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
+  } else if (deviceNAT & 0x40) { // parked devices on the left tree?
+    for (int i = 0; i < this->treeDevicesLeftCount; ++i)
+      this->treeDevicesLeft[i]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
   } else {
-    if (deviceNAT & 0x40) { // left tree?
-      for (int i = 0; i < this->treeDevicesLeftCount; ++i)
-        this->treeDevicesLeft[i]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
-    } else {
-      for (int i = 0; i < this->treeDevicesRightCount; ++i)
-        this->treeDevicesRight[i]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
-    }
+    for (int i = 0; i < this->treeDevicesRightCount; ++i)
+      this->treeDevicesRight[i]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
   }
 }
 
@@ -134,14 +362,3 @@ void LoxBusTreeExtension::ReceiveBroadcastFragment(LoxMsgNATCommand_t command, u
       this->treeDevicesRight[i]->ReceiveBroadcastFragment(command, deviceNAT, deviceNAT, data, size);
   }
 }
-
-/***
- *  10ms Timer to be called 100x per second
- ***/
-void LoxBusTreeExtension::Timer10ms() {
-  LoxNATExtension::Timer10ms();
-  for (int i = 0; i < this->treeDevicesLeftCount; ++i)
-    this->treeDevicesLeft[i]->Timer10ms();
-  for (int i = 0; i < this->treeDevicesRightCount; ++i)
-    this->treeDevicesRight[i]->Timer10ms();
-}
\ No newline at end of file
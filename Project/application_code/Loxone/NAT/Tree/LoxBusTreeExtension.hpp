@@ -11,8 +11,13 @@
 #include "LoxBusTreeDevice.hpp"
 #include "LoxNATExtension.hpp"
 #include "LoxBusTreeExtensionCANDriver.hpp"
+#include "LoxCanDeferredQueue.hpp"
+#include "LoxCanMessageRing.hpp"
 
 #define MAX_TREE_DEVICECOUNT 62 // max. number per branch (6 bits, but 0 and 63 are reserved)
+#define TREE_NAT_COUNT 0x80     // device NATs of both branches, the left branch has bit 6 set
+#define TREE_UPSTREAM_QUEUE 32  // messages per branch waiting for the Loxone Link, a power of 2
+#define TREE_UPSTREAM_HEADROOM 4 // free entries of every Link transmit queue kept for the extension itself
 
 class tTreeExtensionConfig : public tConfigHeader {
 public:
@@ -29,22 +34,51 @@ private:
   LoxBusTreeExtensionCANDriver rightDriver;
   int treeDevicesRightCount;
   LoxBusTreeDevice *treeDevicesRight[MAX_TREE_DEVICECOUNT];
+  LoxBusTreeDevice *treeDeviceRoute[TREE_NAT_COUNT]; // device NAT => device, parked devices are not in it
+  LoxCanMessageRing<TREE_UPSTREAM_QUEUE> upstreamQueue[2]; // per branch, filled by the devices or the bridge
+  LoxCanDeferredQueue<MAX_TREE_DEVICECOUNT> upstreamDeferred[2]; // per branch, delayed replies of the emulated devices
+  int upstreamNext;                                       // branch, which is forwarded next
+  LoxTimer upstreamTimer;
+
+  LoxBusTreeDevice *FindDevice(uint32_t serial) const;
+  void RouteUpdate(const LoxCanMessage &message);
+  void RouteDevice(LoxBusTreeDevice *device);
+  void Downstream(eTreeBranch branch, const LoxCanMessage &treeMessage);
+  void DownstreamBoth(const LoxCanMessage &treeMessage);
+  bool UpstreamAdd(int b, const LoxCanMessage &message);
+  void UpstreamDeferred(void);
+  void UpstreamForward(void);
+  virtual const LoxCANBaseDriver &StatusDriver(eTreeBranch branch);
 
 public:
   tTreeExtensionConfig config;
+  struct {
+    uint32_t Up;   // messages forwarded to the Loxone Link
+    uint32_t Drop; // messages dropped, because the queue of the branch was full
+    uint32_t mQ;   // max. number of waiting messages
+  } upstreamStatistics[2]; // left and right branch
+
+  virtual void Startup(void);
+  virtual void TimerExpired(LoxTimer &timer);
 
   virtual void SendValues(void);
-  virtual void ReceiveDirect(LoxCanMessage &message);
-  virtual void ReceiveBroadcast(LoxCanMessage &message);
+  virtual void ReceiveMessage(const LoxCanMessage &message);
+  virtual void ReceiveDirect(const LoxCanMessage &message);
+  virtual void ReceiveBroadcast(const LoxCanMessage &message);
   virtual void ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size);
   virtual void ReceiveBroadcastFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size);
-  virtual void Timer10ms(void);
 
-  void from_treebus_to_loxonelink(eTreeBranch treeBranch, LoxCanMessage &message);
+  eSendStatus from_treebus_to_loxonelink(eTreeBranch treeBranch, LoxCanMessage &message, eSendPolicy policy, CTL_TIME_t timeout, CTL_TIME_t msDelay = 0, tTransmitReservation *reservation = NULL);
+  bool TransmitReserve(tTransmitReservation &reservation, int count, CTL_TIME_t timeout, eTransmitClass transmitClass) { return this->driver.TransmitReserve(reservation, count, timeout, transmitClass); };
+  void TransmitRelease(tTransmitReservation &reservation) { this->driver.TransmitRelease(reservation); };
+  LoxTimerWheel &TimerWheel(void) { return this->driver.TimerWheel(); };
 
 public:
   LoxBusTreeExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive);
 
+  // are both physical Tree buses wired together?
+  bool Shortcut(void) const;
+
   // device driver for devices below this extension
   LoxBusTreeExtensionCANDriver &Driver(eTreeBranch branch);
 
@@ -6,30 +6,62 @@
 //
 
 #include "LoxBusTreeExtensionCANDriver.hpp"
+#include "LoxBusTreeBridge.hpp"
 #include "LoxBusTreeExtension.hpp"
 #include <stdio.h>
 
-LoxBusTreeExtensionCANDriver::LoxBusTreeExtensionCANDriver(LoxBusTreeExtension *parentTreeExtension, eTreeBranch treeBranch) : LoxCANBaseDriver(tLoxCANDriverType_TreeBus), parentTreeExtension(parentTreeExtension), treeBranch(treeBranch) {
+LoxBusTreeExtensionCANDriver::LoxBusTreeExtensionCANDriver(LoxBusTreeExtension *parentTreeExtension, eTreeBranch treeBranch) : LoxCANBaseDriver(tLoxCANDriverType_TreeBus), parentTreeExtension(parentTreeExtension), treeBranch(treeBranch), bridge(NULL) {
 }
 
 /***
- *  CAN error reporting and statistics
+ *  CAN error reporting and statistics of the physical Tree bus, emulated devices have no errors
  ***/
 uint32_t LoxBusTreeExtensionCANDriver::GetErrorCounter() const {
-  return 0; // never any errors
+  if (this->bridge)
+    return this->bridge->Bus().GetErrorCounter();
+  return 0;
 }
 
 uint8_t LoxBusTreeExtensionCANDriver::GetTransmitErrorCounter() const {
-  return 0; // never any errors
+  if (this->bridge)
+    return this->bridge->Bus().GetTransmitErrorCounter();
+  return 0;
 }
 
 uint8_t LoxBusTreeExtensionCANDriver::GetReceiveErrorCounter() const {
-  return 0; // never any errors
+  if (this->bridge)
+    return this->bridge->Bus().GetReceiveErrorCounter();
+  return 0;
 }
 
 /***
  *  Send the message from the device back to the Tree Base Extension
  ***/
-void LoxBusTreeExtensionCANDriver::SendMessage(LoxCanMessage &message) {
-    this->parentTreeExtension->from_treebus_to_loxonelink(this->treeBranch, message);
+eSendStatus LoxBusTreeExtensionCANDriver::SendMessage(LoxCanMessage &message, eSendPolicy policy, CTL_TIME_t timeout, tTransmitReservation *reservation) {
+  return this->parentTreeExtension->from_treebus_to_loxonelink(this->treeBranch, message, policy, timeout, 0, reservation);
+}
+
+/***
+ *  Deferred messages are queued by the driver of the Tree Base Extension as well
+ ***/
+eSendStatus LoxBusTreeExtensionCANDriver::SendMessageDelayed(LoxCanMessage &message, CTL_TIME_t msDelay) {
+  return this->parentTreeExtension->from_treebus_to_loxonelink(this->treeBranch, message, eSendPolicy_dropNewest, 0, msDelay);
+}
+
+/***
+ *  Messages are queued by the driver of the Tree Base Extension
+ ***/
+bool LoxBusTreeExtensionCANDriver::TransmitReserve(tTransmitReservation &reservation, int count, CTL_TIME_t timeout, eTransmitClass transmitClass) {
+  return this->parentTreeExtension->TransmitReserve(reservation, count, timeout, transmitClass);
+}
+
+void LoxBusTreeExtensionCANDriver::TransmitRelease(tTransmitReservation &reservation) {
+  this->parentTreeExtension->TransmitRelease(reservation);
+}
+
+/***
+ *  The timers of the devices run in the driver of the Tree Base Extension
+ ***/
+LoxTimerWheel &LoxBusTreeExtensionCANDriver::TimerWheel(void) {
+  return this->parentTreeExtension->TimerWheel();
 }
\ No newline at end of file
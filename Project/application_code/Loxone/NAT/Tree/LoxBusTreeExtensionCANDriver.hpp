@@ -12,14 +12,20 @@
 #include "LoxNATExtension.hpp"
 
 class LoxBusTreeExtension;
+class LoxBusTreeBridge;
 
 class LoxBusTreeExtensionCANDriver : public LoxCANBaseDriver {
   LoxBusTreeExtension *parentTreeExtension;
   eTreeBranch treeBranch;
+  LoxBusTreeBridge *bridge; // physical Tree bus of this branch, NULL = the devices are emulated
 
 public:
   LoxBusTreeExtensionCANDriver(LoxBusTreeExtension *parentTreeExtension, eTreeBranch treeBranch);
 
+  // connect the branch to a physical Tree bus
+  void Attach(LoxBusTreeBridge *bridge) { this->bridge = bridge; };
+  LoxBusTreeBridge *Bridge(void) const { return this->bridge; };
+
   // setup various CAN filters. At least one is required to receive messages!
   virtual void FilterAllowAll(uint32_t filterBank){};
   virtual void FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment){};
@@ -30,7 +36,11 @@ public:
   uint8_t GetReceiveErrorCounter() const;
 
   // send a message onto the CAN bus
-  void SendMessage(LoxCanMessage &message);
+  eSendStatus SendMessage(LoxCanMessage &message, eSendPolicy policy = eSendPolicy_dropNewest, CTL_TIME_t timeout = 0, tTransmitReservation *reservation = NULL);
+  eSendStatus SendMessageDelayed(LoxCanMessage &message, CTL_TIME_t msDelay);
+  bool TransmitReserve(tTransmitReservation &reservation, int count, CTL_TIME_t timeout, eTransmitClass transmitClass = eTransmitClass_bulk);
+  void TransmitRelease(tTransmitReservation &reservation);
+  LoxTimerWheel &TimerWheel(void);
 };
 
 #endif /* LoxBusTreeExtensionCANDriver_hpp */
\ No newline at end of file
@@ -0,0 +1,49 @@
+//
+//  crc.hpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef crc_hpp
+#define crc_hpp
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// The STM32 CRC32 over a whole buffer uses the CRC unit of the STM32. Without it (e.g. on the host)
+// a table is used, like for the streaming CRC32, because the CRC unit of the STM32F1 can not continue
+// from a given CRC value.
+#ifndef CRC_USE_HARDWARE
+#define CRC_USE_HARDWARE 1
+#endif
+
+// These are the 3 commonly used CRC algorithms for the Loxone hardware:
+
+// simple CRC8 with a Polynome of 0x85
+uint8_t crc8_default(const void *data, size_t len);
+
+// Used for Maxim 1-Wire hardware to calculate the CRC over the serialnumber
+uint8_t crc8_OneWire(const void *data, size_t size);
+
+// Used for Modbus, a CRC16
+uint16_t crc16_Modus(const void *data, size_t size);
+
+// STM32 CRC32 algorithm as available in the STM32 hardware. Used as CRC32 over packages, etc
+uint32_t crc32_stm32_aligned(const void *data, size_t size);
+
+// STM32 CRC32 of one more 32-bit word
+uint32_t crc32_stm32_word(uint32_t crc, uint32_t data);
+
+// The same CRC32 over data arriving in pieces (e.g. fragments), without buffering it. The result is
+// identical to crc32_stm32_aligned() over all pieces in one buffer.
+typedef struct {
+  uint32_t crc;
+  uint32_t word;  // bytes of the incomplete word, little endian
+  uint8_t count;  // number of bytes in word
+} tCRC32Stream;
+void crc32_stm32_stream_init(tCRC32Stream *stream);
+void crc32_stm32_stream_add(tCRC32Stream *stream, const void *data, size_t size);
+uint32_t crc32_stm32_stream_result(const tCRC32Stream *stream);
+
+#endif /* crc_hpp */
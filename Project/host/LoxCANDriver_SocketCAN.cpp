@@ -0,0 +1,276 @@
+//
+//  LoxCANDriver_SocketCAN.cpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxCANDriver_SocketCAN.hpp"
+#include "LoxExtension.hpp"
+#include "system.hpp"
+#include <__cross_studio_io.h>
+#include <errno.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SOCKETCAN_RCVBUF (1024 * 1024) // socket receive buffer, large enough for hundreds of extensions
+
+LoxCANDriver_SocketCAN::LoxCANDriver_SocketCAN(tLoxCANDriverType type, const char *interfaceName)
+  : LoxCANQueuedDriver(type), interfaceName(interfaceName), canSocket(-1), filterCount(0), receiveDropped(0), transmitErrorCounter(0), receiveErrorCounter(0) {
+}
+
+/***
+ *  An error frame from the CAN controller
+ ***/
+void LoxCANDriver_SocketCAN::ReceiveErrorFrame(const struct can_frame &frame) {
+  ++this->statistics.Err;
+  if (frame.can_id & CAN_ERR_BUSOFF)
+    ++this->statistics.HWE;
+  if (frame.can_id & CAN_ERR_CRTL) {
+    if (frame.data[1] & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE))
+      ++this->statistics.HWE;
+    if (frame.data[1] & CAN_ERR_CRTL_RX_OVERFLOW)
+      ++this->statistics.FOVR0;
+  }
+#ifdef CAN_ERR_CNT
+  if (frame.can_id & CAN_ERR_CNT) {
+    this->transmitErrorCounter = frame.data[6];
+    this->receiveErrorCounter = frame.data[7];
+  }
+#endif
+}
+
+/***
+ *  CAN RX Task to forward messages and timers to all extensions.
+ *  All frames available are read with a single recvmmsg() call.
+ ***/
+void LoxCANDriver_SocketCAN::vCANRXTask(void *pvParameters) {
+  LoxCANDriver_SocketCAN *_this = (LoxCANDriver_SocketCAN *)pvParameters;
+  static const int controlSize = CMSG_SPACE(sizeof(uint32_t));
+  struct can_frame frames[SOCKETCAN_BATCH];
+  struct iovec iov[SOCKETCAN_BATCH];
+  struct mmsghdr msgs[SOCKETCAN_BATCH];
+  uint8_t control[SOCKETCAN_BATCH][controlSize];
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < SOCKETCAN_BATCH; ++i) {
+    iov[i].iov_base = &frames[i];
+    iov[i].iov_len = sizeof(frames[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i];
+  }
+  CTL_TIME_t nextTimer = ctl_get_current_time() + 10;
+  while (1) {
+    int32_t wait = nextTimer - ctl_get_current_time();
+    struct pollfd pfd = {_this->canSocket, POLLIN, 0};
+    int count = 0;
+    ctl_host_cpu_release();
+    if (poll(&pfd, 1, wait > 0 ? wait : 0) > 0) {
+      for (int i = 0; i < SOCKETCAN_BATCH; ++i)
+        msgs[i].msg_hdr.msg_controllen = controlSize;
+      count = recvmmsg(_this->canSocket, msgs, SOCKETCAN_BATCH, MSG_DONTWAIT, NULL);
+    }
+    ctl_host_cpu_acquire();
+    if (count > 0) {
+      _this->statistics.RQ = count;
+      if ((uint32_t)count > _this->statistics.mRQ)
+        _this->statistics.mRQ = count;
+      for (int i = 0; i < count; ++i) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+          uint32_t dropped;
+          memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+          _this->statistics.ROvf += dropped - _this->receiveDropped;
+          _this->receiveDropped = dropped;
+        }
+        const struct can_frame &frame = frames[i];
+        if (frame.can_id & CAN_ERR_FLAG) {
+          _this->ReceiveErrorFrame(frame);
+        } else if ((frame.can_id & (CAN_EFF_FLAG | CAN_RTR_FLAG)) == CAN_EFF_FLAG && frame.can_dlc == 8) { // only accept standard Loxone packages
+          LoxCanMessage message;
+          message.identifier = frame.can_id & CAN_EFF_MASK;
+          memcpy(message.can_data, frame.data, 8);
+          _this->ReceiveMessage(message);
+        }
+      }
+    }
+    CTL_TIME_t now = ctl_get_current_time();
+    if ((int32_t)(now - nextTimer) >= 0) {
+      _this->Timer10ms();
+      nextTimer += 10;
+      if ((int32_t)(now - nextTimer) >= 0) // fell behind: skip the missed ticks, like the event on the STM32
+        nextTimer = now + 10;
+    }
+  }
+}
+
+/***
+ *  CAN TX Task to send pending messages to the CAN bus.
+ *  All queued messages (up to SOCKETCAN_BATCH) are sent with a single sendmmsg() call.
+ ***/
+void LoxCANDriver_SocketCAN::vCANTXTask(void *pvParameters) {
+  LoxCANDriver_SocketCAN *_this = (LoxCANDriver_SocketCAN *)pvParameters;
+  struct can_frame frames[SOCKETCAN_BATCH];
+  struct iovec iov[SOCKETCAN_BATCH];
+  struct mmsghdr msgs[SOCKETCAN_BATCH];
+  memset(frames, 0, sizeof(frames));
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < SOCKETCAN_BATCH; ++i) {
+    iov[i].iov_base = &frames[i];
+    iov[i].iov_len = sizeof(frames[i]);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int pending = 0; // frames taken from the queues, but not accepted by the socket yet
+  while (1) {
+    CTL_TIME_t nextDeferred;
+    CTL_TIME_t timeout = ctl_get_current_time() + 5;
+    if (_this->TransmitDeferred(&nextDeferred) && (int32_t)(nextDeferred - timeout) < 0)
+      timeout = nextDeferred;
+    ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->transmitEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_ABSOLUTE, timeout);
+    while (pending > 0 || _this->TransmitPending()) {
+      int c;
+      while (pending < SOCKETCAN_BATCH && (c = _this->TransmitNextClass()) >= 0) {
+        const tTransmitEntry *entry = _this->transmitQueue[c].Peek();
+        frames[pending].can_id = entry->message.identifier | CAN_EFF_FLAG;
+        frames[pending].can_dlc = 8;
+        memcpy(frames[pending].data, entry->message.can_data, 8);
+        _this->TransmitRemove(c);
+        ++pending;
+      }
+      ctl_host_cpu_release();
+      int sent = sendmmsg(_this->canSocket, msgs, pending, 0);
+      int error = errno;
+      ctl_host_cpu_acquire();
+      if (sent < 0) {
+        if (error == ENOBUFS || error == EAGAIN) { // the interface queue is full, try again a little bit later
+          ctl_timeout_wait(ctl_get_current_time() + 1);
+          continue;
+        }
+        ++_this->statistics.Err; // drop the frame, like a failed transmission without retransmission on the STM32
+        sent = 1;
+      }
+      pending -= sent;
+      memmove(&frames[0], &frames[sent], pending * sizeof(frames[0]));
+    }
+  }
+}
+
+/***
+ *  Open the socket and start the tasks
+ ***/
+void LoxCANDriver_SocketCAN::Startup(void) {
+  TransmitInit(transmitBufferControl, sizeof(transmitBufferControl) / sizeof(transmitBufferControl[0]),
+      transmitBufferValue, sizeof(transmitBufferValue) / sizeof(transmitBufferValue[0]),
+      transmitBufferBulk, sizeof(transmitBufferBulk) / sizeof(transmitBufferBulk[0]));
+
+  this->canSocket = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+  if (this->canSocket < 0) {
+    perror("socket(PF_CAN)");
+    exit(1);
+  }
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, this->interfaceName, IFNAMSIZ - 1);
+  if (ioctl(this->canSocket, SIOCGIFINDEX, &ifr) < 0) {
+    perror(this->interfaceName);
+    exit(1);
+  }
+  // nothing is received till the extensions requested their filters
+  setsockopt(this->canSocket, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+  can_err_mask_t errorMask = CAN_ERR_TX_TIMEOUT | CAN_ERR_LOSTARB | CAN_ERR_CRTL | CAN_ERR_PROT | CAN_ERR_TRX | CAN_ERR_ACK | CAN_ERR_BUSOFF | CAN_ERR_BUSERROR;
+#ifdef CAN_ERR_CNT
+  errorMask |= CAN_ERR_CNT;
+#endif
+  setsockopt(this->canSocket, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &errorMask, sizeof(errorMask));
+  int enable = 1;
+  setsockopt(this->canSocket, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+  int rcvbuf = SOCKETCAN_RCVBUF;
+  setsockopt(this->canSocket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  struct sockaddr_can addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.can_family = AF_CAN;
+  addr.can_ifindex = ifr.ifr_ifindex;
+  if (bind(this->canSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("bind(PF_CAN)");
+    exit(1);
+  }
+
+  ctl_task_run(&this->txTask, 0x20, LoxCANDriver_SocketCAN::vCANTXTask, this, "CAN_TX", 0, NULL, 0);
+  ctl_task_run(&this->rxTask, 0x10, LoxCANDriver_SocketCAN::vCANRXTask, this, "CAN_RX", 0, NULL, 0);
+
+  LoxCANBaseDriver::Startup();
+}
+
+/***
+ *  Apply the filter list to the socket
+ ***/
+void LoxCANDriver_SocketCAN::FilterApply(void) {
+  if (this->canSocket >= 0)
+    setsockopt(this->canSocket, SOL_CAN_RAW, CAN_RAW_FILTER, this->filters, this->filterCount * sizeof(this->filters[0]));
+}
+
+/***
+ *  Setup CAN filters in mask mode: a message is accepted, if all bits set in the mask match the identifier.
+ *  The kernel has no limit on the number of filters, each request gets its own entry.
+ ***/
+void LoxCANDriver_SocketCAN::FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment) {
+  if (filterBank >= MAX_FILTER_REQUESTS)
+    return;
+  this->filters[filterBank].can_id = (filterId & CAN_EFF_MASK) | CAN_EFF_FLAG;
+  this->filters[filterBank].can_mask = (filterMaskId & CAN_EFF_MASK) | CAN_EFF_FLAG | CAN_RTR_FLAG;
+  if ((int)filterBank >= this->filterCount)
+    this->filterCount = filterBank + 1;
+  FilterApply();
+}
+
+/***
+ *  This Filter is a default filter, which allows to listen to all extended messages on the CAN bus
+ ***/
+void LoxCANDriver_SocketCAN::FilterAllowAll(uint32_t filterBank) {
+  FilterSetup(filterBank, 0x00000000, 0x00000000, 0);
+}
+
+/***
+ *  Setup all filters requested by the extensions, nothing has to be merged
+ ***/
+void LoxCANDriver_SocketCAN::FilterUpdate(void) {
+  this->filterCount = 0;
+  for (int r = 0; r < this->filterRequestCount; ++r) {
+    this->filters[r].can_id = (this->filterRequests[r].filterId & CAN_EFF_MASK) | CAN_EFF_FLAG;
+    this->filters[r].can_mask = (this->filterRequests[r].filterMaskId & CAN_EFF_MASK) | CAN_EFF_FLAG | CAN_RTR_FLAG;
+    ++this->filterCount;
+  }
+  // no requests at all: do not filter anything
+  if (this->filterCount == 0) {
+    this->filters[0].can_id = CAN_EFF_FLAG;
+    this->filters[0].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG;
+    this->filterCount = 1;
+  }
+  this->statistics.FBk = this->filterCount;
+  this->statistics.FMrg = 0;
+  FilterApply();
+}
+
+/***
+ *  CAN error reporting and statistics
+ ***/
+uint32_t LoxCANDriver_SocketCAN::GetErrorCounter() const {
+  return this->statistics.Err;
+}
+
+uint8_t LoxCANDriver_SocketCAN::GetTransmitErrorCounter() const {
+  return this->transmitErrorCounter;
+}
+
+uint8_t LoxCANDriver_SocketCAN::GetReceiveErrorCounter() const {
+  return this->receiveErrorCounter;
+}
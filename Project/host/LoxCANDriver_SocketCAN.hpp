@@ -0,0 +1,55 @@
+//
+//  LoxCANDriver_SocketCAN.hpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxCANDriver_SocketCAN_hpp
+#define LoxCANDriver_SocketCAN_hpp
+
+#include "LoxCANQueuedDriver.hpp"
+#include <linux/can.h>
+
+#define SOCKETCAN_BATCH 32 // frames per recvmmsg()/sendmmsg() call
+
+/***
+ *  Linux SocketCAN driver (e.g. for a vcan interface) to run the extensions on a host.
+ *  Each driver has its own raw socket, the filters requested by the extensions are
+ *  applied to it via CAN_RAW_FILTER. Several drivers can share the same interface.
+ ***/
+class LoxCANDriver_SocketCAN : public LoxCANQueuedDriver {
+  const char *interfaceName;
+  int canSocket;
+  tTransmitEntry transmitBufferControl[16];
+  tTransmitEntry transmitBufferValue[16];
+  tTransmitEntry transmitBufferBulk[64];
+  struct can_filter filters[MAX_FILTER_REQUESTS];
+  int filterCount;
+  uint32_t receiveDropped; // SO_RXQ_OVFL counter of the socket, already added to the statistics
+  uint8_t transmitErrorCounter;
+  uint8_t receiveErrorCounter;
+  CTL_TASK_t rxTask;
+  CTL_TASK_t txTask;
+
+  void FilterApply(void);
+  void FilterUpdate(void);
+  void ReceiveErrorFrame(const struct can_frame &frame);
+  static void vCANRXTask(void *pvParameters);
+  static void vCANTXTask(void *pvParameters);
+
+public:
+  LoxCANDriver_SocketCAN(tLoxCANDriverType type, const char *interfaceName);
+  void Startup(void);
+
+  // setup various CAN filters, the FIFO is ignored
+  void FilterAllowAll(uint32_t filterBank);
+  void FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment);
+
+  // CAN bus statistics and errors
+  uint32_t GetErrorCounter() const;
+  uint8_t GetTransmitErrorCounter() const;
+  uint8_t GetReceiveErrorCounter() const;
+};
+
+#endif /* LoxCANDriver_SocketCAN_hpp */
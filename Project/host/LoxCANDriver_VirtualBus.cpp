@@ -0,0 +1,169 @@
+//
+//  LoxCANDriver_VirtualBus.cpp
+//
+//  Created by Markus Fritze on 17.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "system.hpp"
+#include <string.h>
+
+LoxCANDriver_VirtualBus::LoxCANDriver_VirtualBus(tLoxCANDriverType type, LoxVirtualCANBus &bus)
+  : LoxCANQueuedDriver(type), bus(bus), mailboxCount(0), autoRetransmission(true), acceptAll(false) {
+  ctl_events_init(&this->receiveEvent, 0);
+  bus.Attach(this);
+}
+
+/***
+ *  CAN RX Task to forward messages and timers to all extensions
+ ***/
+void LoxCANDriver_VirtualBus::vCANRXTask(void *pvParameters) {
+  LoxCANDriver_VirtualBus *_this = (LoxCANDriver_VirtualBus *)pvParameters;
+  CTL_TIME_t nextTimer = ctl_get_current_time() + 10;
+  while (1) {
+    unsigned events = ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->receiveEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_ABSOLUTE, nextTimer);
+    if (events & eMainEvents_CanMessaged) {
+      unsigned rq = _this->receiveRing.Count();
+      _this->statistics.RQ = rq;
+      if (rq > _this->statistics.mRQ)
+        _this->statistics.mRQ = rq;
+      while ((rq = _this->receiveRing.Count()) > 0) {
+        for (unsigned i = 0; i < rq; ++i)
+          _this->ReceiveMessage(_this->receiveRing.Peek(i));
+        _this->receiveRing.Release(rq);
+      }
+    }
+    CTL_TIME_t now = ctl_get_current_time();
+    if ((int32_t)(now - nextTimer) >= 0) {
+      _this->Timer10ms();
+      nextTimer += 10;
+      if ((int32_t)(now - nextTimer) >= 0) // fell behind: skip the missed ticks, like the event on the STM32
+        nextTimer = now + 10;
+    }
+  }
+}
+
+/***
+ *  CAN TX Task: move queued messages into the transmit mailboxes,
+ *  afterwards the bus refills them, whenever a frame was sent. Unlike on the STM32
+ *  no transmit complete interrupt can get lost, so no timeout is needed, which also
+ *  keeps the virtual clock from stopping every 5ms.
+ ***/
+void LoxCANDriver_VirtualBus::vCANTXTask(void *pvParameters) {
+  LoxCANDriver_VirtualBus *_this = (LoxCANDriver_VirtualBus *)pvParameters;
+  while (1) {
+    CTL_TIME_t nextDeferred;
+    if (_this->TransmitDeferred(&nextDeferred)) // only a deferred message needs a timeout
+      ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->transmitEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_ABSOLUTE, nextDeferred);
+    else
+      ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->transmitEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_INFINITE, 0);
+    _this->TransmitFillMailboxes();
+  }
+}
+
+/***
+ *  Move pending messages from the transmit queues into the free transmit mailboxes
+ ***/
+void LoxCANDriver_VirtualBus::TransmitFillMailboxes(void) {
+  int c;
+  bool filled = false;
+  while (this->mailboxCount < VIRTUAL_BUS_MAILBOXES && (c = TransmitNextClass()) >= 0) {
+    this->mailbox[this->mailboxCount++] = *this->transmitQueue[c].Peek();
+    TransmitRemove(c);
+    filled = true;
+  }
+  if (filled)
+    this->bus.TransmitRequest();
+}
+
+/***
+ *  Oldest filled transmit mailbox or NULL
+ ***/
+const tTransmitEntry *LoxCANDriver_VirtualBus::TransmitMailbox(void) const {
+  return this->mailboxCount ? &this->mailbox[0] : NULL;
+}
+
+/***
+ *  The frame of the oldest mailbox was sent, refill the mailboxes
+ ***/
+void LoxCANDriver_VirtualBus::TransmitMailboxDone(void) {
+  --this->mailboxCount;
+  memmove(&this->mailbox[0], &this->mailbox[1], this->mailboxCount * sizeof(this->mailbox[0]));
+  TransmitFillMailboxes();
+}
+
+/***
+ *  The frame of the oldest mailbox lost the arbitration. Without automatic
+ *  retransmission it is dropped, like a failed transmission on the STM32.
+ ***/
+void LoxCANDriver_VirtualBus::TransmitArbitrationLost(void) {
+  if (this->autoRetransmission)
+    return;
+  ++this->statistics.Err;
+  TransmitMailboxDone();
+}
+
+void LoxCANDriver_VirtualBus::SetAutoRetransmission(bool enable) {
+  this->autoRetransmission = enable;
+}
+
+/***
+ *  A frame from another node, filtered like the hardware filters would
+ ***/
+void LoxCANDriver_VirtualBus::ReceiveFrame(const LoxCanMessage &message) {
+  if (!this->filterActive || !(this->acceptAll || FilterIsRequested(message.identifier)))
+    return;
+  LoxCanMessage *slot = this->receiveRing.ProducerSlot();
+  if (!slot) {
+    ++this->statistics.ROvf;
+    return;
+  }
+  *slot = message;
+  this->receiveRing.ProducerCommit();
+  ctl_events_set_clear(&this->receiveEvent, eMainEvents_CanMessaged, 0);
+}
+
+/***
+ *  Start the tasks, the bus has to be started already
+ ***/
+void LoxCANDriver_VirtualBus::Startup(void) {
+  TransmitInit(transmitBufferControl, sizeof(transmitBufferControl) / sizeof(transmitBufferControl[0]),
+      transmitBufferValue, sizeof(transmitBufferValue) / sizeof(transmitBufferValue[0]),
+      transmitBufferBulk, sizeof(transmitBufferBulk) / sizeof(transmitBufferBulk[0]));
+  ctl_task_run(&this->txTask, 0x20, LoxCANDriver_VirtualBus::vCANTXTask, this, "CAN_TX", 0, NULL, 0);
+  ctl_task_run(&this->rxTask, 0x10, LoxCANDriver_VirtualBus::vCANRXTask, this, "CAN_RX", 0, NULL, 0);
+  LoxCANBaseDriver::Startup();
+}
+
+/***
+ *  The bus accepts exactly the requested filters, nothing has to be merged
+ ***/
+void LoxCANDriver_VirtualBus::FilterUpdate(void) {
+  this->acceptAll = this->filterRequestCount == 0;
+  this->statistics.FBk = this->filterRequestCount;
+  this->statistics.FMrg = 0;
+}
+
+void LoxCANDriver_VirtualBus::FilterAllowAll(uint32_t filterBank) {
+  this->acceptAll = true;
+}
+
+void LoxCANDriver_VirtualBus::FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment) {
+  // the requests of the extensions are used directly
+}
+
+/***
+ *  CAN error reporting and statistics
+ ***/
+uint32_t LoxCANDriver_VirtualBus::GetErrorCounter() const {
+  return this->statistics.Err;
+}
+
+uint8_t LoxCANDriver_VirtualBus::GetTransmitErrorCounter() const {
+  return 0;
+}
+
+uint8_t LoxCANDriver_VirtualBus::GetReceiveErrorCounter() const {
+  return 0;
+}
@@ -0,0 +1,63 @@
+//
+//  LoxCANDriver_VirtualBus.hpp
+//
+//  Created by Markus Fritze on 17.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxCANDriver_VirtualBus_hpp
+#define LoxCANDriver_VirtualBus_hpp
+
+#include "LoxCANQueuedDriver.hpp"
+#include "LoxCanMessageRing.hpp"
+#include "LoxVirtualCANBus.hpp"
+
+#define VIRTUAL_BUS_MAILBOXES 3 // like the bxCAN, sent in the order they were filled
+
+/***
+ *  Driver for a node on a LoxVirtualCANBus. It behaves like LoxCANDriver_STM32: the
+ *  transmit queues feed three mailboxes, received frames go through a receive ring.
+ ***/
+class LoxCANDriver_VirtualBus : public LoxCANQueuedDriver {
+  LoxVirtualCANBus &bus;
+  tTransmitEntry transmitBufferControl[16];
+  tTransmitEntry transmitBufferValue[16];
+  tTransmitEntry transmitBufferBulk[64];
+  tTransmitEntry mailbox[VIRTUAL_BUS_MAILBOXES];
+  int mailboxCount;
+  bool autoRetransmission;
+  bool acceptAll;
+  CTL_EVENT_SET_t receiveEvent;
+  LoxCanMessageRing<64> receiveRing;
+  CTL_TASK_t rxTask;
+  CTL_TASK_t txTask;
+
+  void TransmitFillMailboxes(void);
+  void FilterUpdate(void);
+  static void vCANRXTask(void *pvParameters);
+  static void vCANTXTask(void *pvParameters);
+
+public: // used by LoxVirtualCANBus
+  const tTransmitEntry *TransmitMailbox(void) const;
+  void TransmitMailboxDone(void);
+  void TransmitArbitrationLost(void);
+  void ReceiveFrame(const LoxCanMessage &message);
+
+public:
+  LoxCANDriver_VirtualBus(tLoxCANDriverType type, LoxVirtualCANBus &bus);
+  void Startup(void);
+
+  // a frame, which lost the arbitration, is retried (default) or dropped (like the STM32, which disables it)
+  void SetAutoRetransmission(bool enable);
+
+  // the bus filters by the requests of the extensions, these are only for compatibility
+  void FilterAllowAll(uint32_t filterBank);
+  void FilterSetup(uint32_t filterBank, uint32_t filterId, uint32_t filterMaskId, uint32_t filterFIFOAssignment);
+
+  // CAN bus statistics and errors, the virtual bus has no bit errors
+  uint32_t GetErrorCounter() const;
+  uint8_t GetTransmitErrorCounter() const;
+  uint8_t GetReceiveErrorCounter() const;
+};
+
+#endif /* LoxCANDriver_VirtualBus_hpp */
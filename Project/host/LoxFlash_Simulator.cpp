@@ -0,0 +1,69 @@
+//
+//  LoxFlash_Simulator.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxFlash_Simulator.hpp"
+#include <string.h>
+
+LoxFlash_Simulator gFlashSimulator;
+LoxFlash &gFlash = gFlashSimulator;
+
+LoxFlash_Simulator::LoxFlash_Simulator() : eraseEnd(0), erasing(false), runningImage(LOXFLASH_SLOT_A) {
+  memset(this->memory, 0xFF, sizeof(this->memory));
+  memset(&this->statistics, 0, sizeof(this->statistics));
+}
+
+bool LoxFlash_Simulator::Busy(void) {
+  if (this->erasing && (int32_t)(ctl_get_current_time() - this->eraseEnd) >= 0)
+    this->erasing = false;
+  return this->erasing;
+}
+
+bool LoxFlash_Simulator::EraseStart(uint32_t address) {
+  if (Busy() || address < LOXFLASH_BASE || address >= LOXFLASH_BASE + LOXFLASH_SIZE)
+    return false;
+  address -= (address - LOXFLASH_BASE) % LOXFLASH_PAGE_SIZE;
+  memset(this->memory + address - LOXFLASH_BASE, 0xFF, LOXFLASH_PAGE_SIZE);
+  this->eraseEnd = ctl_get_current_time() + FLASH_SIMULATOR_ERASE_MS;
+  this->erasing = true;
+  ++this->statistics.Erase;
+  return true;
+}
+
+/***
+ *  The CPU stalls until the erase is done
+ ***/
+void LoxFlash_Simulator::Wait(void) {
+  if (!Busy())
+    return;
+  CTL_TIME_t start = ctl_get_current_time();
+  ctl_timeout_wait(this->eraseEnd);
+  this->statistics.WaitMs += ctl_get_current_time() - start;
+  this->erasing = false;
+}
+
+bool LoxFlash_Simulator::Program(uint32_t address, const void *data, size_t size) {
+  Wait();
+  if ((size & 1) || address < LOXFLASH_BASE || address + size > LOXFLASH_BASE + LOXFLASH_SIZE)
+    return false;
+  uint8_t *dest = this->memory + address - LOXFLASH_BASE;
+  for (size_t i = 0; i < size; i += 2) {
+    uint16_t value, old;
+    memcpy(&value, (const uint8_t *)data + i, sizeof(value));
+    memcpy(&old, dest + i, sizeof(old));
+    if (old != 0xFFFF && value != 0) { // the STM32 only programs erased halfwords (or writes 0)
+      ++this->statistics.PErr;
+      return false;
+    }
+    memcpy(dest + i, &value, sizeof(value));
+  }
+  this->statistics.Program += size;
+  return true;
+}
+
+const uint8_t *LoxFlash_Simulator::Read(uint32_t address) {
+  return this->memory + address - LOXFLASH_BASE;
+}
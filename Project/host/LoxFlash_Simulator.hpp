@@ -0,0 +1,46 @@
+//
+//  LoxFlash_Simulator.hpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxFlash_Simulator_hpp
+#define LoxFlash_Simulator_hpp
+
+#include "LoxFlash.hpp"
+#include <ctl_api.h>
+
+#define FLASH_SIMULATOR_ERASE_MS 20 // typical page erase time of the STM32F1
+
+/***
+ *  Flash of the STM32F103VE in RAM: erasing sets a page to 0xFF and takes FLASH_SIMULATOR_ERASE_MS,
+ *  programming can only clear bits of an erased halfword, like on the STM32.
+ ***/
+class LoxFlash_Simulator : public LoxFlash {
+  uint8_t memory[LOXFLASH_SIZE];
+  CTL_TIME_t eraseEnd; // end of the running erase
+  bool erasing;
+
+public:
+  struct {
+    uint32_t Erase;   // pages erased
+    uint32_t Program; // bytes programmed
+    uint32_t PErr;    // programming of not erased flash
+    uint32_t WaitMs;  // time Program() waited for an erase
+  } statistics;
+  uint32_t runningImage; // start of the simulated running firmware, LOXFLASH_SLOT_A by default
+
+  LoxFlash_Simulator();
+
+  virtual bool Busy(void);
+  virtual void Wait(void);
+  virtual bool EraseStart(uint32_t address);
+  virtual bool Program(uint32_t address, const void *data, size_t size);
+  virtual const uint8_t *Read(uint32_t address);
+  virtual uint32_t RunningImage(void) { return this->runningImage; };
+};
+
+extern LoxFlash_Simulator gFlashSimulator;
+
+#endif /* LoxFlash_Simulator_hpp */
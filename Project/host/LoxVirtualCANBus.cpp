@@ -0,0 +1,249 @@
+//
+//  LoxVirtualCANBus.cpp
+//
+//  Created by Markus Fritze on 17.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#include "LoxVirtualCANBus.hpp"
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "system.hpp"
+#include <__cross_studio_io.h>
+#include <string.h>
+
+LoxVirtualCANBus::LoxVirtualCANBus(tLoxCANDriverType type) : bitrate(Bitrate(type)), nodeCount(0), busTimeUs(0) {
+  this->bitTimeNs = 1000000000 / this->bitrate;
+  ctl_events_init(&this->busEvent, 0);
+  StatisticsReset();
+}
+
+/***
+ *  Bitrate of the bus: Loxone Link runs at 125kbit/s, the Tree bus at 50kbit/s
+ ***/
+uint32_t LoxVirtualCANBus::Bitrate(tLoxCANDriverType type) {
+  return type == tLoxCANDriverType_LoxoneLink ? 125000 : 50000;
+}
+
+/***
+ *  Length of an extended data frame with 8 data bytes in bits. Stuff bits are inserted after
+ *  5 identical bits from the SOF till the end of the CRC, the stuff bit itself counts for the
+ *  next sequence.
+ ***/
+uint32_t LoxVirtualCANBus::FrameBits(const LoxCanMessage &message, uint32_t *stuffBits) {
+  uint8_t bits[128];
+  int count = 0;
+  uint32_t identifier = message.identifier;
+  bits[count++] = 0; // SOF
+  for (int i = 28; i >= 18; --i) // base identifier
+    bits[count++] = (identifier >> i) & 1;
+  bits[count++] = 1; // SRR
+  bits[count++] = 1; // IDE
+  for (int i = 17; i >= 0; --i) // identifier extension
+    bits[count++] = (identifier >> i) & 1;
+  bits[count++] = 0; // RTR
+  bits[count++] = 0; // r1
+  bits[count++] = 0; // r0
+  for (int i = 3; i >= 0; --i) // DLC = 8
+    bits[count++] = (8 >> i) & 1;
+  for (int b = 0; b < 8; ++b)
+    for (int i = 7; i >= 0; --i)
+      bits[count++] = (message.can_data[b] >> i) & 1;
+
+  // CRC15 over all bits so far
+  uint16_t crc = 0;
+  for (int i = 0; i < count; ++i) {
+    bool crcNext = bits[i] ^ ((crc >> 14) & 1);
+    crc = (crc << 1) & 0x7FFF;
+    if (crcNext)
+      crc ^= 0x4599;
+  }
+  for (int i = 14; i >= 0; --i)
+    bits[count++] = (crc >> i) & 1;
+
+  uint32_t stuff = 0;
+  int run = 0;
+  uint8_t last = 2;
+  for (int i = 0; i < count; ++i) {
+    if (bits[i] == last) {
+      ++run;
+    } else {
+      last = bits[i];
+      run = 1;
+    }
+    if (run == 5) { // insert the complement
+      ++stuff;
+      last = !last;
+      run = 1;
+    }
+  }
+  if (stuffBits)
+    *stuffBits = stuff;
+  return count + stuff + 1 + 2 + 7 + 3; // CRC delimiter, ACK slot+delimiter, EOF, interframe space
+}
+
+/***
+ *  A driver is attached to the bus, before it is started
+ ***/
+void LoxVirtualCANBus::Attach(LoxCANDriver_VirtualBus *driver) {
+  if (this->nodeCount == VIRTUAL_BUS_MAX_NODES)
+    return;
+  this->nodes[this->nodeCount++] = driver;
+}
+
+/***
+ *  A node filled a transmit mailbox
+ ***/
+void LoxVirtualCANBus::TransmitRequest(void) {
+  ctl_events_set_clear(&this->busEvent, eMainEvents_CanMessaged, 0);
+}
+
+/***
+ *  Bus task: arbitration, frame timing and delivery
+ ***/
+void LoxVirtualCANBus::vBusTask(void *pvParameters) {
+  LoxVirtualCANBus *_this = (LoxVirtualCANBus *)pvParameters;
+  while (1) {
+    // the oldest pending frame of every node takes part, the lowest identifier wins
+    LoxCANDriver_VirtualBus *winner = NULL;
+    const tTransmitEntry *winnerEntry = NULL;
+    for (int n = 0; n < _this->nodeCount; ++n) {
+      const tTransmitEntry *entry = _this->nodes[n]->TransmitMailbox();
+      if (entry && (!winner || entry->message.identifier < winnerEntry->message.identifier)) {
+        winner = _this->nodes[n];
+        winnerEntry = entry;
+      }
+    }
+    if (!winner) {
+      ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &_this->busEvent, eMainEvents_CanMessaged, CTL_TIMEOUT_INFINITE, 0);
+      continue;
+    }
+    LoxCanMessage message = winnerEntry->message;
+    CTL_TIME_t queueTime = winnerEntry->time;
+    for (int n = 0; n < _this->nodeCount; ++n) {
+      if (_this->nodes[n] != winner && _this->nodes[n]->TransmitMailbox()) {
+        ++_this->statistics.lostArbitrations;
+        _this->nodes[n]->TransmitArbitrationLost();
+      }
+    }
+
+    // an idle bus starts right away, otherwise the frame follows the previous one
+    uint64_t nowUs = (uint64_t)ctl_get_current_time() * 1000;
+    uint64_t startUs = _this->busTimeUs > nowUs ? _this->busTimeUs : nowUs;
+    uint32_t stuffBits;
+    uint32_t bits = FrameBits(message, &stuffBits);
+    uint64_t endUs = startUs + (uint64_t)bits * _this->bitTimeNs / 1000;
+    ctl_timeout_wait((CTL_TIME_t)((endUs + 999) / 1000));
+
+    _this->busTimeUs = endUs;
+    _this->statistics.busyUs += endUs - startUs;
+    ++_this->statistics.frames;
+    _this->statistics.bits += bits;
+    _this->statistics.stuffBits += stuffBits;
+    uint64_t queueUs = (uint64_t)queueTime * 1000;
+    _this->LatencyAdd(message.identifier, endUs > queueUs ? endUs - queueUs : 0);
+    winner->TransmitMailboxDone();
+    for (int n = 0; n < _this->nodeCount; ++n) {
+      if (_this->nodes[n] != winner)
+        _this->nodes[n]->ReceiveFrame(message);
+    }
+  }
+}
+
+/***
+ *  Start the bus task, called before the drivers are started
+ ***/
+void LoxVirtualCANBus::Startup(void) {
+  StatisticsReset();
+  ctl_task_run(&this->busTask, 0x30, LoxVirtualCANBus::vBusTask, this, "CAN_BUS", 0, NULL, 0);
+}
+
+/***
+ *  Latency histogram: 8 linear buckets per power of 2, which is a resolution of 12.5%
+ ***/
+static int LatencyBucket(uint32_t latencyUs) {
+  if (latencyUs < 8)
+    return latencyUs;
+  int exponent = 31 - __builtin_clz(latencyUs);
+  return (exponent - 2) * 8 + ((latencyUs >> (exponent - 3)) & 7);
+}
+
+static uint32_t LatencyBucketValue(int bucket) {
+  if (bucket < 8)
+    return bucket;
+  int exponent = bucket / 8 + 2;
+  return (uint32_t)(8 + bucket % 8) << (exponent - 3);
+}
+
+void LoxVirtualCANBus::LatencyAdd(uint32_t identifier, uint32_t latencyUs) {
+  uint32_t index = (identifier * 2654435761u) >> 24;
+  for (int i = 0; i < VIRTUAL_BUS_LATENCY_IDS; ++i, ++index) {
+    index &= VIRTUAL_BUS_LATENCY_IDS - 1;
+    if (this->latency[index].identifier == 0xFFFFFFFF)
+      this->latency[index].identifier = identifier;
+    if (this->latency[index].identifier == identifier) {
+      ++this->latency[index].count;
+      if (latencyUs > this->latency[index].maxUs)
+        this->latency[index].maxUs = latencyUs;
+      ++this->latency[index].histogram[LatencyBucket(latencyUs)];
+      return;
+    }
+  }
+  // table is full: this identifier is not tracked
+}
+
+uint32_t LoxVirtualCANBus::LatencyPercentile(const uint32_t *histogram, uint32_t count, uint32_t percent) {
+  uint32_t needed = ((uint64_t)count * percent + 99) / 100;
+  uint32_t sum = 0;
+  for (int b = 0; b < VIRTUAL_BUS_LATENCY_BUCKETS; ++b) {
+    sum += histogram[b];
+    if (sum >= needed) // upper end of the bucket
+      return b + 1 < VIRTUAL_BUS_LATENCY_BUCKETS ? LatencyBucketValue(b + 1) - 1 : 0xFFFFFFFF;
+  }
+  return 0;
+}
+
+/***
+ *  Bus statistics
+ ***/
+uint32_t LoxVirtualCANBus::UtilisationPermille(void) const {
+  uint64_t nowUs = (uint64_t)ctl_get_current_time() * 1000;
+  if (nowUs < this->busTimeUs)
+    nowUs = this->busTimeUs;
+  if (nowUs <= this->statistics.startUs)
+    return 0;
+  return this->statistics.busyUs * 1000 / (nowUs - this->statistics.startUs);
+}
+
+void LoxVirtualCANBus::StatisticsPrint(void) const {
+  uint32_t utilisation = UtilisationPermille();
+  debug_printf("Bus %ukbit/s: %u.%u%% busy, %u frames, %u bits, %u stuff bits, %u lost arbitrations\n", this->bitrate / 1000, utilisation / 10, utilisation % 10,
+      this->statistics.frames, this->statistics.bits, this->statistics.stuffBits, this->statistics.lostArbitrations);
+  // latencies sorted by identifier
+  uint8_t order[VIRTUAL_BUS_LATENCY_IDS];
+  int count = 0;
+  for (int i = 0; i < VIRTUAL_BUS_LATENCY_IDS; ++i) {
+    if (this->latency[i].identifier == 0xFFFFFFFF)
+      continue;
+    int j = count++;
+    for (; j > 0 && this->latency[order[j - 1]].identifier > this->latency[i].identifier; --j)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+  for (int i = 0; i < count; ++i) {
+    const uint32_t *histogram = this->latency[order[i]].histogram;
+    uint32_t n = this->latency[order[i]].count;
+    uint32_t maxUs = this->latency[order[i]].maxUs;
+    uint32_t p50 = LatencyPercentile(histogram, n, 50), p90 = LatencyPercentile(histogram, n, 90), p99 = LatencyPercentile(histogram, n, 99);
+    debug_printf("  %08x: %6u frames, latency p50:%uus p90:%uus p99:%uus max:%uus\n", this->latency[order[i]].identifier, n,
+        p50 < maxUs ? p50 : maxUs, p90 < maxUs ? p90 : maxUs, p99 < maxUs ? p99 : maxUs, maxUs);
+  }
+}
+
+void LoxVirtualCANBus::StatisticsReset(void) {
+  memset(&this->statistics, 0, sizeof(this->statistics));
+  memset(this->latency, 0, sizeof(this->latency));
+  for (int i = 0; i < VIRTUAL_BUS_LATENCY_IDS; ++i)
+    this->latency[i].identifier = 0xFFFFFFFF;
+  uint64_t nowUs = (uint64_t)ctl_get_current_time() * 1000;
+  this->statistics.startUs = this->busTimeUs > nowUs ? this->busTimeUs : nowUs;
+}
@@ -0,0 +1,76 @@
+//
+//  LoxVirtualCANBus.hpp
+//
+//  Created by Markus Fritze on 17.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+
+#ifndef LoxVirtualCANBus_hpp
+#define LoxVirtualCANBus_hpp
+
+#include "LoxCANBaseDriver.hpp"
+#include "LoxCanMessage.hpp"
+#include <ctl_api.h>
+
+class LoxCANDriver_VirtualBus;
+
+#define VIRTUAL_BUS_MAX_NODES 128     // drivers attached to one bus
+#define VIRTUAL_BUS_LATENCY_IDS 256   // identifiers with their own latency histogram, power of 2
+#define VIRTUAL_BUS_LATENCY_BUCKETS 240 // log-linear histogram: 8 buckets per power of 2, up to 2^32us
+
+/***
+ *  Simulated CAN bus for many LoxCANDriver_VirtualBus drivers in one process.
+ *  Whenever the bus is idle, the oldest pending frame of every node takes part in the
+ *  arbitration and the lowest 29-bit identifier wins. The frame then occupies the bus for
+ *  its exact length in bits (incl. stuff bits, CRC15, ACK, EOF and interframe space),
+ *  before it is delivered to all other nodes. Bus time is kept in us.
+ ***/
+class LoxVirtualCANBus {
+  uint32_t bitrate;
+  uint32_t bitTimeNs;
+  int nodeCount;
+  LoxCANDriver_VirtualBus *nodes[VIRTUAL_BUS_MAX_NODES];
+  CTL_EVENT_SET_t busEvent; // eMainEvents_CanMessaged is set, whenever a node has a new frame pending
+  CTL_TASK_t busTask;
+  uint64_t busTimeUs; // end of the last frame on the bus
+
+  // latency from queuing a message till the end of its frame on the bus, per identifier
+  struct {
+    uint32_t identifier; // 0xFFFFFFFF = unused
+    uint32_t count;
+    uint32_t maxUs;
+    uint32_t histogram[VIRTUAL_BUS_LATENCY_BUCKETS];
+  } latency[VIRTUAL_BUS_LATENCY_IDS];
+
+  void LatencyAdd(uint32_t identifier, uint32_t latencyUs);
+  static uint32_t LatencyPercentile(const uint32_t *histogram, uint32_t count, uint32_t percent);
+  static void vBusTask(void *pvParameters);
+
+public:
+  struct {
+    uint64_t startUs;          // start of the statistics
+    uint64_t busyUs;           // time the bus was busy with frames
+    uint32_t frames;           // frames transmitted
+    uint32_t bits;             // bits transmitted, incl. stuff bits
+    uint32_t stuffBits;        // stuff bits transmitted
+    uint32_t lostArbitrations; // frames, which lost the arbitration against a lower identifier
+  } statistics;
+
+  LoxVirtualCANBus(tLoxCANDriverType type);
+  void Startup(void);
+
+  // bitrate of the bus type, like the prescaler in LoxCANDriver_STM32::Startup()
+  static uint32_t Bitrate(tLoxCANDriverType type);
+  // length of an extended data frame with 8 bytes in bits, incl. stuff bits, ACK, EOF and interframe space
+  static uint32_t FrameBits(const LoxCanMessage &message, uint32_t *stuffBits = 0);
+
+  // called by the drivers
+  void Attach(LoxCANDriver_VirtualBus *driver);
+  void TransmitRequest(void);
+
+  uint32_t UtilisationPermille(void) const;
+  void StatisticsPrint(void) const;
+  void StatisticsReset(void);
+};
+
+#endif /* LoxVirtualCANBus_hpp */
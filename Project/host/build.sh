@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+#  build.sh
+#
+#  Created by Markus Fritze on 16.03.19.
+#  Copyright (c) 2019 Markus Fritze. All rights reserved.
+#
+#  Host build of the Loxone Link protocol code for Linux (SocketCAN).
+#  The AES keys in CryptoCanCode/secrets.c have to be generated first, like for the firmware.
+#
+#    sudo ip link add dev vcan0 type vcan && sudo ip link set up vcan0
+#    ./build.sh && ./loxlink_host -i vcan0 -n 200 -l 50
+#
+#  Without a CAN interface, the extensions can run on an in-process virtual bus:
+#
+#    ./loxlink_host -v -n 100 -t 60
+#
+#  or in virtual time, which runs a day of protocol in seconds and is reproducible for a given seed:
+#
+#    ./loxlink_host -v -x -n 100 -t 86400 -p 3600 -r 1
+#
+#  A Tree Base Extension with 10 Tree devices per branch, each branch on its own virtual Tree bus:
+#
+#    ./loxlink_host -v -x -n 10 -e 10 -t 3600 -p 600
+#
+#  The host tests in tests/ are programs of their own, linked with the same protocol code. They run in
+#  virtual time and fail with an exit code != 0:
+#
+#    ./build.sh test
+#
+#  Additional compiler flags can be passed via CXXFLAGS, e.g. CXXFLAGS="-DDEBUG=1 -g" ./build.sh
+#
+set -e
+cd "$(dirname "$0")"
+
+A=../application_code
+L=$A/Loxone
+INCLUDES=(-Iinclude -I. -I$A -I$L -I$L/Legacy -I$L/NAT -I$L/NAT/Tree -I$L/NAT/Tree/Devices "-I$L/CAN Driver" -I$L/Flash -I$L/CryptoCanCode)
+FLAGS=(-O2 -DMAX_EXTENSIONS=32 -DCRC_USE_HARDWARE=0 ${CXXFLAGS})
+
+SOURCES=(
+  host_ctl.cpp
+  host_system.cpp
+  LoxCANDriver_SocketCAN.cpp
+  LoxCANDriver_VirtualBus.cpp
+  LoxFlash_Simulator.cpp
+  LoxVirtualCANBus.cpp
+  "$L/CAN Driver/LoxCANBaseDriver.cpp"
+  "$L/CAN Driver/LoxTimerWheel.cpp"
+  "$L/CAN Driver/LoxCANQueuedDriver.cpp"
+  "$L/CAN Driver/LoxNATFragmentReassembly.cpp"
+  $L/Flash/LoxFirmwareUpdate.cpp
+  $L/LoxCanMessage.cpp
+  $L/LoxExtension.cpp
+  $L/crc.cpp
+  $L/global_functions.cpp
+  $L/Legacy/LoxLegacyExtension.cpp
+  $L/NAT/LoxNATExtension.cpp
+  $L/NAT/Tree/LoxBusTreeBridge.cpp
+  $L/NAT/Tree/LoxBusTreeExtension.cpp
+  $L/NAT/Tree/LoxBusTreeExtensionCANDriver.cpp
+  $L/NAT/Tree/Devices/LoxBusTreeDevice.cpp
+)
+C_SOURCES=(
+  $L/CryptoCanCode/CryptoCanAlgo.c
+  $L/CryptoCanCode/aes.c
+  $L/CryptoCanCode/hash.c
+  $L/CryptoCanCode/secrets.c
+)
+
+mkdir -p build
+OBJECTS=()
+for f in "${C_SOURCES[@]}"; do
+  o=build/$(basename "$f" .c).o
+  ${CC:-cc} -std=gnu11 "${FLAGS[@]}" "${INCLUDES[@]}" -c "$f" -o "$o"
+  OBJECTS+=("$o")
+done
+for f in "${SOURCES[@]}"; do
+  o=build/$(basename "$f" .cpp).o
+  ${CXX:-g++} -std=gnu++11 "${FLAGS[@]}" "${INCLUDES[@]}" -c "$f" -o "$o"
+  OBJECTS+=("$o")
+done
+${CXX:-g++} -std=gnu++11 "${FLAGS[@]}" "${INCLUDES[@]}" main.cpp "${OBJECTS[@]}" -lpthread -o loxlink_host
+
+if [ "$1" = "test" ]; then
+  # tests/include replaces hardware headers, e.g. the STM32 HAL for the tests of the STM32 driver
+  for t in tests/*.cpp; do
+    ${CXX:-g++} -std=gnu++11 "${FLAGS[@]}" -Itests/include "${INCLUDES[@]}" "$t" "${OBJECTS[@]}" -lpthread -o build/$(basename "$t" .cpp)
+  done
+  for t in tests/*.cpp; do
+    echo "== $(basename "$t" .cpp)"
+    build/$(basename "$t" .cpp)
+  done
+fi
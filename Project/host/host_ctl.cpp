@@ -0,0 +1,360 @@
+//
+//  host_ctl.cpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  CTL on top of POSIX threads, see ctl_api.h
+//
+//  The running task owns gCPU. Blocking passes the CPU to the head of the ready queue, every
+//  task waits on its own condition till it is dispatched. If no task is ready, the clock decides:
+//  the real time clock leaves it to the timed waits of the blocked tasks, the virtual clock jumps
+//  to the earliest timeout. With the virtual clock the tasks are coroutines on the main thread
+//  instead, a blocking task switches directly to the dispatched one.
+//
+
+#include <__cross_studio_io.h>
+#include <ctl_api.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ucontext.h>
+
+#define HOST_CTL_STACK_SIZE (256 * 1024) // per coroutine
+
+/***
+ *  Clocks
+ ***/
+typedef struct {
+  CTL_TIME_t (*now)(void);
+  // no task is ready till the deadline: true, if the clock advanced to it
+  bool (*idle)(bool timed, CTL_TIME_t deadline);
+} tHostClock;
+
+static struct timespec gStartTime;
+static CTL_TIME_t gVirtualTime;
+
+static CTL_TIME_t host_clock_realtime_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec - gStartTime.tv_sec) * 1000 + (ts.tv_nsec - gStartTime.tv_nsec) / 1000000L;
+}
+
+static bool host_clock_realtime_idle(bool timed, CTL_TIME_t deadline) {
+  return false; // the blocked tasks wake up on their own
+}
+
+static CTL_TIME_t host_clock_virtual_now(void) {
+  return gVirtualTime;
+}
+
+static bool host_clock_virtual_idle(bool timed, CTL_TIME_t deadline) {
+  if (!timed) {
+    fprintf(stderr, "ctl: all tasks wait forever at %ums\n", gVirtualTime);
+    exit(1);
+  }
+  if ((int32_t)(deadline - gVirtualTime) > 0)
+    gVirtualTime = deadline;
+  return true;
+}
+
+static const tHostClock gRealtimeClock = {host_clock_realtime_now, host_clock_realtime_idle};
+static const tHostClock gVirtualClock = {host_clock_virtual_now, host_clock_virtual_idle};
+static const tHostClock *gClock = &gRealtimeClock;
+
+/***
+ *  Scheduler state, only touched by the owner of gCPU
+ ***/
+static pthread_mutex_t gCPU = PTHREAD_MUTEX_INITIALIZER; // owned by the running task
+static pthread_once_t gInitOnce = PTHREAD_ONCE_INIT;
+static CTL_TASK_t *gTasks;
+static CTL_TASK_t **gTasksTail = &gTasks;
+static CTL_TASK_t *gReadyHead;
+static CTL_TASK_t **gReadyTail = &gReadyHead;
+static CTL_TASK_t *gRunning; // NULL = idle
+static __thread CTL_TASK_t *tTask;
+
+static bool host_ctl_coroutines(void) {
+  return gClock == &gVirtualClock;
+}
+
+static void host_ctl_init(void) {
+  clock_gettime(CLOCK_MONOTONIC, &gStartTime);
+}
+
+void ctl_host_set_clock(CTL_HOST_CLOCK_t clock) {
+  gClock = clock == CTL_HOST_CLOCK_VIRTUAL ? &gVirtualClock : &gRealtimeClock;
+}
+
+/***
+ *  Absolute time of a CTL time for pthread_cond_timedwait()
+ ***/
+static struct timespec host_ctl_timespec(CTL_TIME_t time) {
+  struct timespec ts = gStartTime;
+  ts.tv_sec += time / 1000;
+  ts.tv_nsec += (time % 1000) * 1000000L;
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_nsec -= 1000000000L;
+    ++ts.tv_sec;
+  }
+  return ts;
+}
+
+static void host_ctl_task_add(CTL_TASK_t *task, const char *name) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&task->wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+  task->name = name;
+  task->next = NULL;
+  task->readyNext = NULL;
+  task->waiting = false;
+  task->queued = false;
+  *gTasksTail = task;
+  gTasksTail = &task->next;
+}
+
+static void host_ctl_ready(CTL_TASK_t *task) {
+  if (task->queued)
+    return;
+  task->queued = true;
+  task->readyNext = NULL;
+  *gReadyTail = task;
+  gReadyTail = &task->readyNext;
+}
+
+static bool host_ctl_events_matched(const CTL_TASK_t *task) {
+  if (!task->eventSet)
+    return false;
+  CTL_EVENT_SET_t matched = *task->eventSet & task->events;
+  return task->allEvents ? matched == task->events : matched != 0;
+}
+
+static bool host_ctl_timed_out(const CTL_TASK_t *task) {
+  return task->timed && (int32_t)(gClock->now() - task->deadline) >= 0;
+}
+
+/***
+ *  Move all blocked tasks with an expired timeout into the ready queue, in the order they were created.
+ *  Returns the earliest pending timeout.
+ ***/
+static bool host_ctl_ready_timeouts(CTL_TIME_t *deadline) {
+  bool timed = false;
+  for (CTL_TASK_t *task = gTasks; task; task = task->next) {
+    if (!task->waiting || task->queued || !task->timed)
+      continue;
+    if (host_ctl_timed_out(task))
+      host_ctl_ready(task);
+    else if (!timed || (int32_t)(task->deadline - *deadline) < 0) {
+      *deadline = task->deadline;
+      timed = true;
+    }
+  }
+  return timed;
+}
+
+/***
+ *  The running task gave up the CPU: dispatch the next ready task
+ ***/
+static void host_ctl_dispatch(void) {
+  CTL_TIME_t deadline = 0;
+  gRunning = NULL;
+  bool timed = host_ctl_ready_timeouts(&deadline);
+  if (!gReadyHead && gClock->idle(timed, deadline))
+    host_ctl_ready_timeouts(&deadline);
+  CTL_TASK_t *task = gReadyHead;
+  if (!task)
+    return;
+  gReadyHead = task->readyNext;
+  if (!gReadyHead)
+    gReadyTail = &gReadyHead;
+  task->queued = false;
+  gRunning = task;
+  if (!task->context)
+    pthread_cond_signal(&task->wakeup);
+}
+
+/***
+ *  Wait till the task is dispatched again
+ ***/
+static void host_ctl_wait_for_cpu(CTL_TASK_t *task) {
+  while (gRunning != task) {
+    bool timedOut = task->waiting && !task->queued && host_ctl_timed_out(task);
+    if (gClock == &gRealtimeClock && task->waiting && task->timed && !task->queued && !timedOut) {
+      struct timespec ts = host_ctl_timespec(task->deadline);
+      pthread_cond_timedwait(&task->wakeup, &gCPU, &ts);
+    } else if (timedOut && !gRunning) {
+      host_ctl_dispatch(); // nobody runs, who would notice the timeout
+    } else {
+      pthread_cond_wait(&task->wakeup, &gCPU); // a running task dispatches us later
+    }
+  }
+}
+
+/***
+ *  Block the running task till its events are set or its timeout expired
+ ***/
+static void host_ctl_block(CTL_TASK_t *task) {
+  task->waiting = true;
+  while (!host_ctl_events_matched(task) && !host_ctl_timed_out(task)) {
+    host_ctl_dispatch();
+    if (!task->context)
+      host_ctl_wait_for_cpu(task);
+    else if (gRunning != task)
+      swapcontext((ucontext_t *)task->context, (ucontext_t *)gRunning->context);
+  }
+  task->waiting = false;
+}
+
+/***
+ *  Tasks
+ ***/
+void ctl_task_init(CTL_TASK_t *task, unsigned char priority, const char *name) {
+  pthread_once(&gInitOnce, host_ctl_init);
+  pthread_mutex_lock(&gCPU);
+  task->thread = pthread_self();
+  host_ctl_task_add(task, name);
+  task->context = host_ctl_coroutines() ? calloc(1, sizeof(ucontext_t)) : NULL;
+  tTask = task;
+  gRunning = task;
+}
+
+static void host_ctl_coroutine_entry(void) {
+  CTL_TASK_t *task = gRunning;
+  task->entrypoint(task->parameter);
+  host_ctl_dispatch(); // the stack of the ended task is not released
+  setcontext((ucontext_t *)gRunning->context);
+}
+
+static void *host_ctl_task_entry(void *parameter) {
+  CTL_TASK_t *task = (CTL_TASK_t *)parameter;
+  pthread_mutex_lock(&gCPU);
+  tTask = task;
+  host_ctl_wait_for_cpu(task);
+  task->entrypoint(task->parameter);
+  host_ctl_dispatch();
+  pthread_mutex_unlock(&gCPU);
+  return NULL;
+}
+
+void ctl_task_run(CTL_TASK_t *task, unsigned char priority, void (*entrypoint)(void *), void *parameter, const char *name, unsigned stack_size_in_words, unsigned *stack, unsigned call_size_in_words) {
+  pthread_once(&gInitOnce, host_ctl_init);
+  host_ctl_task_add(task, name);
+  task->entrypoint = entrypoint;
+  task->parameter = parameter;
+  host_ctl_ready(task); // runs, when the current task blocks
+  if (host_ctl_coroutines()) {
+    ucontext_t *context = (ucontext_t *)calloc(1, sizeof(ucontext_t));
+    getcontext(context);
+    context->uc_stack.ss_sp = malloc(HOST_CTL_STACK_SIZE);
+    context->uc_stack.ss_size = HOST_CTL_STACK_SIZE;
+    context->uc_link = NULL;
+    makecontext(context, host_ctl_coroutine_entry, 0);
+    task->context = context;
+    task->thread = pthread_self();
+    return;
+  }
+  task->context = NULL;
+  if (pthread_create(&task->thread, NULL, host_ctl_task_entry, task) != 0) {
+    fprintf(stderr, "ctl_task_run: can not start %s\n", name);
+    exit(1);
+  }
+  pthread_detach(task->thread);
+}
+
+unsigned char ctl_task_set_priority(CTL_TASK_t *task, unsigned char priority) {
+  return 0; // all tasks have the same priority on the host
+}
+
+/***
+ *  Events
+ ***/
+void ctl_events_init(CTL_EVENT_SET_t *eventSet, CTL_EVENT_SET_t set) {
+  *eventSet = set;
+}
+
+void ctl_events_set_clear(CTL_EVENT_SET_t *eventSet, CTL_EVENT_SET_t set, CTL_EVENT_SET_t clear) {
+  *eventSet = (*eventSet | set) & ~clear;
+  for (CTL_TASK_t *task = gTasks; task; task = task->next) {
+    if (task->waiting && task->eventSet == eventSet && host_ctl_events_matched(task))
+      host_ctl_ready(task);
+  }
+}
+
+unsigned ctl_events_wait(CTL_EVENT_WAIT_TYPE_t type, CTL_EVENT_SET_t *eventSet, CTL_EVENT_SET_t events, CTL_TIMEOUT_t timeoutType, CTL_TIME_t timeout) {
+  CTL_TASK_t *task = gRunning;
+  bool autoClear = type == CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR || type == CTL_EVENT_WAIT_ALL_EVENTS_WITH_AUTO_CLEAR;
+  task->eventSet = eventSet;
+  task->events = events;
+  task->allEvents = type == CTL_EVENT_WAIT_ALL_EVENTS || type == CTL_EVENT_WAIT_ALL_EVENTS_WITH_AUTO_CLEAR;
+  task->timed = timeoutType == CTL_TIMEOUT_ABSOLUTE || timeoutType == CTL_TIMEOUT_DELAY;
+  task->deadline = timeoutType == CTL_TIMEOUT_DELAY ? ctl_get_current_time() + timeout : timeout;
+  if (timeoutType != CTL_TIMEOUT_NOW)
+    host_ctl_block(task);
+  if (!host_ctl_events_matched(task))
+    return 0; // timeout
+  CTL_EVENT_SET_t matched = *eventSet & events;
+  if (autoClear)
+    *eventSet &= ~matched;
+  return matched;
+}
+
+/***
+ *  Time in ms since the start
+ ***/
+CTL_TIME_t ctl_get_current_time(void) {
+  pthread_once(&gInitOnce, host_ctl_init);
+  return gClock->now();
+}
+
+void ctl_timeout_wait(CTL_TIME_t timeout) {
+  CTL_TASK_t *task = gRunning;
+  task->eventSet = NULL;
+  task->timed = true;
+  task->deadline = timeout;
+  host_ctl_block(task); // gives the CPU to other tasks meanwhile
+}
+
+/***
+ *  Interrupts: only one task runs at a time and there are no interrupt handlers
+ ***/
+int ctl_global_interrupts_disable(void) {
+  return 1;
+}
+
+int ctl_global_interrupts_set(int enable) {
+  return 1;
+}
+
+void ctl_host_cpu_release(void) {
+  if (host_ctl_coroutines())
+    return; // the system call blocks all tasks
+  host_ctl_dispatch();
+  pthread_mutex_unlock(&gCPU);
+}
+
+void ctl_host_cpu_acquire(void) {
+  CTL_TASK_t *task = tTask;
+  if (host_ctl_coroutines())
+    return;
+  pthread_mutex_lock(&gCPU);
+  if (!gRunning) {
+    gRunning = task;
+    return;
+  }
+  host_ctl_ready(task);
+  host_ctl_wait_for_cpu(task);
+}
+
+/***
+ *  Debug output
+ ***/
+int debug_printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int result = vprintf(format, args);
+  va_end(args);
+  return result;
+}
@@ -0,0 +1,43 @@
+//
+//  host_system.cpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host replacements for the hardware used by the protocol code: the status LED,
+//  the unique device ID and the reset.
+//
+
+#include "LED.hpp"
+#include "system.hpp"
+#include "stm32f1xx_hal.h"
+#include <string.h>
+#include <unistd.h>
+
+CTL_EVENT_SET_t gMainEvent;
+eAliveReason_t gResetReason = eAliveReason_t_power_on_reset;
+
+/***
+ *  The status LED of all emulated extensions, the state is ignored
+ ***/
+LED gLED;
+
+void LED::Startup(void) {}
+void LED::off(void) {}
+void LED::blink_green(void) {}
+void LED::blink_orange(void) {}
+void LED::blink_red(void) {}
+void LED::identify_on(void) {}
+void LED::identify_off(void) {}
+void LED::sync(uint32_t timeInMs) {}
+void LED::set_sync_offset(uint8_t sync_offset) {}
+
+void HAL_GetUID(uint32_t *UID) {
+  UID[0] = 0x484F5354; // 'HOST'
+  UID[1] = gethostid();
+  UID[2] = getpid();
+}
+
+void NVIC_SystemReset(void) {
+  debug_printf("NVIC_SystemReset() ignored on the host\n");
+}
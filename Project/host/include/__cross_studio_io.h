@@ -0,0 +1,23 @@
+//
+//  __cross_studio_io.h
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host replacement for the CrossStudio debug I/O: debug_printf() prints to stdout.
+//
+
+#ifndef __cross_studio_io_h
+#define __cross_studio_io_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int debug_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __cross_studio_io_h */
@@ -0,0 +1,103 @@
+//
+//  ctl_api.h
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host replacement for the parts of the CrossWorks Tasking Library (CTL) used by the firmware.
+//  Every task is a thread, but only one task runs at a time: a task owns the CPU till it blocks
+//  in ctl_events_wait() or ctl_timeout_wait(). The firmware code therefore stays as single-threaded
+//  as on the STM32 and disabling the interrupts is not needed. Ready tasks get the CPU in the order
+//  they became ready.
+//
+//  The time either follows the real time or is virtual: with the virtual clock nothing ever sleeps,
+//  whenever all tasks are blocked, the time jumps straight to the next timeout. The tasks then are
+//  coroutines on the main thread, switching between them is much cheaper than between threads.
+//  Together with a fixed random_init() seed, a run is reproducible.
+//
+
+#ifndef ctl_api_h
+#define ctl_api_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef unsigned CTL_TIME_t;      // ms, wraps around like on the STM32
+typedef unsigned CTL_EVENT_SET_t; // 32 event bits
+
+typedef struct CTL_TASK_s {
+  pthread_t thread;
+  const char *name;
+  void (*entrypoint)(void *);
+  void *parameter;
+
+  // scheduler
+  struct CTL_TASK_s *next;      // all tasks, in the order they were created
+  struct CTL_TASK_s *readyNext; // ready queue
+  pthread_cond_t wakeup;        // signaled, when the task gets the CPU
+  void *context;                // virtual clock: the tasks are coroutines on a single thread
+  bool waiting;                 // blocked in ctl_events_wait() or ctl_timeout_wait()
+  bool queued;                  // in the ready queue
+  CTL_EVENT_SET_t *eventSet;    // waiting for these events, NULL = only for the timeout
+  CTL_EVENT_SET_t events;
+  bool allEvents;
+  bool timed;
+  CTL_TIME_t deadline;
+} CTL_TASK_t;
+
+typedef enum {
+  CTL_TIMEOUT_NONE,
+  CTL_TIMEOUT_INFINITE,
+  CTL_TIMEOUT_ABSOLUTE,
+  CTL_TIMEOUT_DELAY,
+  CTL_TIMEOUT_NOW,
+} CTL_TIMEOUT_t;
+
+typedef enum {
+  CTL_EVENT_WAIT_ANY_EVENTS,
+  CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR,
+  CTL_EVENT_WAIT_ALL_EVENTS,
+  CTL_EVENT_WAIT_ALL_EVENTS_WITH_AUTO_CLEAR,
+} CTL_EVENT_WAIT_TYPE_t;
+
+// tasks
+void ctl_task_init(CTL_TASK_t *task, unsigned char priority, const char *name);
+void ctl_task_run(CTL_TASK_t *task, unsigned char priority, void (*entrypoint)(void *), void *parameter, const char *name, unsigned stack_size_in_words, unsigned *stack, unsigned call_size_in_words);
+unsigned char ctl_task_set_priority(CTL_TASK_t *task, unsigned char priority);
+
+// events
+void ctl_events_init(CTL_EVENT_SET_t *eventSet, CTL_EVENT_SET_t set);
+void ctl_events_set_clear(CTL_EVENT_SET_t *eventSet, CTL_EVENT_SET_t set, CTL_EVENT_SET_t clear);
+unsigned ctl_events_wait(CTL_EVENT_WAIT_TYPE_t type, CTL_EVENT_SET_t *eventSet, CTL_EVENT_SET_t events, CTL_TIMEOUT_t timeoutType, CTL_TIME_t timeout);
+
+// time
+CTL_TIME_t ctl_get_current_time(void);
+void ctl_timeout_wait(CTL_TIME_t timeout);
+
+// interrupts, only one task runs at a time: nothing to do
+int ctl_global_interrupts_disable(void);
+int ctl_global_interrupts_set(int enable);
+
+// host only: give up the CPU around a blocking system call (poll(), sendmmsg(), ...)
+void ctl_host_cpu_release(void);
+void ctl_host_cpu_acquire(void);
+
+// host only: the clock behind ctl_get_current_time(), has to be selected before ctl_task_init().
+// The virtual clock only advances, when all tasks are blocked, a system call blocks all tasks.
+typedef enum {
+  CTL_HOST_CLOCK_REALTIME,
+  CTL_HOST_CLOCK_VIRTUAL,
+} CTL_HOST_CLOCK_t;
+
+void ctl_host_set_clock(CTL_HOST_CLOCK_t clock);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ctl_api_h */
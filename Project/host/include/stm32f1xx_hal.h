@@ -0,0 +1,29 @@
+//
+//  stm32f1xx_hal.h
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host replacement for the few STM32 HAL functions used by the protocol code.
+//
+
+#ifndef stm32f1xx_hal_h
+#define stm32f1xx_hal_h
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 96-bit unique device ID, derived from the process on the host
+void HAL_GetUID(uint32_t *UID);
+
+// the host can not reboot a single emulated extension, the request is only logged
+void NVIC_SystemReset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* stm32f1xx_hal_h */
@@ -0,0 +1,15 @@
+//
+//  stm32f1xx_ll_cortex.h
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host replacement, see stm32f1xx_hal.h
+//
+
+#ifndef stm32f1xx_ll_cortex_h
+#define stm32f1xx_ll_cortex_h
+
+#include "stm32f1xx_hal.h"
+
+#endif /* stm32f1xx_ll_cortex_h */
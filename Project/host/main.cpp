@@ -0,0 +1,224 @@
+//
+//  main.cpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host soak/load test: runs emulated NAT and legacy extensions on a SocketCAN interface,
+//  e.g. against a Miniserver emulator on a vcan interface, or on an in-process virtual bus
+//  with bus timing and latency statistics (-v). On the virtual bus the time can be virtual as
+//  well (-x): it jumps from timeout to timeout, so a day of protocol runs in seconds. With the
+//  same seed (-r), such a run is reproducible. See build.sh.
+//  With -e, a Tree Base Extension bridges the Loxone Link to two virtual Tree buses (50kbit/s),
+//  one per branch, with emulated Tree devices on them.
+//
+
+#include "LoxCANDriver_SocketCAN.hpp"
+#include "LoxBusTreeBridge.hpp"
+#include "LoxBusTreeExtension.hpp"
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "LoxLegacyExtension.hpp"
+#include "LoxNATExtension.hpp"
+#include "global_functions.hpp"
+#include "system.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+/***
+ *  NAT extension without any hardware, it only reports a digital value of 0
+ ***/
+class tEmulatedConfig : public tConfigHeader {
+  tConfigHeaderFiller filler;
+};
+
+class LoxEmulatedNATExtension : public LoxNATExtension {
+  tEmulatedConfig config;
+
+  virtual void SendValues(void) {
+    send_digital_value(0, 0);
+  }
+
+public:
+  LoxEmulatedNATExtension(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, gResetReason) {
+  }
+};
+
+/***
+ *  Legacy extension without any hardware
+ ***/
+class LoxEmulatedLegacyExtension : public LoxLegacyExtension {
+public:
+  LoxEmulatedLegacyExtension(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxLegacyExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_Extension << 24), eDeviceType_t_Extension, 0, 10031108) {
+  }
+};
+
+/***
+ *  Tree device without any hardware on a physical Tree bus
+ ***/
+class LoxEmulatedTreeDevice : public LoxBusTreeDevice {
+  tEmulatedConfig config;
+
+  virtual void SendValues(void) {
+    send_digital_value(0, 0);
+  }
+
+public:
+  LoxEmulatedTreeDevice(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxBusTreeDevice(driver, serial, eDeviceType_t_TouchTree, 0, 10031114, 1, sizeof(config), &config, gResetReason) {
+  }
+};
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [-i interface] [-n NAT extensions] [-l legacy extensions] [-e Tree devices per branch] [-s serial] [-t seconds] [-p seconds] [-r seed] [-v [-x]]\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  const char *interfaceName = "vcan0";
+  int natCount = 1;
+  int legacyCount = 0;
+  int treeCount = 0; // devices per branch on the virtual Tree buses
+  uint32_t serialBase = 0x100000;
+  int runSeconds = 0; // 0 = forever
+  int printSeconds = 10;
+  uint32_t seed = 0; // 0 = serial
+  bool virtualBus = false;
+  bool virtualTime = false;
+  int ch;
+  while ((ch = getopt(argc, argv, "i:n:l:e:s:t:p:r:vx")) != -1) {
+    switch (ch) {
+    case 'i':
+      interfaceName = optarg;
+      break;
+    case 'n':
+      natCount = atoi(optarg);
+      break;
+    case 'l':
+      legacyCount = atoi(optarg);
+      break;
+    case 'e':
+      treeCount = atoi(optarg);
+      break;
+    case 's':
+      serialBase = strtoul(optarg, NULL, 16);
+      break;
+    case 't':
+      runSeconds = atoi(optarg);
+      break;
+    case 'p':
+      printSeconds = atoi(optarg);
+      break;
+    case 'r':
+      seed = strtoul(optarg, NULL, 0);
+      break;
+    case 'v':
+      virtualBus = true;
+      break;
+    case 'x':
+      virtualTime = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if ((virtualTime && !virtualBus) || printSeconds <= 0) // SocketCAN needs the real time
+    usage(argv[0]);
+  if ((treeCount && !virtualBus) || treeCount < 0 || treeCount > MAX_TREE_DEVICECOUNT)
+    usage(argv[0]);
+
+  static CTL_TASK_t main_task;
+  if (virtualTime)
+    ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&main_task, 255, "main");
+  random_init(seed ? seed : serialBase);
+
+  // every driver has its own socket (or bus node) and up to MAX_EXTENSIONS extensions
+  int extensionCount = natCount + legacyCount + (treeCount ? 1 : 0);
+  int driverCount = (extensionCount + MAX_EXTENSIONS - 1) / MAX_EXTENSIONS;
+  LoxVirtualCANBus *bus = virtualBus ? new LoxVirtualCANBus(tLoxCANDriverType_LoxoneLink) : NULL;
+  LoxCANBaseDriver **drivers = new LoxCANBaseDriver *[driverCount];
+  for (int d = 0; d < driverCount; ++d) {
+    if (bus)
+      drivers[d] = new LoxCANDriver_VirtualBus(tLoxCANDriverType_LoxoneLink, *bus);
+    else
+      drivers[d] = new LoxCANDriver_SocketCAN(tLoxCANDriverType_LoxoneLink, interfaceName);
+  }
+  LoxBusTreeExtension *treeExtension = NULL;
+  for (int i = 0; i < extensionCount; ++i) {
+    LoxCANBaseDriver &driver = *drivers[i / MAX_EXTENSIONS];
+    if (i < natCount)
+      new LoxEmulatedNATExtension(driver, serialBase + i);
+    else if (i < natCount + legacyCount)
+      new LoxEmulatedLegacyExtension(driver, serialBase + i);
+    else
+      treeExtension = new LoxBusTreeExtension(driver, serialBase + i, gResetReason);
+  }
+
+  // every branch has its own Tree bus: a node for the bridge and the nodes of the devices
+  LoxVirtualCANBus *treeBus[2] = {NULL, NULL};
+  LoxBusTreeBridge *bridges[2] = {NULL, NULL};
+  int treeDriverCount = treeCount ? 2 * (1 + (treeCount + MAX_EXTENSIONS - 1) / MAX_EXTENSIONS) : 0;
+  LoxCANBaseDriver **treeDrivers = new LoxCANBaseDriver *[treeDriverCount];
+  int treeDriverIndex = 0;
+  for (int b = 0; b < 2 && treeCount; ++b) {
+    eTreeBranch branch = b ? eTreeBranch_rightBranch : eTreeBranch_leftBranch;
+    treeBus[b] = new LoxVirtualCANBus(tLoxCANDriverType_TreeBus);
+    treeDrivers[treeDriverIndex] = new LoxCANDriver_VirtualBus(tLoxCANDriverType_TreeBus, *treeBus[b]);
+    bridges[b] = new LoxBusTreeBridge(*treeDrivers[treeDriverIndex++], *treeExtension, branch);
+    for (int i = 0; i < treeCount; ++i) {
+      if (i % MAX_EXTENSIONS == 0)
+        treeDrivers[treeDriverIndex++] = new LoxCANDriver_VirtualBus(tLoxCANDriverType_TreeBus, *treeBus[b]);
+      new LoxEmulatedTreeDevice(*treeDrivers[treeDriverIndex - 1], serialBase + (b + 1) * 0x1000 + i);
+    }
+  }
+
+  if (bus)
+    bus->Startup();
+  for (int b = 0; b < 2 && treeCount; ++b)
+    treeBus[b]->Startup();
+  for (int d = 0; d < driverCount; ++d)
+    drivers[d]->Startup();
+  for (int d = 0; d < treeDriverCount; ++d)
+    treeDrivers[d]->Startup();
+  debug_printf("%d extensions on %d drivers at %s%s\n", extensionCount, driverCount, bus ? "virtual bus" : interfaceName, virtualTime ? " in virtual time" : "");
+
+  // print the summed up statistics every few seconds
+  struct timespec realStart, realEnd;
+  clock_gettime(CLOCK_MONOTONIC, &realStart);
+  CTL_TIME_t startTime = ctl_get_current_time();
+  CTL_TIME_t endTime = startTime + runSeconds * 1000;
+  while (runSeconds == 0 || (int32_t)(endTime - ctl_get_current_time()) > 0) {
+    CTL_TIME_t nextTime = ctl_get_current_time() + printSeconds * 1000;
+    if (runSeconds && (int32_t)(endTime - nextTime) < 0)
+      nextTime = endTime;
+    ctl_timeout_wait(nextTime);
+    uint32_t rcv = 0, sent = 0, qovf = 0, rovf = 0, err = 0, mtq = 0, stall = 0;
+    for (int d = 0; d < driverCount; ++d) {
+      rcv += drivers[d]->statistics.Rcv;
+      sent += drivers[d]->statistics.Sent;
+      qovf += drivers[d]->statistics.QOvf;
+      rovf += drivers[d]->statistics.ROvf;
+      err += drivers[d]->statistics.Err;
+      if (drivers[d]->statistics.mTQ > mtq)
+        mtq = drivers[d]->statistics.mTQ;
+      if (drivers[d]->statistics.mRxStall > stall)
+        stall = drivers[d]->statistics.mRxStall;
+    }
+    debug_printf("%5us Rcv:%u Sent:%u QOvf:%u ROvf:%u Err:%u mTQ:%u mRxStall:%ums\n", (ctl_get_current_time() - startTime) / 1000, rcv, sent, qovf, rovf, err, mtq, stall);
+    if (bus)
+      bus->StatisticsPrint();
+    for (int b = 0; b < 2 && treeCount; ++b) {
+      debug_printf("Tree%d Up:%u Down:%u Coal:%u Drop:%u Err:%u Fwd:%u QDrop:%u mQ:%u\n", b + 1, bridges[b]->statistics.Up, bridges[b]->statistics.Down, bridges[b]->statistics.Coal, bridges[b]->statistics.Drop, bridges[b]->Bus().GetErrorCounter(),
+                   treeExtension->upstreamStatistics[b].Up, treeExtension->upstreamStatistics[b].Drop, treeExtension->upstreamStatistics[b].mQ);
+      treeBus[b]->StatisticsPrint();
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &realEnd);
+  uint32_t realMs = (realEnd.tv_sec - realStart.tv_sec) * 1000 + (realEnd.tv_nsec - realStart.tv_nsec) / 1000000L;
+  debug_printf("%us simulated in %u.%03us\n", (ctl_get_current_time() - startTime) / 1000, realMs / 1000, realMs % 1000);
+  return 0;
+}
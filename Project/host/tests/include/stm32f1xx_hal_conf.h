@@ -0,0 +1,206 @@
+//
+//  stm32f1xx_hal_conf.h
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host tests only: the parts of the STM32 HAL and the bxCAN registers used by LoxCANDriver_STM32.cpp.
+//  The CAN functions are implemented by the test, which emulates the transmit mailboxes and the bus.
+//
+
+#ifndef stm32f1xx_hal_conf_h
+#define stm32f1xx_hal_conf_h
+
+#include "stm32f1xx_hal.h"
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __IO volatile
+
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+typedef enum { HAL_OK = 0x00, HAL_ERROR = 0x01, HAL_BUSY = 0x02, HAL_TIMEOUT = 0x03 } HAL_StatusTypeDef;
+typedef enum { CAN1_TX_IRQn = 19, CAN1_RX0_IRQn = 20, CAN1_RX1_IRQn = 21, CAN1_SCE_IRQn = 22 } IRQn_Type;
+
+// bxCAN registers
+typedef struct {
+  __IO uint32_t TIR;
+  __IO uint32_t TDTR;
+  __IO uint32_t TDLR;
+  __IO uint32_t TDHR;
+} CAN_TxMailBox_TypeDef;
+
+typedef struct {
+  __IO uint32_t RIR;
+  __IO uint32_t RDTR;
+  __IO uint32_t RDLR;
+  __IO uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+typedef struct {
+  __IO uint32_t MCR;
+  __IO uint32_t MSR;
+  __IO uint32_t TSR;
+  __IO uint32_t RF0R;
+  __IO uint32_t RF1R;
+  __IO uint32_t IER;
+  __IO uint32_t ESR;
+  __IO uint32_t BTR;
+  CAN_TxMailBox_TypeDef sTxMailBox[3];
+  CAN_FIFOMailBox_TypeDef sFIFOMailBox[2];
+} CAN_TypeDef;
+
+extern CAN_TypeDef gHostCAN1;
+#define CAN1 (&gHostCAN1)
+
+#define CAN_RF0R_FMP0 0x00000003U
+#define CAN_RF0R_FOVR0 0x00000010U
+#define CAN_RF0R_RFOM0 0x00000020U
+#define CAN_RI0R_RTR 0x00000002U
+#define CAN_RI0R_IDE 0x00000004U
+#define CAN_RI0R_EXID_Pos 3U
+#define CAN_RDT0R_DLC 0x0000000FU
+
+// HAL CAN driver
+typedef struct {
+  uint32_t Prescaler;
+  uint32_t Mode;
+  uint32_t SyncJumpWidth;
+  uint32_t TimeSeg1;
+  uint32_t TimeSeg2;
+  FunctionalState TimeTriggeredMode;
+  FunctionalState AutoBusOff;
+  FunctionalState AutoWakeUp;
+  FunctionalState AutoRetransmission;
+  FunctionalState ReceiveFifoLocked;
+  FunctionalState TransmitFifoPriority;
+} CAN_InitTypeDef;
+
+typedef struct {
+  uint32_t FilterIdHigh;
+  uint32_t FilterIdLow;
+  uint32_t FilterMaskIdHigh;
+  uint32_t FilterMaskIdLow;
+  uint32_t FilterFIFOAssignment;
+  uint32_t FilterBank;
+  uint32_t FilterMode;
+  uint32_t FilterScale;
+  uint32_t FilterActivation;
+  uint32_t SlaveStartFilterBank;
+} CAN_FilterTypeDef;
+
+typedef struct {
+  uint32_t StdId;
+  uint32_t ExtId;
+  uint32_t IDE;
+  uint32_t RTR;
+  uint32_t DLC;
+  FunctionalState TransmitGlobalTime;
+} CAN_TxHeaderTypeDef;
+
+typedef struct {
+  uint32_t StdId;
+  uint32_t ExtId;
+  uint32_t IDE;
+  uint32_t RTR;
+  uint32_t DLC;
+  uint32_t Timestamp;
+  uint32_t FilterMatchIndex;
+} CAN_RxHeaderTypeDef;
+
+typedef struct {
+  CAN_TypeDef *Instance;
+  CAN_InitTypeDef Init;
+  __IO uint32_t ErrorCode;
+} CAN_HandleTypeDef;
+
+#define CAN_MODE_NORMAL 0x00000000U
+#define CAN_SJW_1TQ 0x00000000U
+#define CAN_BS1_10TQ 0x00090000U
+#define CAN_BS2_5TQ 0x00400000U
+#define CAN_ID_EXT 0x00000004U
+#define CAN_RTR_DATA 0x00000000U
+#define CAN_RX_FIFO0 0x00000000U
+#define CAN_RX_FIFO1 0x00000001U
+#define CAN_FILTER_FIFO0 0x00000000U
+#define CAN_FILTER_FIFO1 0x00000001U
+#define CAN_FILTERMODE_IDMASK 0x00000000U
+#define CAN_FILTERMODE_IDLIST 0x00000001U
+#define CAN_FILTERSCALE_32BIT 0x00000001U
+#define CAN_FILTER_DISABLE 0x00000000U
+#define CAN_FILTER_ENABLE 0x00000001U
+#define CAN_IT_TX_MAILBOX_EMPTY 0x00000001U
+#define CAN_IT_RX_FIFO0_MSG_PENDING 0x00000002U
+#define CAN_IT_RX_FIFO1_MSG_PENDING 0x00000010U
+#define CAN_IT_ERROR_PASSIVE 0x00000200U
+#define CAN_IT_LAST_ERROR_CODE 0x00000800U
+#define CAN_IT_ERROR 0x00008000U
+#define HAL_CAN_ERROR_NONE 0x00000000U
+#define HAL_CAN_ERROR_TX_ALST0 0x00000800U
+#define HAL_CAN_ERROR_TX_TERR0 0x00001000U
+#define HAL_CAN_ERROR_TX_ALST1 0x00002000U
+#define HAL_CAN_ERROR_TX_TERR1 0x00004000U
+#define HAL_CAN_ERROR_TX_ALST2 0x00008000U
+#define HAL_CAN_ERROR_TX_TERR2 0x00010000U
+
+HAL_StatusTypeDef HAL_CAN_Init(CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_Start(CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_ActivateNotification(CAN_HandleTypeDef *hcan, uint32_t ActiveITs);
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef *hcan, CAN_FilterTypeDef *sFilterConfig);
+HAL_StatusTypeDef HAL_CAN_ResetError(CAN_HandleTypeDef *hcan);
+uint32_t HAL_CAN_GetTxMailboxesFreeLevel(CAN_HandleTypeDef *hcan);
+HAL_StatusTypeDef HAL_CAN_AddTxMessage(CAN_HandleTypeDef *hcan, const CAN_TxHeaderTypeDef *pHeader, uint8_t aData[], uint32_t *pTxMailbox);
+HAL_StatusTypeDef HAL_CAN_GetRxMessage(CAN_HandleTypeDef *hcan, uint32_t RxFifo, CAN_RxHeaderTypeDef *pHeader, uint8_t aData[]);
+void HAL_CAN_IRQHandler(CAN_HandleTypeDef *hcan);
+
+// RCC, GPIO and NVIC, without any function on the host
+#define GPIOB ((void *)0)
+#define GPIO_PIN_8 0x0100U
+#define GPIO_PIN_9 0x0200U
+#define GPIO_MODE_INPUT 0x00000000U
+#define GPIO_MODE_AF_PP 0x00000002U
+#define GPIO_NOPULL 0x00000000U
+#define GPIO_SPEED_FREQ_HIGH 0x00000003U
+
+typedef struct {
+  uint32_t Pin;
+  uint32_t Mode;
+  uint32_t Pull;
+  uint32_t Speed;
+} GPIO_InitTypeDef;
+
+static inline void HAL_GPIO_Init(void *GPIOx, GPIO_InitTypeDef *GPIO_Init) {}
+static inline void HAL_GPIO_DeInit(void *GPIOx, uint32_t GPIO_Pin) {}
+static inline uint32_t HAL_RCC_GetPCLK1Freq(void) { return 36000000U; }
+static inline void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority) {}
+static inline void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) {}
+static inline void HAL_NVIC_DisableIRQ(IRQn_Type IRQn) {}
+#define __HAL_RCC_CAN1_CLK_ENABLE()
+#define __HAL_RCC_CAN1_CLK_DISABLE()
+#define __HAL_RCC_GPIOB_CLK_ENABLE()
+#define __HAL_AFIO_REMAP_CAN1_2()
+
+// cycle counter for the DEBUG statistics
+typedef struct {
+  __IO uint32_t CTRL;
+  __IO uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+  __IO uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern DWT_Type gHostDWT;
+extern CoreDebug_Type gHostCoreDebug;
+#define DWT (&gHostDWT)
+#define CoreDebug (&gHostCoreDebug)
+#define DWT_CTRL_CYCCNTENA_Msk 0x00000001U
+#define CoreDebug_DEMCR_TRCENA_Msk 0x01000000U
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* stm32f1xx_hal_conf_h */
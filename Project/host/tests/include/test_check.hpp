@@ -0,0 +1,23 @@
+//
+//  test_check.hpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Host tests only: every test prints its checks and counts the failed ones for its exit code.
+//
+
+#ifndef test_check_hpp
+#define test_check_hpp
+
+#include <stdio.h>
+
+static int failed;
+
+static void check(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok  " : "FAIL", what);
+  if (!ok)
+    ++failed;
+}
+
+#endif /* test_check_hpp */
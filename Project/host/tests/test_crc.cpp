@@ -0,0 +1,148 @@
+//
+//  test_crc.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  The table driven CRCs of crc.cpp against bitwise reference versions over random data of random
+//  length, the streaming CRC32 with random piece sizes against the CRC32 over the whole buffer.
+//  Afterwards the throughput of both versions is printed, it is not checked.
+//
+
+#include "crc.hpp"
+#include "test_check.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define TEST_ROUNDS 10000
+#define TEST_MAX_SIZE 1100 // larger than a 1024 byte flash page
+#define BENCH_SIZE 4096
+#define BENCH_ROUNDS 2000
+
+// simple CRC8, polynome 0x85, MSB first
+static uint8_t ref_crc8_default(const void *data, size_t size) {
+  const uint8_t *dp = (const uint8_t *)data;
+  uint8_t crc = 0x00;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= dp[i];
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x85 : crc << 1;
+  }
+  return crc;
+}
+
+// Maxim 1-Wire CRC8, polynome 0x31, LSB first
+static uint8_t ref_crc8_OneWire(const void *data, size_t size) {
+  const uint8_t *dp = (const uint8_t *)data;
+  uint8_t crc = 0x00;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= dp[i];
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x8C : crc >> 1;
+  }
+  return crc;
+}
+
+// Modbus CRC16, polynome 0x8005, LSB first
+static uint16_t ref_crc16_Modus(const void *data, size_t size) {
+  const uint8_t *dp = (const uint8_t *)data;
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= dp[i];
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
+
+// CRC unit of the STM32: polynome 0x04C11DB7, MSB first over little endian 32-bit words
+static uint32_t ref_crc32_stm32(const void *data, size_t size) {
+  const uint8_t *dp = (const uint8_t *)data;
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i += 4) {
+    uint32_t word = 0;
+    for (size_t b = 0; b < 4 && i + b < size; ++b) // the remainder is filled with zero bytes
+      word |= uint32_t(dp[i + b]) << (b * 8);
+    crc ^= word;
+    for (int bit = 0; bit < 32; ++bit)
+      crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+  }
+  return crc;
+}
+
+static uint32_t stream_crc32(const uint8_t *data, size_t size) {
+  tCRC32Stream stream;
+  crc32_stm32_stream_init(&stream);
+  size_t offset = 0;
+  while (offset < size) {
+    size_t count = rand() % 16; // pieces of 0..15 bytes, like fragments of 7 bytes
+    if (count > size - offset)
+      count = size - offset;
+    crc32_stm32_stream_add(&stream, data + offset, count);
+    offset += count;
+  }
+  return crc32_stm32_stream_result(&stream);
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// the first word changes every round, so the compiler can not move the CRC out of the loop
+#define BENCH(name, function)                                                            \
+  do {                                                                                   \
+    uint32_t sum = 0;                                                                    \
+    double start = now_ns();                                                             \
+    for (int round = 0; round < BENCH_ROUNDS; ++round) {                                 \
+      buffer[0] = round;                                                                 \
+      sum += function(buffer, BENCH_SIZE);                                               \
+    }                                                                                    \
+    double ns = now_ns() - start;                                                        \
+    sink += sum;                                                                         \
+    printf("%-22s %8.3f bytes/ns\n", name, BENCH_SIZE * double(BENCH_ROUNDS) / ns);     \
+  } while (0)
+
+int main(int argc, char *argv[]) {
+  static uint32_t buffer[BENCH_SIZE / 4];
+  uint8_t *data = (uint8_t *)buffer;
+  srand(argc > 1 ? atoi(argv[1]) : 1);
+
+  int errors[5] = {0};
+  for (int round = 0; round < TEST_ROUNDS; ++round) {
+    size_t size = rand() % TEST_MAX_SIZE;
+    for (size_t i = 0; i < size; ++i)
+      data[i] = rand();
+    errors[0] += crc8_default(data, size) != ref_crc8_default(data, size);
+    errors[1] += crc8_OneWire(data, size) != ref_crc8_OneWire(data, size);
+    errors[2] += crc16_Modus(data, size) != ref_crc16_Modus(data, size);
+    errors[3] += crc32_stm32_aligned(data, size) != ref_crc32_stm32(data, size);
+    errors[4] += stream_crc32(data, size) != ref_crc32_stm32(data, size);
+  }
+  check(errors[0] == 0, "crc8_default matches the bitwise CRC8");
+  check(errors[1] == 0, "crc8_OneWire matches the bitwise 1-Wire CRC8");
+  check(errors[2] == 0, "crc16_Modus matches the bitwise Modbus CRC16");
+  check(errors[3] == 0, "crc32_stm32_aligned matches the bitwise STM32 CRC32");
+  check(errors[4] == 0, "the streaming CRC32 in random pieces matches the bitwise STM32 CRC32");
+  // known values: "123456789" of the 1-Wire and Modbus CRC, 0xDF8A8A2B is the STM32 CRC of 0x12345678
+  static const uint32_t word = 0x12345678;
+  check(crc8_OneWire("123456789", 9) == 0xA1 && crc16_Modus("123456789", 9) == 0x4B37 && crc32_stm32_aligned(&word, 4) == 0xDF8A8A2B, "known check values");
+
+  for (size_t i = 0; i < BENCH_SIZE; ++i)
+    data[i] = rand();
+  volatile uint32_t sink = 0;
+  BENCH("crc8_default", crc8_default);
+  BENCH("crc8_default bitwise", ref_crc8_default);
+  BENCH("crc8_OneWire", crc8_OneWire);
+  BENCH("crc8_OneWire bitwise", ref_crc8_OneWire);
+  BENCH("crc16_Modus", crc16_Modus);
+  BENCH("crc16_Modus bitwise", ref_crc16_Modus);
+  BENCH("crc32_stm32", crc32_stm32_aligned);
+  BENCH("crc32_stm32 bitwise", ref_crc32_stm32);
+
+  printf("test_crc: %s\n", failed ? "FAILED" : "OK");
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,97 @@
+//
+//  test_firmware_update.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  The firmware update never writes into the slot of the running firmware: it is taken from the
+//  running image, not from the boot record, and a firmware linked to the start of the flash (without
+//  a bootloader) can not be updated at all.
+//
+
+#include "LoxFirmwareUpdate.hpp"
+#include "LoxFlash_Simulator.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_PAGE_SIZE 512
+#define TEST_PAGES 16
+
+// flash of a slot still contains the given byte everywhere
+static bool untouched(uint32_t slot, uint8_t value) {
+  const uint8_t *flash = gFlashSimulator.Read(slot);
+  for (uint32_t i = 0; i < LOXFLASH_SLOT_SIZE; ++i)
+    if (flash[i] != value)
+      return false;
+  return true;
+}
+
+// fill the flash with a "running firmware" and write a boot record, which names the given slot
+static void prepare(uint32_t runningImage, uint32_t bootSlot) {
+  static uint8_t image[LOXFLASH_PAGE_SIZE];
+  memset(image, 0x5A, sizeof(image));
+  for (uint32_t address = LOXFLASH_BASE; address < LOXFLASH_BASE + LOXFLASH_SIZE; address += LOXFLASH_PAGE_SIZE) {
+    gFlashSimulator.Wait();
+    gFlashSimulator.EraseStart(address);
+    if (address != LOXFLASH_BOOT_RECORD)
+      gFlashSimulator.Program(address, image, sizeof(image));
+  }
+  tFirmwareBootRecord record;
+  record.magic = FIRMWARE_UPDATE_BOOT_MAGIC;
+  record.slot = bootSlot;
+  record.version = 1;
+  record.size = 0;
+  record.crc = crc32_stm32_aligned(&record, offsetof(tFirmwareBootRecord, crc));
+  gFlashSimulator.Program(LOXFLASH_BOOT_RECORD, &record, sizeof(record));
+  gFlashSimulator.Wait();
+  gFlashSimulator.runningImage = runningImage;
+}
+
+// send a firmware of TEST_PAGES pages, with the timer running in between
+static bool update(LoxFirmwareUpdate &updater) {
+  static uint8_t data[TEST_PAGE_SIZE * TEST_PAGES];
+  for (size_t i = 0; i < sizeof(data); ++i)
+    data[i] = i * 7;
+  updater.Start(2, TEST_PAGE_SIZE);
+  bool ok = true;
+  for (uint32_t offset = 0; offset < sizeof(data); offset += 16) {
+    ok = updater.Write(offset, data + offset, 16) && ok;
+    if ((offset & 0xFF) == 0) {
+      ctl_timeout_wait(ctl_get_current_time() + 10);
+      updater.Timer10ms();
+    }
+  }
+  for (uint32_t page = 0; page < TEST_PAGES; ++page)
+    updater.SetPageCRC(page, crc32_stm32_aligned(data + page * TEST_PAGE_SIZE, TEST_PAGE_SIZE));
+  uint32_t badPage, badCRC;
+  return updater.Verify(TEST_PAGES, &badPage, &badCRC) && ok;
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxFirmwareUpdate updater(gFlashSimulator);
+
+  prepare(LOXFLASH_SLOT_A, LOXFLASH_SLOT_B); // the last update into B did not start
+  check(updater.RunningSlot() == LOXFLASH_SLOT_A, "the running slot is taken from the running image, not from the boot record");
+  check(update(updater) && untouched(LOXFLASH_SLOT_A, 0x5A), "running from slot A, the update goes into slot B");
+
+  prepare(LOXFLASH_SLOT_B + 0x200, LOXFLASH_SLOT_A);
+  check(updater.RunningSlot() == LOXFLASH_SLOT_B, "a vector table inside slot B runs from slot B");
+  check(update(updater) && untouched(LOXFLASH_SLOT_B, 0x5A), "running from slot B, the update goes into slot A");
+
+  prepare(LOXFLASH_BASE, LOXFLASH_SLOT_A);
+  uint32_t erased = gFlashSimulator.statistics.Erase;
+  check(updater.RunningSlot() == 0, "a firmware at the start of the flash is not in a slot");
+  check(!update(updater) && untouched(LOXFLASH_SLOT_A, 0x5A) && untouched(LOXFLASH_SLOT_B, 0x5A) && gFlashSimulator.statistics.Erase == erased, "without a bootloader the update is rejected, nothing is erased");
+
+  printf("test_firmware_update: %s\n", failed ? "FAILED" : "OK");
+  exit(failed ? 1 : 0);
+}
@@ -0,0 +1,145 @@
+//
+//  test_legacy_update.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Replay of a legacy firmware update, in which data frames get lost and one page arrives with wrong
+//  data: the verify fails, the extension requests only the missing pages and the pages of the flash
+//  page with the wrong data with software_update_retry_page, one after the other. A page, which is
+//  lost again, is requested again after LEGACY_UPDATE_RETRY_TIMEOUT. Once all pages arrived, the
+//  final verify succeeds and the boot record names the new slot.
+//  The commands of the Miniserver are passed to PacketMulticastExtension(), the data frames to
+//  ReceiveMessage(), the retry requests of the extension are received on the virtual bus.
+//
+
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "LoxFirmwareUpdate.hpp"
+#include "LoxFlash_Simulator.hpp"
+#include "LoxLegacyExtension.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_VERSION 10031109
+#define TEST_PAGES 8
+#define TEST_MAX_RETRIES 32
+
+static uint8_t gImage[TEST_PAGES * LEGACY_UPDATE_PAGE_SIZE];
+
+/***
+ *  Legacy extension, which receives the update commands of the Miniserver directly
+ ***/
+class LoxTestLegacyExtension : public LoxLegacyExtension {
+public:
+  LoxTestLegacyExtension(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxLegacyExtension(driver, serial | (eDeviceType_t_Extension << 24), eDeviceType_t_Extension, 0, 10031108) {
+  }
+  void Command(LoxMsgLegacyCommand_t command, uint8_t val8, uint16_t val16, uint32_t val32) {
+    LoxCanMessage message;
+    message.identifier = this->device_type << 24;
+    message.commandLegacy = command;
+    message.commandDirection = LoxMsgLegacyCommandDirection_t_fromServer;
+    message.value8 = val8;
+    message.value16 = val16;
+    message.value32 = val32;
+    PacketMulticastExtension(message);
+  }
+};
+
+/***
+ *  The Miniserver side of the bus, it records the requested pages
+ ***/
+class LoxTestMiniserver : public LoxExtension {
+public:
+  int retryCount;
+  uint16_t retryPages[TEST_MAX_RETRIES];
+
+  LoxTestMiniserver(LoxCANBaseDriver &driver)
+    : LoxExtension(driver, 0x0FFFFFF, eDeviceType_t_Miniserver, 0, 0), retryCount(0) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    if (message.commandLegacy == software_update_retry_page && message.commandDirection == LoxMsgLegacyCommandDirection_t_fromDevice && this->retryCount < TEST_MAX_RETRIES)
+      this->retryPages[this->retryCount++] = message.value16;
+  }
+};
+
+// send the data frames of a page, except the dropped block (-1 = none), optionally with a wrong byte
+static void sendPage(LoxTestLegacyExtension &extension, int page, int droppedBlock, bool corrupt = false) {
+  for (int block = 0; block < LEGACY_UPDATE_BLOCKS; ++block) {
+    if (block == droppedBlock)
+      continue;
+    LoxCanMessage message;
+    message.identifier = 0x1F000000 | (eDeviceType_t_Extension << 16) | (page * LEGACY_UPDATE_BLOCKS + block);
+    memcpy(message.can_data, gImage + page * LEGACY_UPDATE_PAGE_SIZE + block * LEGACY_UPDATE_BLOCK_SIZE, LEGACY_UPDATE_BLOCK_SIZE);
+    if (corrupt && block == 0)
+      message.can_data[0] ^= 0xFF;
+    extension.ReceiveMessage(message);
+  }
+}
+
+static void sleep(CTL_TIME_t ms) {
+  ctl_timeout_wait(ctl_get_current_time() + ms);
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxVirtualCANBus bus(tLoxCANDriverType_LoxoneLink);
+  static LoxCANDriver_VirtualBus serverDriver(tLoxCANDriverType_LoxoneLink, bus);
+  static LoxCANDriver_VirtualBus extensionDriver(tLoxCANDriverType_LoxoneLink, bus);
+  static LoxTestMiniserver server(serverDriver);
+  static LoxTestLegacyExtension extension(extensionDriver, 0x123456);
+  bus.Startup();
+  serverDriver.Startup();
+  extensionDriver.Startup();
+  sleep(100);
+
+  srand(1);
+  for (size_t i = 0; i < sizeof(gImage); ++i)
+    gImage[i] = rand();
+
+  // the first transfer loses a data frame in page 2 and in page 5, page 6 arrives with a wrong byte
+  extension.Command(software_update_init, 0, 0xDEAD, TEST_VERSION);
+  for (int page = 0; page < TEST_PAGES; ++page) {
+    extension.Command(software_update_page_crc, 0, page, crc32_stm32_aligned(gImage + page * LEGACY_UPDATE_PAGE_SIZE, LEGACY_UPDATE_PAGE_SIZE));
+    sendPage(extension, page, page == 2 ? 17 : page == 5 ? LEGACY_UPDATE_BLOCKS - 1 : -1, page == 6);
+    sleep(10);
+  }
+  uint32_t verifyErrors = gFirmwareUpdate.statistics.VErr;
+  extension.Command(software_update_verify, 1, 0, TEST_VERSION);
+  sleep(100);
+  check(gFirmwareUpdate.statistics.VErr == verifyErrors + 1, "the verify fails");
+  check(server.retryCount == 1 && server.retryPages[0] == 2, "the first page with a lost data frame is requested");
+
+  // answer the requests, the first repetition of page 2 loses a data frame again
+  bool lostAgain = false;
+  for (int handled = 0; handled < server.retryCount && handled < TEST_MAX_RETRIES; ++handled) {
+    int page = server.retryPages[handled];
+    bool drop = page == 2 && !lostAgain;
+    sendPage(extension, page, drop ? 100 : -1);
+    lostAgain = lostAgain || drop;
+    sleep(drop ? LEGACY_UPDATE_RETRY_TIMEOUT + 100 : 50);
+  }
+  // page 6 and 7 share a flash page, which is erased again
+  static const uint16_t expected[] = {2, 2, 5, 6, 7};
+  bool ordered = server.retryCount == (int)(sizeof(expected) / sizeof(expected[0]));
+  for (int i = 0; ordered && i < server.retryCount; ++i)
+    ordered = server.retryPages[i] == expected[i];
+  check(ordered, "only the missing pages and the flash page with the wrong data are requested, page 2 twice after it was lost again");
+  check(gFirmwareUpdate.statistics.Verify == 1, "the final verify succeeds");
+
+  tFirmwareBootRecord record;
+  memcpy(&record, gFlashSimulator.Read(LOXFLASH_BOOT_RECORD), sizeof(record));
+  check(record.magic == FIRMWARE_UPDATE_BOOT_MAGIC && record.slot == LOXFLASH_SLOT_B && record.version == TEST_VERSION && record.size == sizeof(gImage), "the boot record names the new firmware in slot B");
+  check(memcmp(gFlashSimulator.Read(LOXFLASH_SLOT_B), gImage, sizeof(gImage)) == 0, "slot B contains the firmware");
+
+  printf("test_legacy_update: %s\n", failed ? "FAILED" : "OK");
+  exit(failed ? 1 : 0);
+}
@@ -0,0 +1,172 @@
+//
+//  test_offline_timer.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  The offline timer of the NAT extensions calculates its deadlines from the time of the last
+//  message of the Miniserver. It has to behave like the former countdown, which was restarted by
+//  every message: the Alive package T/10 before the end of the timeout T, offline in the last second
+//  of it and no Alive package for T < 10. The countdown is modelled below, the extension runs in
+//  virtual time and its Alive packages are received on the virtual bus.
+//
+
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "LoxNATExtension.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define TEST_MAX_EVENTS 8
+#define TEST_TOLERANCE (TIMER_WHEEL_TICK + 10) // timer resolution and the frame on the bus
+
+class tTestConfig : public tConfigHeader {
+  tConfigHeaderFiller filler;
+};
+
+/***
+ *  NAT extension, which records the time it went offline
+ ***/
+class LoxTestNATExtension : public LoxNATExtension {
+  tTestConfig config;
+
+  virtual void SetState(eDeviceState state) {
+    if (state == eDeviceState_offline && this->state == eDeviceState_online)
+      this->offlineTime = ctl_get_current_time();
+    LoxNATExtension::SetState(state);
+  }
+
+public:
+  CTL_TIME_t offlineTime; // 0 = still online
+
+  LoxTestNATExtension(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxNATExtension(driver, serial | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, eAliveReason_t_pairing), offlineTime(0) {
+  }
+  // online with a new offline timeout in seconds, like after a NAT_Offer and the configuration
+  void Online(int32_t timeout) {
+    SetNAT(0x05);
+    SetState(eDeviceState_online);
+    this->offlineTimeout = timeout;
+    this->offlineTime = 0;
+    this->lastServerMessageTime = ctl_get_current_time();
+    offline_timer_update();
+  }
+  // any message of the Miniserver, here a Sync_Packet for another extension
+  void ServerMessage(void) {
+    LoxCanMessage message;
+    message.busType = LoxCmdNATBus_t_LoxoneLink;
+    message.directionNat = LoxCmdNATDirection_t_fromServer;
+    message.extensionNat = 0x7E;
+    message.commandNat = Sync_Packet;
+    ReceiveMessage(message);
+  }
+};
+
+/***
+ *  The Miniserver side of the bus, it records the Alive packages
+ ***/
+class LoxTestMiniserver : public LoxExtension {
+public:
+  int aliveCount;
+  CTL_TIME_t aliveTimes[TEST_MAX_EVENTS];
+
+  LoxTestMiniserver(LoxCANBaseDriver &driver)
+    : LoxExtension(driver, 0x0FFFFFF, eDeviceType_t_Miniserver, 0, 0), aliveCount(0) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    if (message.isNATmessage(this->driver) && message.directionNat == LoxCmdNATDirection_t_fromDevice && message.commandNat == Alive_Packet && this->aliveCount < TEST_MAX_EVENTS)
+      this->aliveTimes[this->aliveCount++] = ctl_get_current_time();
+  }
+};
+
+/***
+ *  The former countdown: every message restarted a timer for T - T/10 seconds (T - 1 for T < 10),
+ *  which sent the Alive package and restarted itself for the rest up to T - 1 seconds.
+ *  Returns the number of Alive packages, offline is 0, if the extension stays online till the end.
+ ***/
+static int oldCountdown(int32_t timeout, const CTL_TIME_t *messages, int messageCount, CTL_TIME_t end, CTL_TIME_t *alives, CTL_TIME_t *offline) {
+  int32_t aliveSeconds = timeout / 10;
+  int aliveCount = 0;
+  *offline = 0;
+  for (int i = 0; i < messageCount; ++i) {
+    CTL_TIME_t next = i + 1 < messageCount ? messages[i + 1] : end;
+    CTL_TIME_t aliveTime = messages[i] + (timeout - (aliveSeconds ? aliveSeconds : 1)) * 1000;
+    if (aliveSeconds && aliveTime < next && aliveCount < TEST_MAX_EVENTS)
+      alives[aliveCount++] = aliveTime;
+    CTL_TIME_t offlineTime = messages[i] + (timeout - 1) * 1000;
+    if (offlineTime < next) {
+      *offline = offlineTime;
+      break;
+    }
+  }
+  return aliveCount;
+}
+
+static bool near(CTL_TIME_t measured, CTL_TIME_t expected) {
+  return measured >= expected && measured - expected <= TEST_TOLERANCE;
+}
+
+/***
+ *  Run a timeout with messages of the Miniserver at the given offsets in ms and compare the Alive
+ *  packages and the offline time with the countdown
+ ***/
+static void scenario(LoxTestNATExtension &extension, LoxTestMiniserver &server, const char *name, int32_t timeout, const CTL_TIME_t *offsets, int offsetCount) {
+  CTL_TIME_t start = ctl_get_current_time();
+  CTL_TIME_t end = start + offsets[offsetCount - 1] + timeout * 1000 + 2000;
+  CTL_TIME_t messages[TEST_MAX_EVENTS];
+  server.aliveCount = 0;
+  extension.Online(timeout);
+  for (int i = 0; i < offsetCount; ++i) {
+    messages[i] = start + offsets[i];
+    ctl_timeout_wait(messages[i]);
+    if (i > 0)
+      extension.ServerMessage();
+  }
+  ctl_timeout_wait(end);
+
+  CTL_TIME_t alives[TEST_MAX_EVENTS], offline;
+  int aliveCount = oldCountdown(timeout, messages, offsetCount, end, alives, &offline);
+  bool ok = server.aliveCount == aliveCount && (offline ? near(extension.offlineTime, offline) : extension.offlineTime == 0);
+  for (int i = 0; ok && i < aliveCount; ++i)
+    ok = near(server.aliveTimes[i], alives[i]);
+  check(ok, name);
+  if (!ok) {
+    printf("      alive %d (expected %d), offline after %dms (expected %dms)\n", server.aliveCount, aliveCount, extension.offlineTime ? int(extension.offlineTime - start) : -1, offline ? int(offline - start) : -1);
+    for (int i = 0; i < server.aliveCount; ++i)
+      printf("      alive after %dms (expected %dms)\n", int(server.aliveTimes[i] - start), i < aliveCount ? int(alives[i] - start) : -1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxVirtualCANBus bus(tLoxCANDriverType_LoxoneLink);
+  static LoxCANDriver_VirtualBus serverDriver(tLoxCANDriverType_LoxoneLink, bus);
+  static LoxCANDriver_VirtualBus extensionDriver(tLoxCANDriverType_LoxoneLink, bus);
+  static LoxTestMiniserver server(serverDriver);
+  static LoxTestNATExtension extension(extensionDriver, 0x123456);
+  bus.Startup();
+  serverDriver.Startup();
+  extensionDriver.Startup();
+  ctl_timeout_wait(ctl_get_current_time() + 100);
+
+  static const CTL_TIME_t silent[] = {0};
+  static const CTL_TIME_t regular[] = {0, 20000, 40000, 60000, 80000};
+  static const CTL_TIME_t afterAlive[] = {0, 30000, 56000};
+  static const CTL_TIME_t beforeAlive[] = {0, 53990};
+  scenario(extension, server, "T=60: Alive after 54s, offline after 59s", 60, silent, 1);
+  scenario(extension, server, "T=60: messages every 20s postpone the Alive package and offline", 60, regular, 5);
+  scenario(extension, server, "T=60: a message after the Alive package restarts both deadlines", 60, afterAlive, 3);
+  scenario(extension, server, "T=60: a message shortly before the Alive package moves it", 60, beforeAlive, 2);
+  scenario(extension, server, "T=900: Alive after 810s, offline after 899s", 900, silent, 1);
+  scenario(extension, server, "T=10: Alive and offline after 9s", 10, silent, 1);
+  scenario(extension, server, "T=9: no Alive package, offline after 8s", 9, silent, 1);
+  scenario(extension, server, "T=5: no Alive package, offline after 4s", 5, silent, 1);
+
+  printf("test_offline_timer: %s\n", failed ? "FAILED" : "OK");
+  exit(failed ? 1 : 0);
+}
@@ -0,0 +1,80 @@
+//
+//  test_transmit_reservation.cpp
+//
+//  Created by Markus Fritze on 16.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Reservations of the bulk transmit queue: the reservations of several fragmented packages add up
+//  and only the messages of a package use its reserved entries, other senders only get free entries.
+//  A full bulk queue drops the new message even with eSendPolicy_dropOldest. The crypto handshake
+//  and the legacy config_check_CRC are control messages, a fragmented crypto reply reserves entries
+//  of the control queue.
+//  The test never blocks, so the transmit task of the driver never runs and the queue keeps its content.
+//
+
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+
+static int send(LoxCANQueuedDriver &driver, int count, tTransmitReservation *reservation) {
+  LoxCanMessage msg;
+  msg.busType = LoxCmdNATBus_t_LoxoneLink;
+  msg.directionNat = LoxCmdNATDirection_t_fromDevice;
+  msg.commandNat = Fragment_Data;
+  msg.fragmented = LoxCmdNATPackage_t_fragmented;
+  int queued = 0;
+  for (int i = 0; i < count; ++i)
+    if (driver.SendMessage(msg, eSendPolicy_dropNewest, 0, reservation) == eSendStatus_queued)
+      ++queued;
+  return queued;
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxVirtualCANBus bus(tLoxCANDriverType_LoxoneLink);
+  static LoxCANDriver_VirtualBus driver(tLoxCANDriverType_LoxoneLink, bus);
+  driver.Startup();
+  const unsigned size = driver.TransmitFree(eTransmitClass_bulk);
+
+  tTransmitReservation a = {0}, b = {0}, c = {0};
+  check(driver.TransmitReserve(a, 20, 0) && driver.TransmitReserve(b, 30, 0), "two packages reserve 20 and 30 entries");
+  check(driver.TransmitFree(eTransmitClass_bulk) == size - 50, "the reservations add up");
+  check(send(driver, size, NULL) == (int)size - 50, "other senders only get the free entries");
+  check(!driver.TransmitReserve(c, 1, 0) && c.count == 0, "a third package does not fit");
+  check(send(driver, 20, &a) == 20 && a.count == 0, "the first package uses its reservation");
+  check(send(driver, 1, &a) == 0, "the first package can not use the reservation of the second");
+  check(send(driver, 25, &b) == 25 && b.count == 5, "the second package uses its reservation");
+  driver.TransmitRelease(b);
+  check(b.count == 0 && driver.TransmitFree(eTransmitClass_bulk) == 5, "the unused entries are returned");
+  check(driver.TransmitReserve(c, 5, 0) && driver.TransmitReserve(c, 3, 0) && driver.TransmitFree(eTransmitClass_bulk) == 2, "a new reservation returns the previous one of the same package");
+  driver.TransmitRelease(c);
+  check(send(driver, 5, NULL) == 5 && driver.TransmitFree(eTransmitClass_bulk) == 0, "the queue is full");
+  LoxCanMessage msg;
+  msg.busType = LoxCmdNATBus_t_LoxoneLink;
+  msg.directionNat = LoxCmdNATDirection_t_fromDevice;
+  msg.commandNat = Fragment_Start;
+  msg.fragmented = LoxCmdNATPackage_t_fragmented;
+  check(driver.SendMessage(msg, eSendPolicy_dropOldest) == eSendStatus_dropped, "dropOldest never removes a queued fragment of another package");
+
+  msg.commandNat = CryptoChallengeReply;
+  msg.fragmented = LoxCmdNATPackage_t_standard;
+  LoxCanMessage legacy;
+  legacy.hardwareType = eDeviceType_t_Extension;
+  legacy.directionLegacy = LoxMsgLegacyDirection_t_fromDevice;
+  legacy.commandDirection = LoxMsgLegacyCommandDirection_t_fromDevice;
+  legacy.commandLegacy = config_check_CRC;
+  check(driver.TransmitClass(msg) == eTransmitClass_control && driver.TransmitClass(legacy) == eTransmitClass_control, "the crypto handshake and config_check_CRC are control messages");
+  const unsigned control = driver.TransmitFree(eTransmitClass_control);
+  tTransmitReservation d = {0};
+  check(driver.TransmitReserve(d, 4, 0, LoxCANBaseDriver::FragmentTransmitClass(CryptoChallengeReply)) && driver.TransmitFree(eTransmitClass_control) == control - 4, "a crypto reply reserves entries of the control queue");
+  check(send(driver, 4, &d) == 4 && d.count == 0 && driver.TransmitFree(eTransmitClass_control) == control - 4, "its fragments are queued in the control class, while the bulk class is full");
+
+  printf(failed ? "test_transmit_reservation: FAILED\n" : "test_transmit_reservation: OK\n");
+  exit(failed ? 1 : 0); // the CAN tasks never end
+}
@@ -0,0 +1,244 @@
+//
+//  test_tree_handler_order.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  The driver passes a received message to all of its extensions and the Tree Base Extension to
+//  all of its devices. None of them may change it for the ones after it. Two identical setups get
+//  the same messages of the Miniserver: in the first one the Tree Base Extension is registered before
+//  a NAT extension, in the second one after it, and the devices of the left branch are added in the
+//  opposite order. Every handler has to receive the same messages in both setups, and the Miniserver
+//  the same replies.
+//
+
+#include "LoxBusTreeDevice.hpp"
+#include "LoxBusTreeExtension.hpp"
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "LoxNATExtension.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_NAT_SERIAL 0x123456
+#define TEST_TREE_SERIAL 0x234567
+#define TEST_DEVICE_SERIAL 0xB0300000
+#define TEST_DEVICE_COUNT 3 // two on the left branch, one on the right one
+#define TEST_MAX_MESSAGES 64
+#define TEST_NAT_EXTENSION 0x05
+#define TEST_NAT_TREE 0x06
+#define TEST_NAT_DEVICE 0x41 // the first device of the left branch
+
+class tTestConfig : public tConfigHeader {
+  tConfigHeaderFiller filler;
+};
+
+/***
+ *  The messages received by a handler, in the order of their arrival
+ ***/
+class LoxTestRecord {
+public:
+  int count;
+  LoxCanMessage messages[TEST_MAX_MESSAGES];
+
+  LoxTestRecord()
+    : count(0) {
+  }
+  void Add(const LoxCanMessage &message) {
+    if (this->count < TEST_MAX_MESSAGES)
+      this->messages[this->count++] = message;
+  }
+  bool Equal(const LoxTestRecord &other) const {
+    if (this->count != other.count)
+      return false;
+    for (int i = 0; i < this->count; ++i)
+      if (this->messages[i].identifier != other.messages[i].identifier || memcmp(this->messages[i].can_data, other.messages[i].can_data, sizeof(this->messages[i].can_data)))
+        return false;
+    return true;
+  }
+  // the replies are delayed randomly, so only their content is compared
+  void Sort(void) {
+    for (int i = 1; i < this->count; ++i)
+      for (int j = i; j > 0 && Less(this->messages[j], this->messages[j - 1]); --j) {
+        LoxCanMessage message = this->messages[j];
+        this->messages[j] = this->messages[j - 1];
+        this->messages[j - 1] = message;
+      }
+  }
+  int Find(LoxMsgNATCommand_t command, uint32_t serial) const {
+    int found = 0;
+    for (int i = 0; i < this->count; ++i)
+      found += this->messages[i].commandNat == command && this->messages[i].value32 == serial;
+    return found;
+  }
+
+private:
+  static bool Less(const LoxCanMessage &a, const LoxCanMessage &b) {
+    if (a.identifier != b.identifier)
+      return a.identifier < b.identifier;
+    return memcmp(a.can_data, b.can_data, sizeof(a.can_data)) < 0;
+  }
+};
+
+class LoxTestTreeExtension : public LoxBusTreeExtension {
+public:
+  LoxTestRecord received;
+
+  LoxTestTreeExtension(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxBusTreeExtension(driver, serial, eAliveReason_t_pairing) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    this->received.Add(message);
+    LoxBusTreeExtension::ReceiveMessage(message);
+  }
+};
+
+class LoxTestNATExtension : public LoxNATExtension {
+  tTestConfig config;
+
+public:
+  LoxTestRecord received;
+
+  LoxTestNATExtension(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxNATExtension(driver, serial | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, eAliveReason_t_pairing) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    this->received.Add(message);
+    LoxNATExtension::ReceiveMessage(message);
+  }
+};
+
+class LoxTestTreeDevice : public LoxBusTreeDevice {
+  tTestConfig config;
+
+public:
+  LoxTestRecord received;
+
+  LoxTestTreeDevice(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxBusTreeDevice(driver, serial, eDeviceType_t_TouchTree, 0, 10031114, 1, sizeof(config), &config, eAliveReason_t_pairing) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    this->received.Add(message);
+    LoxBusTreeDevice::ReceiveMessage(message);
+  }
+};
+
+/***
+ *  The Miniserver side of the bus, it records the replies of the extensions and devices. The
+ *  NAT_Index_Request of a device without a NAT is repeated after a random time, it is no reply.
+ ***/
+class LoxTestMiniserver : public LoxExtension {
+public:
+  LoxTestRecord received;
+
+  LoxTestMiniserver(LoxCANBaseDriver &driver)
+    : LoxExtension(driver, 0x0FFFFFF, eDeviceType_t_Miniserver, 0, 0) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    if (message.isNATmessage(this->driver) && message.directionNat == LoxCmdNATDirection_t_fromDevice && message.commandNat != NAT_Index_Request)
+      this->received.Add(message);
+  }
+};
+
+/***
+ *  A Loxone Link with a Tree Base Extension with emulated devices and a NAT extension on one driver
+ ***/
+class LoxTestSetup {
+public:
+  LoxVirtualCANBus bus;
+  LoxCANDriver_VirtualBus serverDriver;
+  LoxCANDriver_VirtualBus extensionDriver;
+  LoxTestMiniserver server;
+  LoxTestTreeExtension *tree;
+  LoxTestNATExtension *nat;
+  LoxTestTreeDevice *devices[TEST_DEVICE_COUNT];
+
+  LoxTestSetup(bool treeFirst)
+    : bus(tLoxCANDriverType_LoxoneLink), serverDriver(tLoxCANDriverType_LoxoneLink, this->bus), extensionDriver(tLoxCANDriverType_LoxoneLink, this->bus), server(this->serverDriver) {
+    if (treeFirst) {
+      this->tree = new LoxTestTreeExtension(this->extensionDriver, TEST_TREE_SERIAL);
+      this->nat = new LoxTestNATExtension(this->extensionDriver, TEST_NAT_SERIAL);
+    } else {
+      this->nat = new LoxTestNATExtension(this->extensionDriver, TEST_NAT_SERIAL);
+      this->tree = new LoxTestTreeExtension(this->extensionDriver, TEST_TREE_SERIAL);
+    }
+    for (int i = 0; i < TEST_DEVICE_COUNT; ++i) {
+      eTreeBranch branch = i < 2 ? eTreeBranch_leftBranch : eTreeBranch_rightBranch;
+      this->devices[i] = new LoxTestTreeDevice(this->tree->Driver(branch), TEST_DEVICE_SERIAL + i);
+    }
+    for (int i = 0; i < TEST_DEVICE_COUNT; ++i) {
+      int device = (treeFirst || i == 2) ? i : 1 - i;
+      this->tree->AddDevice(this->devices[device], device < 2 ? eTreeBranch_leftBranch : eTreeBranch_rightBranch);
+    }
+  }
+  void Startup(void) {
+    this->bus.Startup();
+    this->serverDriver.Startup();
+    this->extensionDriver.Startup();
+  }
+  void Send(LoxMsgNATCommand_t command, uint8_t extensionNat, uint8_t deviceNAT, uint32_t value32, uint8_t data0) {
+    LoxCanMessage message;
+    message.busType = LoxCmdNATBus_t_LoxoneLink;
+    message.directionNat = LoxCmdNATDirection_t_fromServer;
+    message.extensionNat = extensionNat;
+    message.deviceNAT = deviceNAT;
+    message.commandNat = command;
+    message.data[0] = data0;
+    message.value32 = value32;
+    this->serverDriver.SendMessage(message);
+  }
+};
+
+// send the same message of the Miniserver on both Loxone Links and wait for all replies
+static void send(LoxTestSetup &a, LoxTestSetup &b, LoxMsgNATCommand_t command, uint8_t extensionNat, uint8_t deviceNAT, uint32_t value32 = 0, uint8_t data0 = 0) {
+  a.Send(command, extensionNat, deviceNAT, value32, data0);
+  b.Send(command, extensionNat, deviceNAT, value32, data0);
+  ctl_timeout_wait(ctl_get_current_time() + 500);
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxTestSetup treeFirst(true);
+  static LoxTestSetup natFirst(false);
+  treeFirst.Startup();
+  natFirst.Startup();
+  ctl_timeout_wait(ctl_get_current_time() + 100);
+
+  send(treeFirst, natFirst, Search_Devices, 0xFF, 0x00);                            // the extensions
+  send(treeFirst, natFirst, NAT_Offer, 0xFF, 0x00, TEST_NAT_SERIAL | (eDeviceType_t_DIExtension << 24), TEST_NAT_EXTENSION);
+  send(treeFirst, natFirst, NAT_Offer, 0xFF, 0x00, TEST_TREE_SERIAL | (eDeviceType_t_TreeBaseExtension << 24), TEST_NAT_TREE);
+  send(treeFirst, natFirst, Search_Devices, 0xFF, 0xFF);                            // the extensions and all Tree devices
+  send(treeFirst, natFirst, NAT_Offer, TEST_NAT_TREE, 0xFF, TEST_DEVICE_SERIAL, TEST_NAT_DEVICE);
+  send(treeFirst, natFirst, Ping, TEST_NAT_EXTENSION, 0x00);
+  send(treeFirst, natFirst, Ping, TEST_NAT_TREE, 0x00);
+  send(treeFirst, natFirst, Ping, TEST_NAT_TREE, TEST_NAT_DEVICE);
+
+  check(treeFirst.tree->received.count > 0 && treeFirst.tree->received.Equal(natFirst.tree->received), "the Tree Base Extension receives the same messages in both orders");
+  check(treeFirst.nat->received.count > 0 && treeFirst.nat->received.Equal(natFirst.nat->received), "the NAT extension receives the same messages in both orders");
+  bool devicesEqual = true;
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i)
+    devicesEqual = devicesEqual && treeFirst.devices[i]->received.count > 0 && treeFirst.devices[i]->received.Equal(natFirst.devices[i]->received);
+  check(devicesEqual, "every Tree device receives the same messages in both orders");
+
+  treeFirst.server.received.Sort();
+  natFirst.server.received.Sort();
+  check(treeFirst.server.received.Equal(natFirst.server.received), "the Miniserver receives the same replies in both orders");
+  const LoxTestRecord &replies = natFirst.server.received;
+  bool searched = replies.Find(Search_Reply, TEST_NAT_SERIAL | (eDeviceType_t_DIExtension << 24)) == 2 && replies.Find(Search_Reply, TEST_TREE_SERIAL | (eDeviceType_t_TreeBaseExtension << 24)) == 2;
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i)
+    searched = searched && replies.Find(Search_Reply, TEST_DEVICE_SERIAL + i) == 1;
+  check(searched, "both extensions answer both searches, the devices the one addressed to them");
+  int pongs = 0;
+  for (int i = 0; i < replies.count; ++i)
+    pongs += replies.messages[i].commandNat == Pong;
+  check(pongs == 3, "the extensions and the device with its new NAT answer the Ping");
+
+  printf("test_tree_handler_order: %s\n", failed ? "FAILED" : "OK");
+  exit(failed ? 1 : 0);
+}
@@ -0,0 +1,112 @@
+//
+//  test_tree_search.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  A Search_Devices to a Tree Base Extension with the maximum number of emulated devices on both
+//  branches. Every device answers with a randomly delayed Search_Reply, these wait in the Tree Base
+//  Extension and take turns in the queues of the branches, so every reply reaches the Miniserver
+//  once and none is dropped.
+//
+
+#include "LoxBusTreeDevice.hpp"
+#include "LoxBusTreeExtension.hpp"
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_TREE_SERIAL 0x234567
+#define TEST_DEVICE_SERIAL 0xB0300000
+#define TEST_DEVICE_COUNT (2 * MAX_TREE_DEVICECOUNT)
+#define TEST_NAT_TREE 0x06
+#define TEST_NAT_REQUEST_WAIT 600 // broadcasts are received after the first NAT_Index_Request, 10-500ms after the start
+
+class tTestConfig : public tConfigHeader {
+  tConfigHeaderFiller filler;
+};
+
+class LoxTestTreeDevice : public LoxBusTreeDevice {
+  tTestConfig config;
+
+public:
+  LoxTestTreeDevice(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxBusTreeDevice(driver, serial, eDeviceType_t_TouchTree, 0, 10031114, 1, sizeof(config), &config, eAliveReason_t_pairing) {
+  }
+};
+
+/***
+ *  The Miniserver side of the bus, it counts the Search_Reply of every device
+ ***/
+class LoxTestMiniserver : public LoxExtension {
+public:
+  int replies[TEST_DEVICE_COUNT];
+
+  LoxTestMiniserver(LoxCANBaseDriver &driver)
+    : LoxExtension(driver, 0x0FFFFFF, eDeviceType_t_Miniserver, 0, 0) {
+    memset(this->replies, 0, sizeof(this->replies));
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    if (!message.isNATmessage(this->driver) || message.directionNat != LoxCmdNATDirection_t_fromDevice || message.commandNat != Search_Reply)
+      return;
+    uint32_t device = message.value32 - TEST_DEVICE_SERIAL;
+    if (device < TEST_DEVICE_COUNT)
+      ++this->replies[device];
+  }
+};
+
+static LoxVirtualCANBus gLinkBus(tLoxCANDriverType_LoxoneLink);
+static LoxCANDriver_VirtualBus gServerDriver(tLoxCANDriverType_LoxoneLink, gLinkBus);
+static LoxCANDriver_VirtualBus gExtensionDriver(tLoxCANDriverType_LoxoneLink, gLinkBus);
+
+static void send(LoxMsgNATCommand_t command, uint8_t extensionNat, uint8_t deviceNAT, uint32_t value32 = 0, uint8_t data0 = 0) {
+  LoxCanMessage message;
+  message.busType = LoxCmdNATBus_t_LoxoneLink;
+  message.directionNat = LoxCmdNATDirection_t_fromServer;
+  message.extensionNat = extensionNat;
+  message.deviceNAT = deviceNAT;
+  message.commandNat = command;
+  message.data[0] = data0;
+  message.value32 = value32;
+  gServerDriver.SendMessage(message);
+}
+
+static void sleep(CTL_TIME_t ms) {
+  ctl_timeout_wait(ctl_get_current_time() + ms);
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxTestMiniserver server(gServerDriver);
+  static LoxBusTreeExtension tree(gExtensionDriver, TEST_TREE_SERIAL, eAliveReason_t_pairing);
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i) {
+    eTreeBranch branch = i < MAX_TREE_DEVICECOUNT ? eTreeBranch_leftBranch : eTreeBranch_rightBranch;
+    tree.AddDevice(new LoxTestTreeDevice(tree.Driver(branch), TEST_DEVICE_SERIAL + i), branch);
+  }
+  gLinkBus.Startup();
+  gServerDriver.Startup();
+  gExtensionDriver.Startup();
+  sleep(TEST_NAT_REQUEST_WAIT);
+  send(NAT_Offer, 0xFF, 0x00, TEST_TREE_SERIAL | (eDeviceType_t_TreeBaseExtension << 24), TEST_NAT_TREE);
+  sleep(500);
+
+  uint32_t overflows = gExtensionDriver.statistics.QOvf;
+  send(Search_Devices, 0xFF, 0xFF);
+  sleep(2000);
+  bool once = true;
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i)
+    once = once && server.replies[i] == 1;
+  check(once, "every device of both branches answers the search once");
+  check(tree.upstreamStatistics[0].Drop == 0 && tree.upstreamStatistics[1].Drop == 0 && gExtensionDriver.statistics.QOvf == overflows, "no reply is dropped");
+  check(tree.upstreamStatistics[0].Up >= MAX_TREE_DEVICECOUNT && tree.upstreamStatistics[1].Up >= MAX_TREE_DEVICECOUNT, "the replies are forwarded by the queues of the branches");
+
+  printf("test_tree_search: %s\n", failed ? "FAILED" : "OK");
+  exit(failed ? 1 : 0);
+}
@@ -0,0 +1,187 @@
+//
+//  test_tree_shortcut.cpp
+//
+//  Created by Markus Fritze on 19.03.19.
+//  Copyright (c) 2019 Markus Fritze. All rights reserved.
+//
+//  Both Tree buses of a Tree Base Extension wired together: the bridges of both branches and the
+//  devices are nodes of one virtual Tree bus. The Tree_Shortcut_Test of the Miniserver is answered
+//  by the other branch, the first other Miniserver message on the wire is reported as a Tree_Shortcut
+//  and further ones only after TREE_SHORTCUT_REPORT_INTERVAL. While the shortcut exists, a broadcast
+//  is only sent on the left branch, so every device receives it once, and every message of a device
+//  reaches the Loxone Link once, the right bridge drops its copy.
+//  The device drivers are started after the shortcut is known, before it both bridges would forward.
+//
+
+#include "LoxBusTreeBridge.hpp"
+#include "LoxBusTreeDevice.hpp"
+#include "LoxBusTreeExtension.hpp"
+#include "LoxCANDriver_VirtualBus.hpp"
+#include "system.hpp"
+#include "test_check.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_TREE_SERIAL 0x234567
+#define TEST_DEVICE_SERIAL 0xB0300000
+#define TEST_DEVICE_COUNT 4
+#define TEST_NAT_TREE 0x06
+#define TEST_SEARCH_BURST 5 // broadcasts within TREE_SHORTCUT_REPORT_INTERVAL
+#define TEST_NAT_REQUEST_WAIT 600 // broadcasts are received after the first NAT_Index_Request, 10-500ms after the start
+
+class tTestConfig : public tConfigHeader {
+  tConfigHeaderFiller filler;
+};
+
+/***
+ *  Tree device without a NAT, it counts the searches it received
+ ***/
+class LoxTestTreeDevice : public LoxBusTreeDevice {
+  tTestConfig config;
+
+public:
+  int searches;
+
+  LoxTestTreeDevice(LoxCANBaseDriver &driver, uint32_t serial)
+    : LoxBusTreeDevice(driver, serial, eDeviceType_t_TouchTree, 0, 10031114, 1, sizeof(config), &config, eAliveReason_t_pairing), searches(0) {
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    if (message.isNATmessage(this->driver) && message.directionNat == LoxCmdNATDirection_t_fromServer && message.commandNat == Search_Devices)
+      ++this->searches;
+    LoxBusTreeDevice::ReceiveMessage(message);
+  }
+};
+
+/***
+ *  The Miniserver side of the Loxone Link, it counts the messages of every device and the
+ *  shortcut reports of the Tree Base Extension
+ ***/
+class LoxTestMiniserver : public LoxExtension {
+public:
+  int deviceMessages[TEST_DEVICE_COUNT];
+  int shortcuts[2];     // Tree_Shortcut of the left and the right branch
+  int shortcutTests[2]; // Tree_Shortcut_Test answered by the left and the right branch
+  int badShortcuts;     // shortcut messages with a deviceNAT or data
+
+  LoxTestMiniserver(LoxCANBaseDriver &driver)
+    : LoxExtension(driver, 0x0FFFFFF, eDeviceType_t_Miniserver, 0, 0), badShortcuts(0) {
+    memset(this->deviceMessages, 0, sizeof(this->deviceMessages));
+    memset(this->shortcuts, 0, sizeof(this->shortcuts));
+    memset(this->shortcutTests, 0, sizeof(this->shortcutTests));
+  }
+  virtual void ReceiveMessage(const LoxCanMessage &message) {
+    if (!message.isNATmessage(this->driver))
+      return;
+    if (message.directionNat == LoxCmdNATDirection_t_fromServerShortcut) {
+      int left = message.value8 == 0x40;
+      if (message.commandNat == Tree_Shortcut_Test)
+        ++this->shortcutTests[left ? 0 : 1];
+      else if (message.commandNat == Tree_Shortcut)
+        ++this->shortcuts[left ? 0 : 1];
+      if (message.deviceNAT != 0x00 || (message.commandNat == Tree_Shortcut && message.value32 != 0))
+        ++this->badShortcuts;
+    } else if (message.directionNat == LoxCmdNATDirection_t_fromDevice) {
+      uint32_t device = message.value32 - TEST_DEVICE_SERIAL; // NAT_Index_Request and Search_Reply
+      if (device < TEST_DEVICE_COUNT)
+        ++this->deviceMessages[device];
+    }
+  }
+};
+
+static LoxVirtualCANBus gLinkBus(tLoxCANDriverType_LoxoneLink);
+static LoxCANDriver_VirtualBus gServerDriver(tLoxCANDriverType_LoxoneLink, gLinkBus);
+static LoxCANDriver_VirtualBus gExtensionDriver(tLoxCANDriverType_LoxoneLink, gLinkBus);
+
+static void send(LoxMsgNATCommand_t command, uint8_t extensionNat, uint8_t deviceNAT, uint32_t value32 = 0, uint8_t data0 = 0) {
+  LoxCanMessage message;
+  message.busType = LoxCmdNATBus_t_LoxoneLink;
+  message.directionNat = LoxCmdNATDirection_t_fromServer;
+  message.extensionNat = extensionNat;
+  message.deviceNAT = deviceNAT;
+  message.commandNat = command;
+  message.data[0] = data0;
+  message.value32 = value32;
+  gServerDriver.SendMessage(message);
+}
+
+static void sleep(CTL_TIME_t ms) {
+  ctl_timeout_wait(ctl_get_current_time() + ms);
+}
+
+int main(int argc, char *argv[]) {
+  static CTL_TASK_t mainTask;
+  ctl_host_set_clock(CTL_HOST_CLOCK_VIRTUAL);
+  ctl_task_init(&mainTask, 255, "main");
+  ctl_events_init(&gMainEvent, 0);
+
+  static LoxTestMiniserver server(gServerDriver);
+  static LoxBusTreeExtension tree(gExtensionDriver, TEST_TREE_SERIAL, eAliveReason_t_pairing);
+  // one wire for both branches
+  static LoxVirtualCANBus treeBus(tLoxCANDriverType_TreeBus);
+  static LoxCANDriver_VirtualBus leftDriver(tLoxCANDriverType_TreeBus, treeBus);
+  static LoxCANDriver_VirtualBus rightDriver(tLoxCANDriverType_TreeBus, treeBus);
+  static LoxBusTreeBridge left(leftDriver, tree, eTreeBranch_leftBranch);
+  static LoxBusTreeBridge right(rightDriver, tree, eTreeBranch_rightBranch);
+  static LoxCANDriver_VirtualBus *deviceDrivers[TEST_DEVICE_COUNT];
+  static LoxTestTreeDevice *devices[TEST_DEVICE_COUNT];
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i) {
+    deviceDrivers[i] = new LoxCANDriver_VirtualBus(tLoxCANDriverType_TreeBus, treeBus);
+    devices[i] = new LoxTestTreeDevice(*deviceDrivers[i], TEST_DEVICE_SERIAL + i);
+  }
+  gLinkBus.Startup();
+  treeBus.Startup();
+  gServerDriver.Startup();
+  gExtensionDriver.Startup();
+  leftDriver.Startup();
+  rightDriver.Startup();
+  sleep(TEST_NAT_REQUEST_WAIT);
+  send(NAT_Offer, 0xFF, 0x00, TEST_TREE_SERIAL | (eDeviceType_t_TreeBaseExtension << 24), TEST_NAT_TREE);
+  sleep(500);
+
+  // the tests of the Miniserver are sent on one branch and answered by the other one
+  check(!tree.Shortcut(), "no shortcut before a Miniserver message was on the Tree bus");
+  send(Tree_Shortcut_Test, TEST_NAT_TREE, 0x7F); // left branch
+  send(Tree_Shortcut_Test, TEST_NAT_TREE, 0x3F); // right branch
+  sleep(100);
+  check(tree.Shortcut(), "the shortcut is detected");
+  check(right.statistics.STst == 1 && left.statistics.STst == 1, "STst: each branch answers the test sent on the other one");
+  check(server.shortcutTests[1] == 1 && server.shortcutTests[0] == 1, "the answers reach the Miniserver, marked with their branch");
+  check(left.statistics.SRep == 0 && right.statistics.SRep == 0, "SRep: the tests are no shortcut reports");
+
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i)
+    deviceDrivers[i]->Startup();
+  sleep(TEST_NAT_REQUEST_WAIT);
+
+  // a burst of broadcasts is reported once, a later one again
+  for (int i = 0; i < TEST_SEARCH_BURST; ++i) {
+    send(Search_Devices, 0xFF, 0xFF);
+    sleep(150);
+  }
+  check(right.statistics.SRep == 1 && server.shortcuts[1] == 1, "SRep: a burst of broadcasts is reported once");
+  sleep(TREE_SHORTCUT_REPORT_INTERVAL);
+  send(Search_Devices, 0xFF, 0xFF);
+  sleep(500);
+  check(right.statistics.SRep == 2 && server.shortcuts[1] == 2 && left.statistics.SRep == 0 && server.shortcuts[0] == 0, "SRep: the next broadcast after the interval is reported again, only by the other branch");
+  check(server.badShortcuts == 0, "the shortcut messages carry no deviceNAT and no data");
+
+  bool once = true;
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i)
+    once = once && devices[i]->searches == TEST_SEARCH_BURST + 1;
+  check(once, "every device receives every broadcast once");
+
+  // the devices without a NAT keep sending NAT_Index_Request
+  sleep(10000);
+  uint32_t sent = 0;
+  once = true;
+  for (int i = 0; i < TEST_DEVICE_COUNT; ++i) {
+    sent += deviceDrivers[i]->statistics.Sent;
+    once = once && deviceDrivers[i]->statistics.Sent > 1 && server.deviceMessages[i] == (int)deviceDrivers[i]->statistics.Sent;
+  }
+  check(once, "every message of a device reaches the Loxone Link once");
+  check(left.statistics.Up == sent && right.statistics.Up == 0, "only the left bridge forwards the messages of the devices");
+  check(right.statistics.SDup == sent + TEST_SEARCH_BURST + 1, "SDup: the right branch drops the copies of the device messages and of the broadcasts");
+
+  printf("test_tree_shortcut: %s\n", failed ? "FAILED" : "OK");
+  exit(failed ? 1 : 0);
+}